@@ -0,0 +1,34 @@
+#!/bin/bash
+# Times a batch of identical jobs, from their submission (proc-batch) to the end of the last one.
+# Starts its own server, so no other server may be running.
+#
+# usage: bench/batch_bench.sh <config> <tools> <jobs> <input> <operations...>
+# eg.    bench/batch_bench.sh config.conf tools 2000 README.md encrypt decrypt encrypt
+
+if [ $# -lt 5 ]; then
+    echo "usage: $0 <config> <tools> <jobs> <input> <operations...>" >&2
+    exit 1
+fi
+
+CONFIG=$(realpath "$1"); TOOLS=$(realpath "$2"); JOBS=$3; INPUT=$(realpath "$4")
+shift 4
+
+cd "$(dirname "$0")/.." || exit 1
+make -s all && mkdir -p logs || exit 1
+
+OUT=$(mktemp -d)
+trap 'rm -rf "$OUT"' EXIT
+
+for i in $(seq 1 "$JOBS"); do echo "-p 1 $INPUT $OUT/$i $*"; done > "$OUT/manifest"
+
+./sdstored "$CONFIG" "$TOOLS" > "$OUT/server.log" 2>&1 &
+SERVER=$!
+sleep 1
+
+START=$(date +%s%N)
+./sdstore proc-batch "$OUT/manifest" | tail -1
+END=$(date +%s%N)
+
+kill $SERVER; wait $SERVER 2>/dev/null
+
+echo "$JOBS jobs ($*): $(( (END - START) / 1000000 )) ms"
@@ -0,0 +1,34 @@
+#!/bin/bash
+# Throughput of a job's pipeline with the default pipes and with bigger ones ('pipe_size'),
+# in milliseconds per MB of input. Each size runs the same job a few times (see batch_bench.sh).
+#
+# usage: bench/pipe_bench.sh <config> <tools> <input> <pipe_size> <operations...>
+# eg.    bench/pipe_bench.sh config.conf tools big.bin 1048576 encrypt encrypt encrypt
+
+if [ $# -lt 5 ]; then
+    echo "usage: $0 <config> <tools> <input> <pipe_size> <operations...>" >&2
+    exit 1
+fi
+
+CONFIG=$1; TOOLS=$2; INPUT=$3; PIPE_SIZE=$4
+shift 4
+
+RUNS=3
+MB=$(( $(stat -c %s "$INPUT") / 1048576 ))
+[ "$MB" -gt 0 ] || MB=1
+
+SIZED=$(mktemp)
+trap 'rm -f "$SIZED"' EXIT
+
+# The configuration without its own 'pipe_size' line, plus the size under test.
+grep -v '^pipe_size' "$CONFIG" > "$SIZED"
+echo "pipe_size $PIPE_SIZE" >> "$SIZED"
+
+for config in "$CONFIG" "$SIZED"; do
+    [ "$config" = "$CONFIG" ] && label="default pipes" || label="pipe_size $PIPE_SIZE"
+
+    for run in $(seq 1 $RUNS); do
+        ms=$("$(dirname "$0")/batch_bench.sh" "$config" "$TOOLS" 1 "$INPUT" "$@" | sed -n 's/.*: \([0-9]*\) ms$/\1/p')
+        echo "$label: $(awk "BEGIN { printf \"%.2f\", $ms / $MB }") ms/MB"
+    done
+done
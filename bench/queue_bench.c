@@ -0,0 +1,76 @@
+/**
+ * @file queue_bench.c
+ * @author gweebg ; johnny_longo
+ * @brief Microbenchmark of the priority queue (queue.c): pushes jobs with random priorities,
+ * pops them all and checks the order (highest priority first, FIFO within a priority).
+ * Usage: obj/bench/queue_bench [jobs] (100000 by default).
+ * @version 0.1
+ * @date 2022-05-20
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../includes/queue.h"
+
+static double elapsed_ms(struct timespec *start)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    return (end.tv_sec - start->tv_sec) * 1e3 + (end.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+int main(int argc, char **argv)
+{
+    int jobs_len = argc > 1 ? atoi(argv[1]) : 100000;
+    if (jobs_len <= 0)
+    {
+        print_error("usage: queue_bench [jobs]\n");
+        return EXIT_FAILURE;
+    }
+
+    Job *jobs = xmalloc(sizeof(Job) * jobs_len);
+    for (int i = 0; i < jobs_len; i++) jobs[i] = (Job) {.id = i, .priority = rand() % PRIORITY_LEVELS};
+
+    PriorityQueue queue;
+    init_queue(&queue);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (int i = 0; i < jobs_len; i++)
+    {
+        if (!push(&queue, &jobs[i])) return EXIT_FAILURE;
+    }
+
+    double push_ms = elapsed_ms(&start);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    /* Order checked as the jobs are popped: the priorities never go up, the ids of a priority only go up. */
+    long long last_id[PRIORITY_LEVELS];
+    for (int i = 0; i < PRIORITY_LEVELS; i++) last_id[i] = -1;
+
+    int violations = 0, last_priority = PRIORITY_LEVELS;
+    for (int i = 0; i < jobs_len; i++)
+    {
+        Job *job = pop(&queue);
+        if (!job) return EXIT_FAILURE;
+
+        if (job->priority > last_priority || (long long) job->id < last_id[job->priority]) violations++;
+
+        last_id[job->priority] = job->id;
+        last_priority = job->priority;
+    }
+
+    double pop_ms = elapsed_ms(&start);
+
+    printf("%d jobs: push %.3f ms, pop %.3f ms, order violations %d, left %d\n", jobs_len, push_ms, pop_ms, violations, queue.size);
+
+    free(jobs);
+    return violations == 0 && is_empty(&queue) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,92 @@
+/**
+ * @file spawn_bench.c
+ * @author gweebg ; johnny_longo
+ * @brief Microbenchmark of the start of a pipeline stage (see spawn_tool in execute.c): fork and
+ * exec against posix_spawn of a tool, from a process whose heap has the given size (touched, so
+ * fork has page tables to copy). The tool reads /dev/null and writes to /dev/null.
+ * Usage: obj/bench/spawn_bench [heap_mb] [tool] (8 and tools/nop by default).
+ * @version 0.1
+ * @date 2022-06-03
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include <spawn.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "../includes/utils.h"
+
+/* Tools started by each method. */
+#define SPAWNS 500
+
+extern char **environ;
+
+static double elapsed_us(struct timespec *start)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    return (end.tv_sec - start->tv_sec) * 1e6 + (end.tv_nsec - start->tv_nsec) / 1e3;
+}
+
+int main(int argc, char **argv)
+{
+    size_t heap_size = (size_t) (argc > 1 ? atoi(argv[1]) : 8) << 20;
+    char *tool = argc > 2 ? argv[2] : "tools/nop";
+    char *args[] = {tool, NULL};
+
+    char *heap = xmalloc(heap_size);
+    memset(heap, 1, heap_size);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (int i = 0; i < SPAWNS; i++)
+    {
+        pid_t pid = fork();
+        if (pid < 0) return EXIT_FAILURE;
+
+        if (pid == 0)
+        {
+            int null_fd = open("/dev/null", O_RDWR);
+            if (null_fd < 0 || dup2(null_fd, STDIN_FILENO) < 0 || dup2(null_fd, STDOUT_FILENO) < 0) _exit(DUP2_ERROR);
+
+            execv(tool, args);
+            _exit(EXEC_ERROR);
+        }
+
+        waitpid(pid, NULL, 0);
+    }
+
+    double fork_us = elapsed_us(&start) / SPAWNS;
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (int i = 0; i < SPAWNS; i++)
+    {
+        pid_t pid;
+        if (posix_spawn(&pid, tool, &actions, NULL, args, environ) != 0) return EXIT_FAILURE;
+
+        waitpid(pid, NULL, 0);
+    }
+
+    double spawn_us = elapsed_us(&start) / SPAWNS;
+    posix_spawn_file_actions_destroy(&actions);
+
+    printf("heap %zu MB: fork+exec %.0f us, posix_spawn %.0f us (%s, %d starts each)\n", heap_size >> 20, fork_us, spawn_us, tool, SPAWNS);
+
+    free(heap);
+    return EXIT_SUCCESS;
+}
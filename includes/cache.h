@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "server.h"
+
+/* Directory where cached outputs are stored, one file per key. */
+#define CACHE_DIR "tmp/cache"
+
+/* Size of a cache key string (including the '\0'): SHA-256, input size and up to MAX_OPERATIONS operations. */
+#define CACHE_KEY_SIZE (2 * 32 + 2 + 16 + MAX_OPERATIONS + 1)
+
+/**
+ * @brief Counters of the result cache, shared between every process of the server.
+ * 
+ * @param hits Number of jobs whose output was materialized from the cache.
+ * @param misses Number of jobs that had to be executed.
+ */
+typedef struct cache_stats
+{
+    long hits,
+         misses;
+
+} CacheStats;
+
+void cache_init(long long budget);
+
+bool cache_enabled();
+
+CacheStats *cache_get_stats();
+
+int cache_key(Job job, char *key);
+
+bool cache_fetch(char *key, Job job);
+
+void cache_store(char *key, int output_fd);
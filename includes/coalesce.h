@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "server.h"
+
+/* Initial number of buckets of the coalesce map (a power of two). */
+#define COALESCE_MAP_SIZE 1024
+
+/**
+ * @brief Hash map from coalesce key to the jobs identical jobs can wait for (queued or executing,
+ * see coalesce_key in server.c), chained through the jobs themselves ('coalesce_next'), so adding,
+ * finding and removing a job are O(1). Several jobs may share a key (eg. a new job of a higher
+ * priority than the queued one doesn't wait for it). Grows to keep at most one job per bucket.
+ *
+ * @param buckets First job of each bucket, 'capacity' of them.
+ * @param capacity Number of buckets (a power of two).
+ * @param size Number of jobs.
+ * @param shift Shift of the hash (64 - log2(capacity)).
+ */
+typedef struct coalesce_map
+{
+    Job **buckets;
+
+    size_t capacity,
+           size;
+
+    int shift;
+
+} CoalesceMap;
+
+void coalesce_map_init(CoalesceMap *map);
+
+void coalesce_map_add(CoalesceMap *map, Job *job);
+
+void coalesce_map_remove(CoalesceMap *map, Job *job);
+
+Job *coalesce_map_find(CoalesceMap *map, Job *job);
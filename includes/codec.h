@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "server.h"
+
+/* Size of the buffers used to stream data between in-process stages. */
+#define CODEC_BUFSIZ (256 * 1024)
+
+/* Inputs are split in segments of (at least) this size to be compressed in parallel. */
+#define SEGMENT_SIZE (32 * 1024 * 1024)
+
+/* Maximum number of segments (processes) used to compress a single input. */
+#define MAX_SEGMENTS 16
+
+/* Directory where the compressed segments are stored until they are concatenated. */
+#define SEGMENT_DIR  "tmp"
+
+/**
+ * @brief Operations that can be executed inside the worker process (no fork/exec).
+ * @param CODEC_NONE The operation is not known by the codec engine (must be exec'd).
+ * @param CODEC_NOP Copies the input as is.
+ * @param CODEC_GCOMPRESS Compresses with the gzip format (zlib).
+ * @param CODEC_GDECOMPRESS Decompresses gzip members (zlib).
+ * @param CODEC_BCOMPRESS Compresses with the bzip2 format (libbz2).
+ * @param CODEC_BDECOMPRESS Decompresses bzip2 streams (libbz2).
+ */
+typedef enum
+{
+    CODEC_NONE = -1,
+    CODEC_NOP,
+    CODEC_GCOMPRESS,
+    CODEC_GDECOMPRESS,
+    CODEC_BCOMPRESS,
+    CODEC_BDECOMPRESS
+
+} Codec;
+
+Codec codec_from_operation(Operation operation);
+
+int codec_run(Codec *codecs, int codecs_len, int in_fd, int out_fd, StageStats *stats);
+
+int codec_run_segments(Codec codec, int in_fd, int out_fd, int segments, StageStats *stats);
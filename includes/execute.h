@@ -2,4 +2,4 @@
 
 #include "server.h"
 
-void execute(Job job);
\ No newline at end of file
+int execute(Job job, char *exec_path, int pipe_size, char *cache_id);
\ No newline at end of file
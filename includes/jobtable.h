@@ -0,0 +1,105 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "server.h"
+
+/* Initial number of slots of the job table (a power of two). */
+#define JOB_TABLE_SIZE 1024
+
+/**
+ * @brief Client waiting for a job to end (sdstore wait).
+ * @param client Connection of the client (holds a reference).
+ * @param next Next waiter of the same job.
+ */
+typedef struct waiter
+{
+    Connection *client;
+    struct waiter *next;
+
+} Waiter;
+
+/**
+ * @brief State of a job, from the moment it reaches the scheduler until its result expires.
+ * @param id Job id (0 marks an empty slot).
+ * @param status Current status (COMPLETED or FAILED once the job ended).
+ * @param job The job while it is queued or executing, NULL once it ended.
+ * @param result Message sent when the job ended, NULL while it runs.
+ * @param ended_at When the job ended.
+ * @param waiters Clients waiting for the job to end.
+ */
+typedef struct job_record
+{
+    uint64_t id;
+    Status status;
+
+    Job *job;
+
+    char *result;
+    time_t ended_at;
+
+    Waiter *waiters;
+
+} JobRecord;
+
+/**
+ * @brief Job that ended, in the order the jobs ended (to expire the results).
+ * @param id Job id.
+ * @param ended_at When the job ended.
+ */
+typedef struct ended_job
+{
+    uint64_t id;
+    time_t ended_at;
+
+} EndedJob;
+
+/**
+ * @brief Hash table from job id to job state (open addressing, linear probing), so insert,
+ * lookup, state change and delete are O(1). Kept at most half full. The records move when
+ * the table grows or a record is deleted, so pointers to them are only valid until then.
+ *
+ * @param slots Records, 'capacity' of them.
+ * @param capacity Number of slots (a power of two).
+ * @param size Number of records.
+ * @param shift Shift of the hash (64 - log2(capacity)).
+ * @param ended Ring of the ended jobs, oldest first.
+ * @param ended_head Index of the oldest ended job.
+ * @param ended_size Number of ended jobs in the ring.
+ * @param ended_capacity Size of the 'ended' ring.
+ * @param retention Seconds a result is kept after the job ends.
+ */
+typedef struct job_table
+{
+    JobRecord *slots;
+
+    size_t capacity,
+           size;
+
+    int shift;
+
+    EndedJob *ended;
+
+    size_t ended_head,
+           ended_size,
+           ended_capacity;
+
+    int retention;
+
+} JobTable;
+
+void job_table_init(JobTable *table, int retention);
+
+JobRecord *job_table_add(JobTable *table, Job *job);
+
+JobRecord *job_table_get(JobTable *table, uint64_t id);
+
+void job_table_delete(JobTable *table, uint64_t id);
+
+void job_table_set_ended(JobTable *table, JobRecord *record, char *result, Status status);
+
+void job_table_expire(JobTable *table, time_t now);
+
+Job **job_table_jobs(JobTable *table, Status status, size_t *jobs_len);
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "server.h"
+#include "utils.h"
+#include "queue.h"
+
+/* File where the metrics are exported (Prometheus text format, replaced as a whole on each export). */
+#define METRICS_PATH "logs/metrics.prom"
+
+/* Milliseconds between two exports of the metrics, unless the configuration has a 'metrics' line. */
+#define DEFAULT_METRICS_INTERVAL 10000
+
+/* Each power of two of a histogram is split in 2^HISTOGRAM_SUB_BITS buckets (the width of a bucket is at most 1/4 of its values). */
+#define HISTOGRAM_SUB_BITS 2
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+
+/* Powers of two covered by a histogram, bigger values are only counted in its total (the +Inf bucket). */
+#define HISTOGRAM_OCTAVES 40
+
+#define HISTOGRAM_BUCKETS (HISTOGRAM_SUB_BUCKETS * (HISTOGRAM_OCTAVES + 1))
+
+/* Powers of two between two exported buckets: the exported ones are a fixed, coarser ladder of the kept ones. */
+#define HISTOGRAM_EXPORT_STEP 2
+
+/**
+ * @brief Log-linear histogram (HDR style) of non negative integer values: every power of two
+ * is split in HISTOGRAM_SUB_BUCKETS buckets of the same width, so the relative error is bounded
+ * whatever the magnitude of the values.
+ *
+ * @param buckets Number of values of each bucket (see histogram_bucket in metrics.c).
+ * @param count Number of values (including the ones above the last bucket).
+ * @param sum Sum of the values.
+ */
+typedef struct histogram
+{
+    long long buckets[HISTOGRAM_BUCKETS],
+              count,
+              sum;
+
+} Histogram;
+
+void metrics_job_submitted(Job *job);
+
+void metrics_job_ended(Job *job, bool completed, long long now);
+
+void metrics_slot_denied();
+
+void metrics_export(int queued, int executing, int *resources, Configuration config);
@@ -0,0 +1,34 @@
+#pragma once
+
+/**
+ * @brief Node of a MPSC queue, embedded as the first member of the queued structures.
+ * @param next Next (newer) node of the queue.
+ */
+typedef struct mpsc_node
+{
+    struct mpsc_node *next;
+
+} MPSCNode;
+
+/**
+ * @brief Lock-free multiple producer, single consumer queue (intrusive, unbounded).
+ * Producers only do an atomic exchange, the consumer never blocks them.
+ *
+ * @param head Newest node (where producers push).
+ * @param tail Oldest node (where the consumer pops).
+ * @param stub Placeholder node, keeps the queue non-empty.
+ */
+typedef struct mpsc_queue
+{
+    MPSCNode *head,
+             *tail;
+
+    MPSCNode stub;
+
+} MPSCQueue;
+
+void mpsc_init(MPSCQueue *queue);
+
+void mpsc_push(MPSCQueue *queue, MPSCNode *node);
+
+MPSCNode *mpsc_pop(MPSCQueue *queue);
@@ -0,0 +1,6 @@
+#pragma once
+
+#include "server.h"
+#include "utils.h"
+
+void plan_job(Job *job, Configuration config);
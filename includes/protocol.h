@@ -0,0 +1,102 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "server.h"
+
+/* Version of the client to server protocol, frames with any other version are rejected. */
+#define PROTOCOL_VERSION 2
+
+/* Listening socket of the server (SOCK_SEQPACKET, one frame per packet). */
+#define SOCKET_PATH "tmp/sdstore.sock"
+
+/* Maximum size of a frame (and of a request packet). */
+#define FRAME_MAX_SIZE 4096
+
+/* Maximum size of a message sent to a client (one packet). */
+#define MESSAGE_MAX_SIZE (64 * 1024)
+
+/* Size of the frame header: payload length (4 bytes), version (1 byte), type (1 byte), flags (1 byte), reserved (1 byte). */
+#define FRAME_HEADER_SIZE 8
+
+/* Flag of MSG_PROC_FILE: the client doesn't wait for the job (the job isn't dropped when it leaves). */
+#define FRAME_FLAG_DETACH 0x01
+
+/* Flags of MSG_PROC_FILE: the input (output) is a file descriptor passed along with the frame (SCM_RIGHTS)
+instead of a path. When both are set the input descriptor comes first. */
+#define FRAME_FLAG_STREAM_IN  0x02
+#define FRAME_FLAG_STREAM_OUT 0x04
+
+/* Bits of the flags of MSG_PROC_FILE holding the durability of the output (see Durability). */
+#define FRAME_DURABILITY_SHIFT 3
+#define FRAME_DURABILITY_MASK  0x18
+
+/* Maximum number of file descriptors passed with a frame. */
+#define FRAME_MAX_FDS 2
+
+/* Maximum number of job ids of a MSG_WAIT request. */
+#define MAX_WAIT_IDS 500
+
+/**
+ * @brief Types of the messages sent by the clients.
+ * @param MSG_HELP Help menu request.
+ * @param MSG_STATUS Server status request.
+ * @param MSG_PROC_FILE Job submission.
+ * @param MSG_WAIT Waits for one or more jobs to end.
+ * @param MSG_POLL Current state of a job.
+ * @param MSG_CANCEL Cancels a queued or executing job.
+ */
+typedef enum
+{
+    MSG_HELP = 1,
+    MSG_STATUS,
+    MSG_PROC_FILE,
+    MSG_WAIT,
+    MSG_POLL,
+    MSG_CANCEL
+
+} MessageType;
+
+/**
+ * @brief Decoded client request. The strings point inside the decoded frame.
+ * @param type Type of the message.
+ * @param priority Priority of the job (MSG_PROC_FILE only).
+ * @param op_len Number of operations (MSG_PROC_FILE only).
+ * @param operations Operations of the job (MSG_PROC_FILE only).
+ * @param from Input path (MSG_PROC_FILE only).
+ * @param to Output path (MSG_PROC_FILE only).
+ * @param detach Whether the client doesn't wait for the job (MSG_PROC_FILE only).
+ * @param stream_in Whether the input is a descriptor passed with the frame, 'from' is then only shown (MSG_PROC_FILE only).
+ * @param stream_out Whether the output is a descriptor passed with the frame, 'to' is then only shown (MSG_PROC_FILE only).
+ * @param durability How the output file is flushed (MSG_PROC_FILE only).
+ * @param ids_len Number of job ids (MSG_WAIT, MSG_POLL and MSG_CANCEL, the last two have a single one).
+ * @param ids Job ids (MSG_WAIT, MSG_POLL and MSG_CANCEL).
+ */
+typedef struct request
+{
+    MessageType type;
+
+    int priority,
+        op_len;
+
+    Operation operations[MAX_OPERATIONS];
+
+    char *from,
+         *to;
+
+    bool detach,
+         stream_in,
+         stream_out;
+
+    Durability durability;
+
+    int ids_len;
+    uint64_t ids[MAX_WAIT_IDS];
+
+} Request;
+
+int protocol_encode(Request *request, char *frame);
+
+int protocol_decode(char *buffer, size_t available, Request *request, int *frame_size);
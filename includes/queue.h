@@ -1,16 +1,48 @@
 #pragma once
 
 #include "server.h"
+#include "utils.h"
+
+/* Number of priority levels (priorities go from 0 to PRIORITY_LEVELS - 1). */
+#define PRIORITY_LEVELS 6
+
+/* Initial capacity of each priority level, grows as needed. */
+#define BUCKET_SIZE 64
+
+/* Maximum number of queued jobs looked at when searching for a job that fits the free resources. */
+#define BACKFILL_WINDOW 64
+
+/* Number of times a job can be overtaken before the resources it needs are reserved for it. */
+#define BACKFILL_SKIPS 8
 
 /**
- * @brief Priority queue implementation using an array.
+ * @brief FIFO ring buffer holding the jobs of a single priority level.
  * 
- * @param values Array of Input structs, one for each job.
+ * @param values Circular array of jobs.
+ * @param head Index of the oldest job.
+ * @param size Number of jobs in the ring.
+ * @param capacity Size of the 'values' array.
+ */
+typedef struct bucket
+{
+    Job **values;
+
+    int head,
+        size,
+        capacity;
+
+} Bucket;
+
+/**
+ * @brief Priority queue implementation using one FIFO ring per priority level.
+ * Push and pop are O(1) and jobs with the same priority leave in the order they arrived.
+ * 
+ * @param buckets One ring per priority level.
  * @param size Size of the queue.
  */
 typedef struct PriorityQueue 
 {
-    PreProcessedInput *values;
+    Bucket buckets[PRIORITY_LEVELS];
     int size;
 
 } PriorityQueue;
@@ -19,11 +51,16 @@ void init_queue(PriorityQueue *queue);
 
 bool is_empty(PriorityQueue *queue);
 
-int compare_input(const void *a, const void *b);
+bool push(PriorityQueue *queue, Job *input);
 
-void push(PriorityQueue *queue, PreProcessedInput input);
+Job *pop(PriorityQueue *queue);
 
-PreProcessedInput pop(PriorityQueue *queue);
+Job *pop_fitting(PriorityQueue *queue, Configuration config, int *in_use_operations);
 
-/* void dump_ops(Input s); */
+Job *peek_priority(PriorityQueue *queue, int priority);
 
+bool remove_job(PriorityQueue *queue, Job *job);
+
+int peek_jobs(PriorityQueue *queue, Job **jobs, int max);
+
+/* void dump_ops(Input s); */
@@ -1,11 +1,11 @@
 #pragma once
 
-#define POP -22
-#define EMPTY -30
-#define STAT -27
-#define UPDATE_ADD -31
-#define UPDATE_DEL -32
-#define CHECK_RESOURCES -33
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "mpsc.h"
 
 /**
  * @brief Status enum that describes the progress of a job.
@@ -13,6 +13,8 @@
  * @param QUEUED The job has been queued and it's waiting to be executed.
  * @param EXECUTING The job is being currently executed.
  * @param COMPLETED The job has finished executing and it's output is available.
+ * @param FAILED The job ended without producing its output.
+ * @param HELP, STATUS, WAIT, POLL, CANCEL Kinds of the other requests (see Submission).
  */
 typedef enum
 {
@@ -20,53 +22,266 @@ typedef enum
     QUEUED,
     EXECUTING,
     COMPLETED,
+    FAILED,
     HELP,
-    STATUS
+    STATUS,
+    WAIT,
+    POLL,
+    CANCEL
 
 } Status;
 
+/* Maximum number of operations of a single job. */
+#define MAX_OPERATIONS 64
+
+/* Maximum number of requests read from one connection before serving the others. */
+#define RECV_BATCH 64
+
+/* Bytes of messages queued for a client that doesn't read them, past which its connection is dropped. */
+#define CLIENT_QUEUE_MAX (1 << 20)
+
+/* Number of queued jobs, the next ones to be dispatched, whose input is prefetched (see the 'prefetch' setting). */
+#define PREFETCH_JOBS 8
+
+/* Bytes asked to be read ahead per call, the kernel caps a single request to the device readahead size. */
+#define PREFETCH_CHUNK (2 * 1024 * 1024)
+
 /**
- * @brief PreProcessedInput struct, a structure that contains a job with only its priority parsed.
- * @param priority The priority of the job.
- * @param id The job id.
- * @param desc The job description in string format (what comes through the named pipe).
- * @param valid Indicates whether the job is valid of not.
+ * @brief Operations supported by the server, in the order of the resources array.
+ * @param OP_COUNT Number of operations (size of a resources array).
  */
-typedef struct ppinput
+typedef enum
 {
-    char *desc;
-    char *fifo;
-    
-    int priority, 
-        id, 
-        valid;
+    OP_NOP,
+    OP_GCOMPRESS,
+    OP_GDECOMPRESS,
+    OP_BCOMPRESS,
+    OP_BDECOMPRESS,
+    OP_ENCRYPT,
+    OP_DECRYPT,
+    OP_COUNT
 
-    Status status;
+} Operation;
+
+/**
+ * @brief How an output file is flushed to the disk before being published (renamed to its path).
+ * @param DURABILITY_NONE Not flushed, the kernel writes it back whenever it wants (default).
+ * @param DURABILITY_FDATASYNC Flushed with fdatasync, then the rename is flushed too (the output survives a crash).
+ * @param DURABILITY_BATCH Written back while the job runs, every SYNC_BATCH_SIZE bytes (sync_file_range),
+ * and waited for at the end, without flushing the metadata (no dirty pages pile up, no fsync).
+ */
+typedef enum
+{
+    DURABILITY_NONE,
+    DURABILITY_FDATASYNC,
+    DURABILITY_BATCH
+
+} Durability;
+
+/* Bytes written by a job (DURABILITY_BATCH) between two write backs. */
+#define SYNC_BATCH_SIZE (8 * 1024 * 1024)
+
+/* Milliseconds between two checks of the bytes written by a job (DURABILITY_BATCH). */
+#define SYNC_BATCH_INTERVAL 100
+
+/* Milliseconds between two progress messages of an executing job, unless the configuration has a 'progress' line. */
+#define DEFAULT_PROGRESS_INTERVAL 1000
+
+/**
+ * @brief Statistics of a stage (process) of the pipeline of a job.
+ * @param first Index of the first operation run by the stage.
+ * @param ops Number of operations run by the stage (consecutive in-process operations share one).
+ * @param pid Exec'd tool of the stage while it runs (its reads are sampled for the progress of the job), 0 otherwise.
+ * @param bytes_in Bytes read by the stage (an exec'd tool also counts what it reads while loading, a few KB).
+ * In-process stages update it as they go, an exec'd tool only once it ended.
+ * @param bytes_out Bytes written by the stage.
+ * @param wall_us Wall time of the stage, in microseconds.
+ * @param cpu_us CPU time (user and system) of the stage and of the processes it waited for, in microseconds.
+ */
+typedef struct stage_stats
+{
+    int first,
+        ops,
+        pid;
+
+    long long bytes_in,
+              bytes_out,
+              wall_us,
+              cpu_us;
+
+} StageStats;
+
+/**
+ * @brief Statistics of the execution of a job, filled by the process of the job (see execute)
+ * in memory shared with the server.
+ * @param stages_len Number of stages, 0 if the output was copied (cache, no operations left).
+ * @param keep_output Set by the server while identical jobs wait for this one: the published
+ * output is then also linked aside for them (see keep_output in utils.c).
+ * @param output_kept Set by the process of the job once its output was linked aside.
+ * @param unpublished Set by the server when the job was cancelled while identical jobs wait for
+ * it: the output is only kept for them, not published.
+ * @param input_size Size of the input, 0 if unknown (eg. streamed input).
+ * @param stages Statistics of each stage.
+ */
+typedef struct job_stats
+{
+    int stages_len;
+    bool keep_output,
+         output_kept,
+         unpublished;
+    long long input_size;
+    StageStats stages[MAX_OPERATIONS];
+
+} JobStats;
+
+/**
+ * @brief Message that couldn't be sent to a client yet (its socket was full), one packet.
+ */
+typedef struct queued_message
+{
+    struct queued_message *next;
+    size_t length;
+    char content[];
+
+} QueuedMessage;
+
+/**
+ * @brief Connection of a client (SOCK_SEQPACKET socket), shared by the receiver thread, the
+ * scheduler and the jobs of the client. Closed when the last reference is released.
+ * @param fd Socket of the connection.
+ * @param refs Number of references (updated atomically).
+ * @param flush_fd Eventfd of the receiver thread, signaled when a message is queued (it then waits for POLLOUT).
+ * @param closed Whether the client has gone away (set by the receiver thread).
+ * @param uid User of the client process (SO_PEERCRED), only that user (or root) cancels its jobs.
+ * @param requests Number of requests received (by the receiver thread), a refusal carries the position of its request.
+ * @param lock Protects the queued messages (both threads send messages).
+ * @param queue Messages not sent yet, in order (sent by the receiver thread, see flush_client_messages).
+ * @param queue_tail Last queued message.
+ * @param queued_bytes Bytes of the queued messages (read without the lock to know whether to wait for POLLOUT).
+ */
+typedef struct connection
+{
+    int fd,
+        refs,
+        flush_fd;
+
+    bool closed;
+
+    uid_t uid;
 
-} PreProcessedInput;
+    uint64_t requests;
+
+    pthread_mutex_t lock;
+    QueuedMessage *queue,
+                  *queue_tail;
+    size_t queued_bytes;
+
+} Connection;
 
 /**
- * @brief Input data structure.
- * @param operations Array containing every operation to be executed on the file.
+ * @brief Job record, parsed once when the request is received and passed as is to every stage.
+ * @param operations Operations to be executed on the file (planned, see planner.c).
  * @param from Input path.
  * @param to Output path.
- * @param priority Priority of the job.
+ * @param client Connection of the client that submitted the job (holds a reference).
+ * @param in_fd Input descriptor passed by the client (streamed input), -1 if the job reads 'from'.
+ * @param out_fd Output descriptor passed by the client (streamed output), -1 if the job writes 'to'.
+ * @param desc Description string of the job (the request, shown by status).
  * @param status Enum with the current status of the job.
- * @param desc Description string of the job.
- * @param id Job id.
- * @param valid Boolean value that represents whether a job is valid or not.
+ * @param id Job id, given by the server (increasing, never reused).
  * @param op_len Number of operations of the job.
+ * @param segments Number of parallel segments used by the first operation (1 if not split).
+ * @param priority Priority of the job.
+ * @param skipped Number of times jobs behind this one were dispatched while it was waiting for resources.
+ * @param detached Whether the client doesn't wait for the job (it runs even if the client leaves).
+ * @param cancelled Whether the job was cancelled while executing (its processes were killed).
+ * @param stopped Whether the job is stopped by a priority 5 job (preemption), its resources are then free.
+ * @param orphaned Whether the job was cancelled while executing for identical jobs too: it already
+ * ended for its client, the execution goes on (without publishing its output) for the others.
+ * @param durability How the output file is flushed before being published (see Durability).
+ * @param resources Resources (slots of each operation) of the planned job.
+ * @param prefetched Bytes of the input asked to be read ahead while the job is queued, 0 if none.
+ * @param pid Process executing the job, or copying its output for coalesced jobs (only while running).
+ * It leads a process group with every process of the job.
+ * @param queued When the job was queued (milliseconds, see monotonic_ms).
+ * @param started When the job started executing (milliseconds, see monotonic_ms), 0 if it didn't.
+ * @param stats Statistics of the execution (shared mapping, see start_job in server.c), NULL until the job starts.
+ * @param worker_fds Sockets of the warm workers running the operations (see worker.c), -1 for the
+ * operations executed by a new process.
+ * @param coalesce_key Key of the identical jobs (see coalesce_key in server.c), NULL if none.
+ * @param coalesce_hash Hash of the coalesce key (see coalesce.c).
+ * @param coalesce_next Next job of the same bucket of the coalesce map.
+ * @param followers Identical jobs waiting for this one to finish.
+ * @param leader Job this one waits for, NULL if none.
+ * @param next Next job of a followers list.
  */
 typedef struct job 
 {
-    char **operations;
+    Operation operations[MAX_OPERATIONS];
 
     char *from,
          *to,
-         *fifo,
          *desc;
 
+    struct connection *client;
+
+    int in_fd,
+        out_fd;
+
     Status status;
 
-    int op_len;
+    uint64_t id;
+
+    int op_len,
+        segments,
+        priority,
+        skipped;
+
+    bool detached,
+         cancelled,
+         stopped,
+         orphaned;
+
+    Durability durability;
+
+    int resources[OP_COUNT];
+
+    long long prefetched;
+
+    int pid;
+
+    int worker_fds[MAX_OPERATIONS];
+
+    long long queued,
+              started;
+    JobStats *stats;
+
+    char *coalesce_key;
+    uint64_t coalesce_hash;
+
+    struct job *coalesce_next,
+               *followers,
+               *leader,
+               *next;
 } Job;
+
+/**
+ * @brief Request handed by the receiver thread to the scheduler through the submission queue.
+ * @param node Link of the submission queue (must be the first member).
+ * @param status Kind of request (PENDING for jobs, STATUS, WAIT, POLL or CANCEL for the other requests).
+ * @param job The parsed job (PENDING only).
+ * @param client Connection of the client (all but PENDING, holds a reference).
+ * @param ids_len Number of job ids (WAIT, POLL and CANCEL only).
+ * @param ids Job ids (WAIT, POLL and CANCEL only).
+ */
+typedef struct submission
+{
+    MPSCNode node;
+    Status status;
+    Job *job;
+    Connection *client;
+
+    int ids_len;
+    uint64_t ids[];
+
+} Submission;
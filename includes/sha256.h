@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Size of a SHA-256 digest, in bytes. */
+#define SHA256_SIZE 32
+
+/**
+ * @brief SHA-256 of a stream of bytes, fed in buffers of any size.
+ *
+ * @param state Hash of the blocks already processed.
+ * @param length Number of bytes fed so far.
+ * @param block Bytes of the block being filled ('length' % 64 of them).
+ */
+typedef struct sha256
+{
+    uint32_t state[8];
+    uint64_t length;
+    unsigned char block[64];
+
+} SHA256;
+
+void sha256_init(SHA256 *sha);
+
+void sha256_update(SHA256 *sha, const void *data, size_t size);
+
+void sha256_final(SHA256 *sha, unsigned char digest[SHA256_SIZE]);
@@ -1,7 +1,8 @@
 #include <stdlib.h>
 #include <stdbool.h>
 
-#include "llist.h"
+#include "cache.h"
+#include "jobtable.h"
 
 #pragma once
 
@@ -15,9 +16,13 @@
 #define PIPE_ERROR   8
 #define DUP2_ERROR   9
 #define EXEC_ERROR   10
+#define CODEC_ERROR  11
 
 #define QSIZE        1024
 
+/* Seconds the result of a job is kept for wait/poll, unless the configuration has a 'retention' line. */
+#define DEFAULT_RETENTION 600
+
 /**
  * @brief Struct that stores the number of times an operation can run at the same time.
  * 
@@ -28,6 +33,14 @@
  * @param gdecompress
  * @param encrypt
  * @param decrypt
+ * @param cache_size Maximum size in bytes of the result cache, 0 disables it (optional 'cache' line).
+ * @param retention Seconds the result of a job is kept for wait/poll (optional 'retention' line).
+ * @param preemption Whether priority 5 jobs stop lower priority jobs to get their resources (optional 'preemption' line, 0 or 1).
+ * @param workers Whether the tools run as warm workers, when they support it (optional 'workers' line, 0 or 1).
+ * @param prefetch_size Maximum bytes of the inputs of queued jobs read ahead into the page cache, 0 disables it (optional 'prefetch' line).
+ * @param pipe_size Size in bytes of the pipes between the stages of a job, 0 keeps the system default (optional 'pipe_size' line).
+ * @param progress_interval Milliseconds between two progress messages of an executing job, 0 disables them (optional 'progress' line).
+ * @param metrics_interval Milliseconds between two exports of the metrics, 0 disables them (optional 'metrics' line).
  */
 typedef struct config
 {
@@ -39,11 +52,40 @@ typedef struct config
         encrypt,
         decrypt;
 
+    long long cache_size;
+
+    int retention;
+
+    bool preemption,
+         workers;
+
+    long long prefetch_size;
+
+    int pipe_size,
+        progress_interval,
+        metrics_interval;
+
 } Configuration;
 
 Configuration generate_config(char *path);
 
-int total_operations(char *string);
+const char *operation_name(Operation operation);
+
+Operation operation_from_name(char *name);
+
+int copy_file(int in_fd, int out_fd);
+
+void output_temp_path(char *dest, const char *path, uint64_t id);
+
+int open_output(const char *path, uint64_t id, bool *temporary);
+
+int publish_output(int fd, const char *path, uint64_t id, Durability durability, bool temporary);
+
+void discard_output(const char *path, uint64_t id);
+
+int keep_output(const char *path, uint64_t id);
+
+int open_kept_output(const char *path, uint64_t id);
 
 void *xmalloc(size_t size);
 
@@ -55,30 +97,42 @@ void print(char *content);
 
 void print_log(char *content, int log_file, bool print_to_terminal);
 
-void send_help_message(int server_to_client);
+void send_help_message(Connection *client);
 
 void print_server_help();
 
-void generate_status_message_from_queued(char *dest, struct Node *llist, char *fifo_id);
+char *generate_status_message_from_queued(JobTable *jobs);
+
+char *generate_status_message_from_executing(JobTable *jobs);
+
+void generate_status_message_from_resources(char *dest, int *resources, Configuration config, CacheStats *cache);
+
+int generate_completed_message(char *dest, Job *job);
 
-void generate_status_message_from_executing(char *dest, struct Node *llist);
+int generate_stats_record(char *dest, Job *job);
 
-void generate_status_message_from_resources(char *dest, int *resources, Configuration config);
+void generate_progress_message(char *dest, Job *job, long long done, long long now);
 
-void generate_completed_message(char *dest, char *in, char *out);
+bool read_process_io(int pid, int pgid, long long *read_bytes, long long *written_bytes);
 
-void send_status_to_client(char *fifo, char *content);
+long long monotonic_ms();
 
-bool check_resources(Job job, Configuration config, int *in_use_operations);
+void send_status_to_client(Connection *client, char *content);
+
+void send_progress_to_client(Connection *client, char *content);
+
+void flush_client_messages(Connection *client);
+
+void discard_client_messages(Connection *client);
 
 void update_resources_usage_add(int *resources, Job job_to_execute);
 
 void update_resources_usage_del(int *resources, Job job_to_execute);
 
-int get_status(char *string, char *fifo_output);
-
 /* Novas */
 
 bool check_execute(int *job, Configuration config, int *in_use_operations);
 
 void get_job_resources(Job job, int *resources);
+
+int get_operation_limit(Configuration config, Operation operation);
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <poll.h>
+#include <sys/types.h>
+
+#include "server.h"
+
+/* Size of a worker frame header: type (1 byte), reserved (3 bytes), payload length (4 bytes). */
+#define WORKER_HEADER_SIZE 8
+
+/* Maximum payload of a worker frame. */
+#define WORKER_CHUNK_SIZE (64 * 1024)
+
+/* Milliseconds a new worker has to announce itself (WORKER_READY): at startup the tool is otherwise
+considered not to support the worker mode, a restarted worker is otherwise killed and not replaced. */
+#define WORKER_READY_TIMEOUT 500
+
+/* Maximum number of workers of an operation, whatever its limit in the configuration. */
+#define WORKER_POOL_MAX 16
+
+/**
+ * @brief Types of the frames exchanged with a worker (a tool started with '--worker', which
+ * reads and writes frames on its standard input and output instead of the raw data).
+ * @param WORKER_READY Sent by the worker once it started, no payload.
+ * @param WORKER_START Starts a job, the payload is the job id (uint64).
+ * @param WORKER_DATA Chunk of input (to the worker) or of output (from the worker).
+ * @param WORKER_END End of the input (to the worker, no payload) or of the output (from the
+ * worker, the payload is a uint8 status, 0 on success). The worker then waits for the next job.
+ */
+typedef enum
+{
+    WORKER_READY = 1,
+    WORKER_START,
+    WORKER_DATA,
+    WORKER_END
+
+} WorkerFrameType;
+
+/**
+ * @brief Warm coprocess running a tool in worker mode.
+ * @param pid Process of the worker.
+ * @param fd Socket connected to the worker (its standard input and output), -1 if the worker couldn't be started.
+ * @param busy Whether a job is using the worker.
+ * @param ready Whether the worker announced itself (WORKER_READY), only then is it given to the jobs.
+ * @param spawned When the worker was started (milliseconds, see monotonic_ms).
+ */
+typedef struct worker
+{
+    pid_t pid;
+    int fd;
+    bool busy,
+         ready;
+
+    long long spawned;
+
+} Worker;
+
+/**
+ * @brief Workers of an operation, shared by the jobs (a job stage takes a worker while it runs).
+ * @param operation Operation of the workers.
+ * @param workers Workers of the pool.
+ * @param size Number of workers, 0 if the tool doesn't support the worker mode.
+ * @param exec_path Path where the executables are.
+ */
+typedef struct worker_pool
+{
+    Operation operation;
+
+    Worker *workers;
+    int size;
+
+    char *exec_path;
+
+} WorkerPool;
+
+void worker_pool_init(WorkerPool *pool, Operation operation, int size, char *exec_path);
+
+int worker_pool_acquire(WorkerPool *pool);
+
+void worker_pool_release(WorkerPool *pool, int fd, bool clean);
+
+bool worker_pool_reap(WorkerPool *pool, pid_t pid);
+
+int worker_pool_watch(WorkerPool *pool, struct pollfd *fds, long long now, long long *deadline);
+
+void worker_pool_started(WorkerPool *pool, struct pollfd *fds, int fds_len);
+
+int worker_run(int worker_fd, uint64_t job_id, int in_fd, int out_fd, StageStats *stats);
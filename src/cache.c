@@ -0,0 +1,298 @@
+/**
+ * @file cache.c
+ * @author gweebg ; johnny_longo
+ * @brief Content-addressed cache of job outputs. The key of a job is made of the SHA-256 of
+ * its input bytes, its size and the planned operations, so resubmitting the same input with the
+ * same operations (to any output path) just copies the cached output.
+ * @version 0.1
+ * @date 2022-05-22
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <stdbool.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "../includes/cache.h"
+#include "../includes/utils.h"
+#include "../includes/sha256.h"
+
+/* Maximum amount of bytes used by the cache, 0 if the cache is disabled. */
+static long long cache_budget = 0;
+
+/* Counters, in memory shared by every process forked after cache_init. */
+static CacheStats *cache_stats = NULL;
+
+/**
+ * @brief Cached file, used while evicting entries.
+ */
+typedef struct cache_entry
+{
+    char name[CACHE_KEY_SIZE];
+    long long size;
+    struct timespec used;
+
+} CacheEntry;
+
+/**
+ * @brief Initializes the cache. Must be called before forking the other server processes
+ * so they all share the same counters.
+ * 
+ * @param budget Maximum size of the cache in bytes, 0 to disable it.
+ */
+void cache_init(long long budget)
+{
+    cache_stats = mmap(NULL, sizeof(CacheStats), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (cache_stats == MAP_FAILED)
+    {
+        print_error("Could not allocate the cache counters, the cache is disabled.\n");
+        cache_stats = NULL;
+        return;
+    }
+
+    memset(cache_stats, 0, sizeof(CacheStats));
+
+    if (budget > 0 && mkdir(CACHE_DIR, 0777) < 0 && errno != EEXIST)
+    {
+        print_error("Could not create the cache directory, the cache is disabled.\n");
+        return;
+    }
+
+    cache_budget = budget;
+}
+
+bool cache_enabled()
+{
+    return cache_budget > 0 && cache_stats;
+}
+
+/**
+ * @brief Returns the cache counters (all zero if the cache is disabled).
+ */
+CacheStats *cache_get_stats()
+{
+    static CacheStats empty = {0};
+    return cache_stats ? cache_stats : &empty;
+}
+
+/**
+ * @brief Generates the cache key of a job: SHA-256 of the input bytes, input size and the planned
+ * operations (one hex digit each). Every part is exact or collision resistant, so a key never
+ * names the output of a different job.
+ * 
+ * @param job Job (already planned).
+ * @param key Output string with at least CACHE_KEY_SIZE bytes.
+ * @return 0 on success, -1 if the input could not be read or isn't a regular file.
+ */
+int cache_key(Job job, char *key)
+{
+    /* Only regular files: reading a FIFO would block, or take the data away from the job. */
+    int in_fd = open(job.from, O_RDONLY | O_NONBLOCK);
+    if (in_fd < 0) return -1;
+
+    struct stat in_stat;
+    if (fstat(in_fd, &in_stat) < 0 || !S_ISREG(in_stat.st_mode))
+    {
+        close(in_fd);
+        return -1;
+    }
+
+    size_t buffer_size = 256 * 1024;
+    unsigned char *buffer = xmalloc(sizeof(unsigned char) * buffer_size);
+
+    SHA256 sha;
+    sha256_init(&sha);
+
+    long long size = 0;
+    ssize_t bytes_read;
+    while ((bytes_read = read(in_fd, buffer, buffer_size)) > 0)
+    {
+        sha256_update(&sha, buffer, bytes_read);
+        size += bytes_read;
+    }
+
+    free(buffer);
+    close(in_fd);
+
+    if (bytes_read < 0) return -1;
+
+    unsigned char digest[SHA256_SIZE];
+    sha256_final(&sha, digest);
+
+    int length = 0;
+    for (int i = 0; i < SHA256_SIZE; i++) length += sprintf(key + length, "%02x", digest[i]);
+    length += sprintf(key + length, "-%llx-", size);
+    for (int i = 0; i < job.op_len; i++) length += sprintf(key + length, "%x", job.operations[i]);
+
+    return 0;
+}
+
+/**
+ * @brief Materializes the output of a job from the cache (reflink or copy_file_range), published
+ * like the output of an executed job (see publish_output). Counts the hit or miss.
+ * 
+ * @param key Cache key of the job.
+ * @param job Job whose output is fetched.
+ * @return true, if the output was served from the cache, false otherwise.
+ */
+bool cache_fetch(char *key, Job job)
+{
+    char path[sizeof(CACHE_DIR) + CACHE_KEY_SIZE + 1];
+    sprintf(path, "%s/%s", CACHE_DIR, key);
+
+    int cached_fd = open(path, O_RDONLY);
+    if (cached_fd < 0)
+    {
+        __atomic_fetch_add(&cache_stats->misses, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+
+    bool temporary;
+    int out_fd = open_output(job.to, job.id, &temporary);
+    bool hit = out_fd >= 0 && copy_file(cached_fd, out_fd) == 0;
+
+    /* Identical jobs wait for this output, as for an executed one (see close_job_files in execute.c). */
+    if (hit && temporary && job.stats && __atomic_load_n(&job.stats->keep_output, __ATOMIC_ACQUIRE))
+        job.stats->output_kept = keep_output(job.to, job.id) == 0;
+
+    /* Cancelled while identical jobs wait for it: the output was only kept for them. */
+    if (hit && temporary && job.stats && __atomic_load_n(&job.stats->unpublished, __ATOMIC_ACQUIRE))
+    {
+        char temp[strlen(job.to) + 32];
+        output_temp_path(temp, job.to, job.id);
+        unlink(temp);
+    }
+    else hit = hit && publish_output(out_fd, job.to, job.id, job.durability, temporary) == 0;
+
+    if (out_fd >= 0 && !hit && temporary) discard_output(job.to, job.id);
+
+    /* The modification time is used as the last use time by the LRU eviction. */
+    if (hit) futimens(cached_fd, NULL);
+
+    __atomic_fetch_add(hit ? &cache_stats->hits : &cache_stats->misses, 1, __ATOMIC_RELAXED);
+
+    if (out_fd >= 0) close(out_fd);
+    close(cached_fd);
+
+    return hit;
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+    const CacheEntry *entry_a = a, *entry_b = b;
+
+    if (entry_a->used.tv_sec != entry_b->used.tv_sec) return entry_a->used.tv_sec < entry_b->used.tv_sec ? -1 : 1;
+    if (entry_a->used.tv_nsec != entry_b->used.tv_nsec) return entry_a->used.tv_nsec < entry_b->used.tv_nsec ? -1 : 1;
+
+    return 0;
+}
+
+/**
+ * @brief Removes the least recently used entries until the cache fits its budget.
+ */
+static void cache_evict()
+{
+    DIR *directory = opendir(CACHE_DIR);
+    if (!directory) return;
+
+    int entries_len = 0, entries_size = 64;
+    CacheEntry *entries = xmalloc(sizeof(CacheEntry) * entries_size);
+    long long total = 0;
+
+    struct dirent *file;
+    while (entries && (file = readdir(directory)))
+    {
+        struct stat file_stat;
+        if (file->d_name[0] == '.' || strlen(file->d_name) >= CACHE_KEY_SIZE) continue;
+        if (fstatat(dirfd(directory), file->d_name, &file_stat, 0) < 0) continue;
+
+        if (entries_len == entries_size)
+        {
+            entries_size *= 2;
+            CacheEntry *temp = realloc(entries, sizeof(CacheEntry) * entries_size);
+            if (!temp) break;
+            entries = temp;
+        }
+
+        strcpy(entries[entries_len].name, file->d_name);
+        entries[entries_len].size = file_stat.st_size;
+        entries[entries_len].used = file_stat.st_mtim;
+
+        total += file_stat.st_size;
+        entries_len++;
+    }
+
+    if (entries && total > cache_budget)
+    {
+        qsort(entries, entries_len, sizeof(CacheEntry), &compare_entries);
+
+        for (int i = 0; i < entries_len && total > cache_budget; i++)
+        {
+            if (unlinkat(dirfd(directory), entries[i].name, 0) == 0) total -= entries[i].size;
+        }
+    }
+
+    free(entries);
+    closedir(directory);
+}
+
+/**
+ * @brief Stores the output of a job in the cache, evicting old entries if needed.
+ * The entry is written to a temporary file and renamed, so it is never seen half written.
+ * 
+ * @param key Cache key of the job.
+ * @param output_fd Temporary file of the output of the job (see open_output), before it is
+ * published. Its offset is the size of the output (the file may be preallocated further) and is left as is.
+ */
+void cache_store(char *key, int output_fd)
+{
+    off_t size = lseek(output_fd, 0, SEEK_CUR);
+    if (size < 0 || size > cache_budget) return;
+
+    char temp_path[sizeof(CACHE_DIR) + 32], path[sizeof(CACHE_DIR) + CACHE_KEY_SIZE + 1];
+    sprintf(temp_path, "%s/.tmp_%d", CACHE_DIR, getpid());
+    sprintf(path, "%s/%s", CACHE_DIR, key);
+
+    int cached_fd = open(temp_path, O_WRONLY | O_TRUNC | O_CREAT, 0666);
+    if (cached_fd < 0) return;
+
+    /* Copied from explicit offsets, the output is still to be published from its own offset. */
+    off_t offset = 0;
+    ssize_t copied = 0;
+    while (offset < size && (copied = copy_file_range(output_fd, &offset, cached_fd, NULL, size - offset, 0)) > 0);
+
+    char buffer[BUFSIZ];
+    while (offset < size && (copied = pread(output_fd, buffer, BUFSIZ, offset)) > 0)
+    {
+        if (write(cached_fd, buffer, copied) != copied)
+        {
+            copied = -1;
+            break;
+        }
+
+        offset += copied;
+    }
+
+    bool stored = offset == size;
+    close(cached_fd);
+
+    if (!stored || rename(temp_path, path) < 0)
+    {
+        unlink(temp_path);
+        return;
+    }
+
+    cache_evict();
+}
@@ -9,6 +9,8 @@
  * 
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <fcntl.h>
 #include <errno.h>
@@ -16,98 +18,525 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdbool.h>
-#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
 
 #include "../includes/client.h"
 #include "../includes/utils.h"
+#include "../includes/protocol.h"
 
 /**
- * @brief Funtion that executes the whole client side as a programm.
+ * @brief Descriptor passed to the server instead of a path: '-' is the standard input (or 
+ * output) of the client and "/dev/fd/N" is its descriptor N.
+ * 
+ * @param path Input or output path.
+ * @param standard_fd Descriptor of '-'.
+ * @return The descriptor, -1 if the path is opened by the server.
+ */
+static int stream_fd(char *path, int standard_fd)
+{
+    if (strcmp(path, "-") == 0) return standard_fd;
+    if (strncmp(path, "/dev/fd/", 8) == 0 && path[8]) return atoi(path + 8);
+
+    return -1;
+}
+
+/**
+ * @brief Fills a request with the command line arguments.
  * 
  * @param argc Number or arguments.
- * @param argv Array containing command line arguments.
- * @return Error code (int).
+ * @param argv Arguments, eg. "proc-file [--detach] [--durability fdatasync] -p 5 in.txt out.txt nop bcompress", "wait 12 13", 
+ * "poll 12", "cancel 12", "status" or "help".
+ * @param request Request to fill (zeroed).
+ * @return true, if the arguments are valid, false otherwise.
  */
-int main(int argc, char *argv[]) 
+static bool parse_request(int argc, char *argv[], Request *request)
 {
-    /*
-    Exemplo de input:
-    ./sdstore proc-file -p <priority> samples/file-a outputs/file-a-output bcompress nop gcompress encrypt nop
-    */
+    if (argc < 2) return false;
+
+    if (strcmp(argv[1], "help") == 0)   { request->type = MSG_HELP;   return true; }
+    if (strcmp(argv[1], "status") == 0) { request->type = MSG_STATUS; return true; }
+
+    if (strcmp(argv[1], "wait") == 0 || strcmp(argv[1], "poll") == 0 || strcmp(argv[1], "cancel") == 0)
+    {
+        request->type = strcmp(argv[1], "wait") == 0 ? MSG_WAIT : strcmp(argv[1], "poll") == 0 ? MSG_POLL : MSG_CANCEL;
+        if (argc < 3 || argc - 2 > (request->type == MSG_WAIT ? MAX_WAIT_IDS : 1)) return false;
+
+        for (int i = 2; i < argc; i++)
+        {
+            request->ids[request->ids_len] = strtoull(argv[i], NULL, 10);
+            if (request->ids[request->ids_len++] == 0) return false;
+        }
+
+        return true;
+    }
+
+    if (strcmp(argv[1], "proc-file") != 0) return false;
+
+    request->type = MSG_PROC_FILE;
+
+    int i = 2;
+    for (; i < argc && argv[i][0] == '-' && argv[i][1]; i++)
+    {
+        if (strcmp(argv[i], "--detach") == 0) request->detach = true;
+        else if (strcmp(argv[i], "--durability") == 0 && i + 1 < argc)
+        {
+            i++;
+            if (strcmp(argv[i], "none") == 0) request->durability = DURABILITY_NONE;
+            else if (strcmp(argv[i], "fdatasync") == 0) request->durability = DURABILITY_FDATASYNC;
+            else if (strcmp(argv[i], "batch") == 0) request->durability = DURABILITY_BATCH;
+            else return false;
+        }
+        else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) request->priority = atoi(argv[++i]);
+        else return false;
+    }
+
+    if (request->priority < 0 || request->priority > 5 || argc - i < 3 || argc - i - 2 > MAX_OPERATIONS) return false;
+
+    request->from = argv[i++];
+    request->to = argv[i++];
+    request->stream_in = stream_fd(request->from, STDIN_FILENO) >= 0;
+    request->stream_out = stream_fd(request->to, STDOUT_FILENO) >= 0;
+
+    for (; i < argc; i++)
+    {
+        Operation operation = operation_from_name(argv[i]);
+        if (operation == OP_COUNT)
+        {
+            print_error("Unknown operation.\n");
+            return false;
+        }
+
+        request->operations[request->op_len++] = operation;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Connects to the server.
+ * 
+ * @return Socket of the connection, -1 if the server isn't running.
+ */
+static int connect_to_server()
+{
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    strncpy(address.sun_path, SOCKET_PATH, sizeof(address.sun_path) - 1);
+
+    int server = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (server < 0 || connect(server, (struct sockaddr *) &address, sizeof(address)) < 0)
+    {
+        print_error("Failed to connect to the server (client).\n");
+        return -1;
+    }
+
+    return server;
+}
+
+/**
+ * @brief Sends a request to the server, with the descriptors of its streamed input and output.
+ * 
+ * @param server Socket of the connection.
+ * @param request Request (encoded in 'frame').
+ * @param frame Encoded request.
+ * @param frame_size Size of the frame.
+ * @return Same as sendmsg.
+ */
+static ssize_t send_request(int server, Request *request, char *frame, int frame_size)
+{
+    struct iovec iov = {.iov_base = frame, .iov_len = frame_size};
+    struct msghdr message = {.msg_iov = &iov, .msg_iovlen = 1};
+
+    /* The input descriptor goes first (see FRAME_FLAG_STREAM_IN). */
+    int fds[FRAME_MAX_FDS], fds_len = 0;
+    if (request->type == MSG_PROC_FILE && request->stream_in) fds[fds_len++] = stream_fd(request->from, STDIN_FILENO);
+    if (request->type == MSG_PROC_FILE && request->stream_out) fds[fds_len++] = stream_fd(request->to, STDOUT_FILENO);
 
-    /* Abrir comunicacao com o servidor. */ 
-    int client_to_server = open("tmp/cts", O_WRONLY);
-    if (client_to_server < 0)
+    char control[CMSG_SPACE(sizeof(int) * FRAME_MAX_FDS)] = {0};
+    if (fds_len)
     {
-        print_error("Failed to open client to server pipe (client).\n");
+        message.msg_control = control;
+        message.msg_controllen = CMSG_SPACE(sizeof(int) * fds_len);
+
+        struct cmsghdr *control_message = CMSG_FIRSTHDR(&message);
+        control_message->cmsg_level = SOL_SOCKET;
+        control_message->cmsg_type = SCM_RIGHTS;
+        control_message->cmsg_len = CMSG_LEN(sizeof(int) * fds_len);
+        memcpy(CMSG_DATA(control_message), fds, sizeof(int) * fds_len);
+    }
+
+    return sendmsg(server, &message, MSG_NOSIGNAL);
+}
+
+/**
+ * @brief Reads the job id of a message sent by the server, eg. "[*] Completed (job 12, ...)".
+ * 
+ * @param message Message.
+ * @return The job id, 0 if the message isn't about a job.
+ */
+static uint64_t message_job_id(char *message)
+{
+    char *id = strstr(message, "(job ");
+    return id ? strtoull(id + 5, NULL, 10) : 0;
+}
+
+/**
+ * @brief Reads the position of the request a refusal of the server answers, eg. "[!] Invalid
+ * request (request 3).", counted from 1 on each connection.
+ * 
+ * @param message Message.
+ * @return The position of the request, 0 if the message isn't a refusal.
+ */
+static uint64_t message_request(char *message)
+{
+    char *position = strstr(message, "(request ");
+    return position ? strtoull(position + 9, NULL, 10) : 0;
+}
+
+/**
+ * @brief Job of a batch, from one line of the manifest.
+ * @param line Line of the manifest.
+ * @param id Job id given by the server (0 until the server answers). Refused jobs keep the
+ * id of the previous job, so the ids stay sorted.
+ */
+typedef struct batch_job
+{
+    int line;
+    uint64_t id;
+
+} BatchJob;
+
+/**
+ * @brief Finds a job of a batch by its id. The server numbers the requests of a connection 
+ * in the order they are sent, so the ids are sorted.
+ * 
+ * @param jobs Jobs that already have an id.
+ * @param jobs_len Number of jobs.
+ * @param id Job id.
+ * @return The job, NULL if it isn't part of the batch.
+ */
+static BatchJob *find_batch_job(BatchJob *jobs, int jobs_len, uint64_t id)
+{
+    /* First job with an id >= 'id' (refused jobs come after the job whose id they copy). */
+    int low = 0, high = jobs_len;
+    while (low < high)
+    {
+        int middle = (low + high) / 2;
+
+        if (jobs[middle].id < id) low = middle + 1;
+        else high = middle;
+    }
+
+    return low < jobs_len && jobs[low].id == id ? &jobs[low] : NULL;
+}
+
+/**
+ * @brief Submits every job of a manifest over a single connection and prints their results
+ * as they complete. Each line of the manifest has the arguments of proc-file, eg. 
+ * "-p 5 in.txt out.txt nop bcompress" (empty lines and lines starting with '#' are skipped).
+ * 
+ * @param manifest Manifest path ("-" or NULL for the standard input).
+ * @return Error code (int), EXIT_SUCCESS if every job completed.
+ */
+static int run_batch(char *manifest)
+{
+    FILE *input = (!manifest || strcmp(manifest, "-") == 0) ? stdin : fopen(manifest, "r");
+    if (!input)
+    {
+        print_error("Could not open the manifest.\n");
         return OPEN_ERROR;
     }
 
-    /* Criacao do pipe entre servidor e cliente. */
-    pid_t client_id = getpid();
+    /* Every frame is encoded up front, one after the other in 'frames'. */
+    size_t frames_size = 0, frames_capacity = FRAME_MAX_SIZE * 16;
+    char *frames = xmalloc(frames_capacity);
 
-    char cts_fifo[64];
-    sprintf(cts_fifo, "tmp/stc_%d", client_id);
+    int jobs_len = 0, jobs_capacity = 1024, failed = 0, line_number = 0;
+    BatchJob *jobs = xmalloc(sizeof(BatchJob) * jobs_capacity);
 
-    char info[32];
-    sprintf(info, "Job id: %d\n", client_id);
-    print_info(info);
+    int status = EXIT_SUCCESS;
 
-    /* Enviar sinal de "status" ou "help" ao servidor. */
-    if ((argc >= 6) || (strcmp(argv[1], "status") == 0) || (strcmp(argv[1], "help") == 0)) /* Enviar os argumentos todos numa string para o servidor. */
+    char *line = NULL; size_t line_capacity = 0;
+    while (getline(&line, &line_capacity, input) > 0)
     {
-        mkfifo(cts_fifo, 0666);
+        line_number++;
+
+        char *args[MAX_OPERATIONS + 8] = {"sdstore", "proc-file"}, *save = NULL;
+        int args_len = 2;
+
+        for (char *token = strtok_r(line, " \t\r\n", &save); token && args_len < MAX_OPERATIONS + 8; 
+             token = strtok_r(NULL, " \t\r\n", &save))
+            args[args_len++] = token;
+
+        if (args_len == 2 || args[2][0] == '#') continue;
 
-        char *message = xmalloc(sizeof(char) * (argc) * 16);
-        strcpy(message, cts_fifo);
+        /* Lines copied from the command line may keep the mode. */
+        int first = strcmp(args[2], "proc-file") == 0 ? 1 : 0;
+        args[first + 1] = "proc-file";
 
-        for (int i = 1; i < argc; i++)
+        if (frames_capacity - frames_size < FRAME_MAX_SIZE)
         {
-            char *temp = xmalloc(sizeof(char) * 16);        
-            sprintf(temp, " %s", argv[i]);
+            char *bigger = realloc(frames, frames_capacity * 2);
+            if (!bigger)
+            {
+                print_error("Failed to allocate memory.\n");
+                status = MALLOC_ERROR;
+                break;
+            }
 
-            strncat(message, temp, strlen(argv[i]) + 1);
-            free(temp);
+            frames = bigger;
+            frames_capacity *= 2;
         }
 
-        if (write(client_to_server, message, strlen(message)) < 0)
+        /* Descriptors can't be passed with the frames of a batch, every job needs paths. */
+        Request request = {0};
+        int frame_size = -1;
+        if (parse_request(args_len - first, args + first, &request) && !request.stream_in && !request.stream_out) 
+            frame_size = protocol_encode(&request, frames + frames_size);
+
+        if (frame_size < 0)
+        {
+            char error[64];
+            sprintf(error, "Invalid job at line %d.\n", line_number);
+            print_error(error);
+
+            failed++;
+            continue;
+        }
+
+        if (jobs_len == jobs_capacity)
         {
-            print_error("Failed to write to client to server pipe.\n");
-            return WRITE_ERROR;
+            BatchJob *bigger = realloc(jobs, sizeof(BatchJob) * jobs_capacity * 2);
+            if (!bigger)
+            {
+                print_error("Failed to allocate memory.\n");
+                status = MALLOC_ERROR;
+                break;
+            }
+
+            jobs = bigger;
+            jobs_capacity *= 2;
         }
+
+        jobs[jobs_len++] = (BatchJob) {.line = line_number, .id = 0};
+        frames_size += frame_size;
     }
-    else /* Erro se houver menos de 6 argumentos ou argumentos invalidos. */
+
+    free(line);
+    if (input != stdin) fclose(input);
+
+    int server = status == EXIT_SUCCESS ? connect_to_server() : -1;
+    if (server < 0)
     {
-        print_error("Not enought arguments. Expected at least 6 but got less, refer to the documentation for more information.\n");
-        return FORMAT_ERROR;
+        free(frames); free(jobs);
+        return status == EXIT_SUCCESS ? OPEN_ERROR : status;
     }
 
-    close(client_to_server);
+    /* Requests are sent while the answers are read, so neither side fills its buffer and blocks. */
+    size_t sent_size = 0;
+    int sent = 0, answered = 0, ended = 0, completed = 0;
 
-    int server_to_client = open(cts_fifo, O_RDONLY);
-    if (server_to_client < 0)
+    static char message[MESSAGE_MAX_SIZE];
+    while (ended < jobs_len && status == EXIT_SUCCESS)
     {
-        print_error("Failed to open server to client pipe. (client).\n");
-        return OPEN_ERROR;
+        struct pollfd poll_fd = {.fd = server, .events = POLLIN | (sent < jobs_len ? POLLOUT : 0)};
+        if (poll(&poll_fd, 1, -1) < 0)
+        {
+            if (errno == EINTR) continue;
+
+            print_error("Failed to poll the server connection (client).\n");
+            status = READ_ERROR;
+            break;
+        }
+
+        if (poll_fd.revents & POLLOUT)
+        {
+            /* Up to RECV_BATCH requests per system call, one packet each. */
+            struct mmsghdr messages[RECV_BATCH];
+            struct iovec vectors[RECV_BATCH];
+
+            int batch_len = 0; size_t offset = sent_size;
+            for (; batch_len < RECV_BATCH && sent + batch_len < jobs_len; batch_len++)
+            {
+                uint32_t length;
+                memcpy(&length, frames + offset, sizeof(length));
+
+                vectors[batch_len] = (struct iovec) {.iov_base = frames + offset, .iov_len = FRAME_HEADER_SIZE + length};
+                messages[batch_len] = (struct mmsghdr) {.msg_hdr = {.msg_iov = &vectors[batch_len], .msg_iovlen = 1}};
+                offset += FRAME_HEADER_SIZE + length;
+            }
+
+            int batch_sent = sendmmsg(server, messages, batch_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (batch_sent < 0 && errno != EAGAIN && errno != EINTR)
+            {
+                print_error("Failed to send the requests to the server.\n");
+                status = WRITE_ERROR;
+                break;
+            }
+
+            for (int i = 0; i < batch_sent; i++) sent_size += vectors[i].iov_len;
+            if (batch_sent > 0) sent += batch_sent;
+        }
+
+        if (!(poll_fd.revents & (POLLIN | POLLHUP | POLLERR))) continue;
+
+        /* Every answer already queued is read, the server drops the clients that let their socket fill up. */
+        while (ended < jobs_len)
+        {
+            ssize_t bytes_read = recv(server, message, sizeof(message) - 1, MSG_DONTWAIT);
+            if (bytes_read < 0 && (errno == EAGAIN || errno == EINTR)) break;
+            if (bytes_read <= 0)
+            {
+                print_error("The server closed the connection.\n");
+                status = EXIT_FAILURE;
+                break;
+            }
+            message[bytes_read] = '\0';
+
+            /* The first answer to each request comes in order: the job id, or the refusal of the request at its position. */
+            BatchJob *job;
+            uint64_t request = message_request(message);
+            if (strncmp(message, "[*] Pending", 11) == 0)
+            {
+                if (answered < jobs_len) jobs[answered++].id = message_job_id(message);
+                continue;
+            }
+            else if (request)
+            {
+                if (request > (uint64_t) jobs_len) continue;
+
+                job = &jobs[request - 1];
+                job->id = request > 1 ? jobs[request - 2].id : 0;
+                answered = request;
+            }
+            else job = message_job_id(message) ? find_batch_job(jobs, answered, message_job_id(message)) : NULL;
+
+            bool success = strncmp(message, "[*] Completed", 13) == 0;
+            if (!job || (!success && strncmp(message, "[!]", 3) != 0)) continue;
+
+            char *result = xmalloc(bytes_read + 32);
+            sprintf(result, "[line %d] %s", job->line, message);
+            write(STDOUT_FILENO, result, strlen(result));
+            free(result);
+
+            ended++;
+            if (success) completed++;
+            else failed++;
+        }
     }
 
-    int bytes_read; char string[BUFSIZ];
+    close(server);
+    free(frames); free(jobs);
+
+    if (status != EXIT_SUCCESS) return status;
+
+    char summary[96];
+    sprintf(summary, "Batch: %d completed, %d failed.\n", completed, failed);
+    print_info(summary);
 
-    /* Listen to incoming messages from the server. */
-    while(true)
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/**
+ * @brief Funtion that executes the whole client side as a programm.
+ * 
+ * @param argc Number or arguments.
+ * @param argv Array containing command line arguments.
+ * @return Error code (int).
+ */
+int main(int argc, char *argv[]) 
+{
+    /*
+    Exemplo de input:
+    ./sdstore proc-file -p <priority> samples/file-a outputs/file-a-output bcompress nop gcompress encrypt nop
+    ./sdstore proc-batch manifest.txt (ou '-' para ler do stdin)
+    */
+
+    if (argc >= 2 && strcmp(argv[1], "proc-batch") == 0) return run_batch(argc > 2 ? argv[2] : NULL);
+
+    Request request = {0};
+    if (!parse_request(argc, argv, &request)) /* Erro se houver menos argumentos que os necessarios ou argumentos invalidos. */
+    {
+        print_error("Invalid arguments (mode, priority, paths or operations), refer to the documentation for more information.\n");
+        return FORMAT_ERROR;
+    }
+
+    char frame[FRAME_MAX_SIZE];
+    int frame_size = protocol_encode(&request, frame);
+    if (frame_size < 0)
     {
-        while((bytes_read = read(server_to_client, string, BUFSIZ)) > 0) 
-        {   
-            write(STDOUT_FILENO, string, bytes_read);
+        print_error("Request too big (paths or operations).\n");
+        return FORMAT_ERROR;
+    }
+
+    /* Abrir comunicacao com o servidor: uma unica ligacao, nos dois sentidos, ate ao fim do pedido. */
+    int server = connect_to_server();
+    if (server < 0) return OPEN_ERROR;
 
-            /* 848 is the size of the help message. */
-            if (bytes_read >= 848) return EXIT_SUCCESS;
-            if (strncmp(string, "[*] Completed", 13) == 0) return EXIT_SUCCESS;
-            if (strncmp(string, "[SERVER STATUS]", 15) == 0) return EXIT_SUCCESS;
+    /* With a streamed output, the standard output only carries the data of the job. */
+    int output = request.type == MSG_PROC_FILE && request.stream_out ? STDERR_FILENO : STDOUT_FILENO;
 
+    bool detach = request.type == MSG_PROC_FILE && request.detach;
+
+    /* Enviar o pedido ao servidor, numa unica mensagem. */
+    if (send_request(server, &request, frame, frame_size) < 0)
+    {
+        print_error("Failed to send the request to the server.\n");
+        return WRITE_ERROR;
+    }
+
+    /* Listen to incoming messages from the server, one per packet. */
+    static char message[MESSAGE_MAX_SIZE];
+    ssize_t bytes_read;
+    int ended = 0, failed = 0;
+    while ((bytes_read = recv(server, message, sizeof(message) - 1, 0)) > 0)
+    {
+        message[bytes_read] = '\0';
+        bool refused = strncmp(message, "[!]", 3) == 0;
+
+        /* Detached: only the job id is printed (eg. for "id=$(sdstore proc-file --detach ...)"). */
+        if (detach && !refused)
+        {
+            char id[32];
+            sprintf(id, "%llu\n", (unsigned long long) message_job_id(message));
+            write(output, id, strlen(id));
+            return EXIT_SUCCESS;
+        }
+
+        /* The id given by the server, the one wait, poll and cancel take. */
+        if (request.type == MSG_PROC_FILE && output == STDOUT_FILENO && strncmp(message, "[*] Pending", 11) == 0)
+        {
+            char info[48];
+            sprintf(info, "Job id: %llu\n", (unsigned long long) message_job_id(message));
+            print_info(info);
+        }
+
+        write(output, message, bytes_read);
+
+        /* Help, status, poll and cancel are answered with a single message, wait with one per job. */
+        switch (request.type)
+        {
+            case MSG_PROC_FILE:
+                if (strncmp(message, "[*] Completed", 13) == 0) return EXIT_SUCCESS;
+                if (refused) return EXIT_FAILURE;
+                break;
+
+            case MSG_WAIT:
+                if (!refused && strncmp(message, "[*] Completed", 13) != 0) break;
+
+                failed += refused;
+                if (++ended == request.ids_len) return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+                break;
+
+            default:
+                return refused ? EXIT_FAILURE : EXIT_SUCCESS;
         }
     }
 
-    close(server_to_client);
-    return 0;
+    if (bytes_read < 0) print_error("Failed to receive from the server (client).\n");
+    else print_error("The server closed the connection.\n");
+
+    close(server);
+    return EXIT_FAILURE;
 }
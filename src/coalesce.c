@@ -0,0 +1,139 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../includes/coalesce.h"
+#include "../includes/utils.h"
+
+/**
+ * @brief Hash of a coalesce key (FNV-1a), computed once per job.
+ */
+static uint64_t coalesce_hash(const char *key)
+{
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (; *key; key++) hash = (hash ^ (unsigned char) *key) * 0x100000001B3ULL;
+
+    return hash;
+}
+
+/**
+ * @brief Bucket of a hash (Fibonacci hashing, as in jobtable.c).
+ */
+static size_t coalesce_bucket(CoalesceMap *map, uint64_t hash)
+{
+    return (hash * 0x9E3779B97F4A7C15ULL) >> map->shift;
+}
+
+/**
+ * @brief Allocates the buckets of a map with the given capacity (a power of two).
+ */
+static void coalesce_map_alloc(CoalesceMap *map, size_t capacity)
+{
+    map->buckets = calloc(capacity, sizeof(Job *));
+    if (!map->buckets)
+    {
+        print_error("Failed to allocate memory.\n");
+        _exit(MALLOC_ERROR);
+    }
+
+    map->capacity = capacity;
+    map->shift = 64 - __builtin_ctzll(capacity);
+}
+
+/**
+ * @brief Doubles the number of buckets, moving every job.
+ */
+static void coalesce_map_grow(CoalesceMap *map)
+{
+    Job **old_buckets = map->buckets;
+    size_t old_capacity = map->capacity;
+
+    coalesce_map_alloc(map, old_capacity * 2);
+
+    for (size_t i = 0; i < old_capacity; i++)
+    {
+        for (Job *job = old_buckets[i], *next; job; job = next)
+        {
+            next = job->coalesce_next;
+
+            Job **bucket = &map->buckets[coalesce_bucket(map, job->coalesce_hash)];
+            job->coalesce_next = *bucket;
+            *bucket = job;
+        }
+    }
+
+    free(old_buckets);
+}
+
+/**
+ * @brief Initializes an empty map.
+ *
+ * @param map Map to initialize.
+ */
+void coalesce_map_init(CoalesceMap *map)
+{
+    *map = (CoalesceMap) {0};
+    coalesce_map_alloc(map, COALESCE_MAP_SIZE);
+}
+
+/**
+ * @brief Adds a job identical jobs can wait for.
+ *
+ * @param map Map.
+ * @param job Job with a coalesce key, not in the map.
+ */
+void coalesce_map_add(CoalesceMap *map, Job *job)
+{
+    if (map->size >= map->capacity) coalesce_map_grow(map);
+
+    job->coalesce_hash = coalesce_hash(job->coalesce_key);
+
+    Job **bucket = &map->buckets[coalesce_bucket(map, job->coalesce_hash)];
+    job->coalesce_next = *bucket;
+    *bucket = job;
+    map->size++;
+}
+
+/**
+ * @brief Removes a job from the map, nothing is done if it isn't there.
+ *
+ * @param map Map.
+ * @param job Job with a coalesce key.
+ */
+void coalesce_map_remove(CoalesceMap *map, Job *job)
+{
+    uint64_t hash = coalesce_hash(job->coalesce_key);
+
+    for (Job **entry = &map->buckets[coalesce_bucket(map, hash)]; *entry; entry = &(*entry)->coalesce_next)
+    {
+        if (*entry != job) continue;
+
+        *entry = job->coalesce_next;
+        job->coalesce_next = NULL;
+        map->size--;
+        return;
+    }
+}
+
+/**
+ * @brief Looks for a queued or executing job identical to a new one, that the new one can wait for.
+ * A queued job is only used if its priority isn't lower than the new job, otherwise the new job
+ * would wait longer than it should.
+ *
+ * @param map Map.
+ * @param job The new job (with a coalesce key).
+ * @return The job to wait for, NULL if there is none.
+ */
+Job *coalesce_map_find(CoalesceMap *map, Job *job)
+{
+    uint64_t hash = coalesce_hash(job->coalesce_key);
+
+    for (Job *leader = map->buckets[coalesce_bucket(map, hash)]; leader; leader = leader->coalesce_next)
+    {
+        if (leader->coalesce_hash == hash && strcmp(leader->coalesce_key, job->coalesce_key) == 0 && !leader->cancelled &&
+            (leader->priority >= job->priority || leader->status == EXECUTING))
+            return leader;
+    }
+
+    return NULL;
+}
@@ -0,0 +1,515 @@
+/**
+ * @file codec.c
+ * @author gweebg ; johnny_longo
+ * @brief In-process implementation of the nop, gcompress, gdecompress, bcompress and
+ * bdecompress operations, using zlib and libbz2 instead of the tools executables.
+ * Large inputs can also be compressed in parallel segments (see codec_run_segments).
+ * @version 0.1
+ * @date 2022-05-20
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <zlib.h>
+#include <bzlib.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "../includes/codec.h"
+#include "../includes/utils.h"
+
+/**
+ * @brief One stage of an in-process chain. Each stage pulls its input from the
+ * previous stage (or from a file descriptor if it is the first one).
+ *
+ * @param type Operation executed by the stage.
+ * @param upstream Previous stage, NULL if this stage reads from 'fd'.
+ * @param fd File descriptor to read from when there's no upstream stage.
+ * @param offset Offset of 'fd' to read from (with 'pread'), -1 to just 'read' the descriptor.
+ * @param remaining Bytes left to read from 'offset'.
+ * @param pulled Bytes read from 'fd'.
+ * @param in Input buffer of the stage.
+ * @param in_eof Whether the upstream has no more data.
+ * @param in_member Whether a decompressor is in the middle of a gzip member/bzip2 stream.
+ * @param done Whether the stage has produced all of its output.
+ */
+typedef struct stage
+{
+    Codec type;
+
+    struct stage *upstream;
+    int fd;
+
+    off_t offset,
+          remaining,
+          pulled;
+
+    union
+    {
+        z_stream z;
+        bz_stream bz;
+    };
+
+    unsigned char *in;
+
+    bool in_eof,
+         in_member,
+         done;
+
+} Stage;
+
+static ssize_t stage_read(Stage *stage, unsigned char *buffer, size_t size);
+
+/**
+ * @brief Maps an operation to the in-process codec.
+ *
+ * @param operation Operation.
+ * @return The codec, or CODEC_NONE if the operation must be executed by its tool.
+ */
+Codec codec_from_operation(Operation operation)
+{
+    switch (operation)
+    {
+        case OP_NOP:         return CODEC_NOP;
+        case OP_GCOMPRESS:   return CODEC_GCOMPRESS;
+        case OP_GDECOMPRESS: return CODEC_GDECOMPRESS;
+        case OP_BCOMPRESS:   return CODEC_BCOMPRESS;
+        case OP_BDECOMPRESS: return CODEC_BDECOMPRESS;
+        default:             return CODEC_NONE;
+    }
+}
+
+/**
+ * @brief Reads up to 'size' bytes of input for a stage, from its upstream stage or file descriptor.
+ *
+ * @return Number of bytes read, 0 at the end of the input, -1 on error.
+ */
+static ssize_t pull(Stage *stage, unsigned char *buffer, size_t size)
+{
+    if (stage->upstream) return stage_read(stage->upstream, buffer, size);
+
+    ssize_t bytes_read;
+    if (stage->offset < 0)
+    {
+        while ((bytes_read = read(stage->fd, buffer, size)) < 0 && errno == EINTR);
+        if (bytes_read > 0) stage->pulled += bytes_read;
+        return bytes_read;
+    }
+
+    if ((off_t) size > stage->remaining) size = stage->remaining;
+    if (size == 0) return 0;
+
+    while ((bytes_read = pread(stage->fd, buffer, size, stage->offset)) < 0 && errno == EINTR);
+    if (bytes_read > 0)
+    {
+        stage->offset += bytes_read;
+        stage->remaining -= bytes_read;
+        stage->pulled += bytes_read;
+    }
+
+    return bytes_read;
+}
+
+/**
+ * @brief Makes sure the input buffer of a stage has data, unless the upstream has ended.
+ *
+ * @param stage Stage to refill.
+ * @param avail_in Amount of bytes still available in the input buffer.
+ * @param next_in Set to the start of the new data.
+ * @return Amount of bytes now available, -1 on error.
+ */
+static ssize_t refill(Stage *stage, size_t avail_in, unsigned char **next_in)
+{
+    if (avail_in > 0 || stage->in_eof) return avail_in;
+
+    ssize_t bytes_read = pull(stage, stage->in, CODEC_BUFSIZ);
+    if (bytes_read < 0) return -1;
+    if (bytes_read == 0) stage->in_eof = true;
+
+    *next_in = stage->in;
+    return bytes_read;
+}
+
+static ssize_t gcompress_read(Stage *stage, unsigned char *buffer, size_t size)
+{
+    z_stream *z = &stage->z;
+    z->next_out = buffer;
+    z->avail_out = size;
+
+    while (z->avail_out > 0 && !stage->done)
+    {
+        ssize_t available = refill(stage, z->avail_in, &z->next_in);
+        if (available < 0) return -1;
+        z->avail_in = available;
+
+        int result = deflate(z, stage->in_eof ? Z_FINISH : Z_NO_FLUSH);
+        if (result == Z_STREAM_END) stage->done = true;
+        else if (result != Z_OK && result != Z_BUF_ERROR) return -1;
+    }
+
+    return size - z->avail_out;
+}
+
+static ssize_t gdecompress_read(Stage *stage, unsigned char *buffer, size_t size)
+{
+    z_stream *z = &stage->z;
+    z->next_out = buffer;
+    z->avail_out = size;
+
+    while (z->avail_out > 0 && !stage->done)
+    {
+        ssize_t available = refill(stage, z->avail_in, &z->next_in);
+        if (available < 0) return -1;
+        z->avail_in = available;
+
+        if (z->avail_in == 0)
+        {
+            /* Ending in the middle of a member means the input was truncated. */
+            if (stage->in_member) return -1;
+
+            stage->done = true;
+            break;
+        }
+
+        int result = inflate(z, Z_NO_FLUSH);
+        if (result == Z_STREAM_END)
+        {
+            /* gzip files may contain several concatenated members. */
+            inflateReset(z);
+            stage->in_member = false;
+        }
+        else if (result == Z_OK || result == Z_BUF_ERROR) stage->in_member = true;
+        else return -1;
+    }
+
+    return size - z->avail_out;
+}
+
+static ssize_t bcompress_read(Stage *stage, unsigned char *buffer, size_t size)
+{
+    bz_stream *bz = &stage->bz;
+    bz->next_out = (char *) buffer;
+    bz->avail_out = size;
+
+    while (bz->avail_out > 0 && !stage->done)
+    {
+        ssize_t available = refill(stage, bz->avail_in, (unsigned char **) &bz->next_in);
+        if (available < 0) return -1;
+        bz->avail_in = available;
+
+        int result = BZ2_bzCompress(bz, stage->in_eof ? BZ_FINISH : BZ_RUN);
+        if (result == BZ_STREAM_END) stage->done = true;
+        else if (result != BZ_RUN_OK && result != BZ_FINISH_OK) return -1;
+    }
+
+    return size - bz->avail_out;
+}
+
+static ssize_t bdecompress_read(Stage *stage, unsigned char *buffer, size_t size)
+{
+    bz_stream *bz = &stage->bz;
+    bz->next_out = (char *) buffer;
+    bz->avail_out = size;
+
+    while (bz->avail_out > 0 && !stage->done)
+    {
+        ssize_t available = refill(stage, bz->avail_in, (unsigned char **) &bz->next_in);
+        if (available < 0) return -1;
+        bz->avail_in = available;
+
+        if (bz->avail_in == 0)
+        {
+            if (stage->in_member) return -1;
+
+            stage->done = true;
+            break;
+        }
+
+        int result = BZ2_bzDecompress(bz);
+        if (result == BZ_STREAM_END)
+        {
+            /* Concatenated bzip2 streams: libbz2 has no reset, so restart the decoder. */
+            bz_stream previous = *bz;
+
+            BZ2_bzDecompressEnd(bz);
+            memset(bz, 0, sizeof(bz_stream));
+            if (BZ2_bzDecompressInit(bz, 0, 0) != BZ_OK) return -1;
+
+            bz->next_in = previous.next_in;
+            bz->avail_in = previous.avail_in;
+            bz->next_out = previous.next_out;
+            bz->avail_out = previous.avail_out;
+
+            stage->in_member = false;
+        }
+        else if (result == BZ_OK) stage->in_member = true;
+        else return -1;
+    }
+
+    return size - bz->avail_out;
+}
+
+/**
+ * @brief Produces up to 'size' bytes of output of a stage.
+ *
+ * @return Number of bytes produced, 0 when the stage is finished, -1 on error.
+ */
+static ssize_t stage_read(Stage *stage, unsigned char *buffer, size_t size)
+{
+    switch (stage->type)
+    {
+        case CODEC_NOP:         return pull(stage, buffer, size);
+        case CODEC_GCOMPRESS:   return gcompress_read(stage, buffer, size);
+        case CODEC_GDECOMPRESS: return gdecompress_read(stage, buffer, size);
+        case CODEC_BCOMPRESS:   return bcompress_read(stage, buffer, size);
+        case CODEC_BDECOMPRESS: return bdecompress_read(stage, buffer, size);
+        default:                return -1;
+    }
+}
+
+static int stage_init(Stage *stage)
+{
+    if (stage->type == CODEC_NOP) return 0;
+
+    stage->in = xmalloc(sizeof(unsigned char) * CODEC_BUFSIZ);
+    if (!stage->in) return -1;
+
+    int result = 0;
+    switch (stage->type)
+    {
+        case CODEC_GCOMPRESS:
+            /* 15 + 16 window bits makes zlib write a gzip header and trailer. */
+            result = deflateInit2(&stage->z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK ? 0 : -1;
+            break;
+
+        case CODEC_GDECOMPRESS:
+            result = inflateInit2(&stage->z, 15 + 16) == Z_OK ? 0 : -1;
+            break;
+
+        case CODEC_BCOMPRESS:
+            result = BZ2_bzCompressInit(&stage->bz, 9, 0, 0) == BZ_OK ? 0 : -1;
+            break;
+
+        case CODEC_BDECOMPRESS:
+            result = BZ2_bzDecompressInit(&stage->bz, 0, 0) == BZ_OK ? 0 : -1;
+            break;
+
+        default:
+            break;
+    }
+
+    if (result < 0)
+    {
+        free(stage->in);
+        stage->in = NULL;
+    }
+
+    return result;
+}
+
+static void stage_end(Stage *stage)
+{
+    switch (stage->type)
+    {
+        case CODEC_GCOMPRESS:   deflateEnd(&stage->z);             break;
+        case CODEC_GDECOMPRESS: inflateEnd(&stage->z);             break;
+        case CODEC_BCOMPRESS:   BZ2_bzCompressEnd(&stage->bz);     break;
+        case CODEC_BDECOMPRESS: BZ2_bzDecompressEnd(&stage->bz);   break;
+        default:                                                   break;
+    }
+
+    free(stage->in);
+}
+
+/**
+ * @brief Writes the whole buffer to a file descriptor, retrying on short writes.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int write_all(int fd, unsigned char *buffer, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t written = write(fd, buffer, size);
+        if (written < 0)
+        {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+
+        buffer += written;
+        size -= written;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Runs a chain of operations reading 'length' bytes of 'in_fd' starting at 'offset'
+ * (or the whole descriptor, if 'offset' is -1) and writing the result to 'out_fd'.
+ * The bytes read and written are added to 'stats' (if not NULL) as they go, so the progress of
+ * the stage can be followed (the segments of a file all add to the same statistics).
+ *
+ * @return 0 on success, -1 if any of the operations failed.
+ */
+static int codec_run_range(Codec *codecs, int codecs_len, int in_fd, off_t offset, off_t length, int out_fd, StageStats *stats)
+{
+    Stage *stages = calloc(codecs_len, sizeof(Stage));
+    unsigned char *buffer = xmalloc(sizeof(unsigned char) * CODEC_BUFSIZ);
+
+    if (!stages || !buffer)
+    {
+        free(stages);
+        free(buffer);
+        return -1;
+    }
+
+    int result = 0, initialized = 0;
+    for (; initialized < codecs_len; initialized++)
+    {
+        Stage *stage = &stages[initialized];
+
+        stage->type = codecs[initialized];
+        stage->fd = in_fd;
+        stage->offset = offset;
+        stage->remaining = length;
+        stage->upstream = initialized > 0 ? &stages[initialized - 1] : NULL;
+
+        if (stage_init(stage) < 0)
+        {
+            result = -1;
+            break;
+        }
+    }
+
+    ssize_t produced;
+    off_t counted = 0;
+    while (result == 0 && (produced = stage_read(&stages[codecs_len - 1], buffer, CODEC_BUFSIZ)) != 0)
+    {
+        if (produced < 0 || write_all(out_fd, buffer, produced) < 0) result = -1;
+        else if (stats)
+        {
+            __atomic_add_fetch(&stats->bytes_in, stages[0].pulled - counted, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&stats->bytes_out, produced, __ATOMIC_RELAXED);
+            counted = stages[0].pulled;
+        }
+    }
+
+    if (stats) __atomic_add_fetch(&stats->bytes_in, stages[0].pulled - counted, __ATOMIC_RELAXED);
+
+    for (int i = 0; i < initialized; i++) stage_end(&stages[i]);
+
+    free(stages);
+    free(buffer);
+
+    return result;
+}
+
+/**
+ * @brief Runs a chain of operations in the calling process, streaming the data from 'in_fd'
+ * through every codec and into 'out_fd'.
+ *
+ * @param codecs Operations to execute, in order.
+ * @param codecs_len Number of operations.
+ * @param in_fd Input file descriptor.
+ * @param out_fd Output file descriptor.
+ * @param stats Where the bytes read and written are counted as they go, NULL if they aren't.
+ * @return 0 on success, -1 if any of the operations failed (eg. corrupted input).
+ */
+int codec_run(Codec *codecs, int codecs_len, int in_fd, int out_fd, StageStats *stats)
+{
+    return codec_run_range(codecs, codecs_len, in_fd, -1, 0, out_fd, stats);
+}
+
+/**
+ * @brief Creates an anonymous temporary file in SEGMENT_DIR to hold the output of a segment.
+ *
+ * @return File descriptor of the file, -1 on error.
+ */
+static int open_segment_file()
+{
+    int fd = open(SEGMENT_DIR, O_TMPFILE | O_RDWR, 0600);
+    if (fd >= 0) return fd;
+
+    /* Filesystems without O_TMPFILE support. */
+    char path[] = SEGMENT_DIR "/segment_XXXXXX";
+    fd = mkstemp(path);
+    if (fd >= 0) unlink(path);
+
+    return fd;
+}
+
+/**
+ * @brief Compresses a regular file by splitting it into 'segments' parts that are compressed
+ * in parallel, each by its own process. Both gzip and bzip2 accept concatenated members, 
+ * so the members are written in order to 'out_fd' and the result is a valid file.
+ *
+ * @param codec CODEC_GCOMPRESS or CODEC_BCOMPRESS.
+ * @param in_fd Input file descriptor (a regular file).
+ * @param out_fd Output file descriptor.
+ * @param segments Number of segments (and processes).
+ * @param stats Where the bytes read and written are counted as they go, NULL if they aren't.
+ * @return 0 on success, -1 on error.
+ */
+int codec_run_segments(Codec codec, int in_fd, int out_fd, int segments, StageStats *stats)
+{
+    struct stat in_stat;
+    if (fstat(in_fd, &in_stat) < 0) return -1;
+
+    off_t segment_size = (in_stat.st_size + segments - 1) / segments;
+
+    int segment_fds[segments];
+    pid_t segment_pids[segments];
+
+    int started = 0, result = 0;
+    for (; started < segments; started++)
+    {
+        segment_fds[started] = open_segment_file();
+        if (segment_fds[started] < 0)
+        {
+            result = -1;
+            break;
+        }
+
+        segment_pids[started] = fork();
+        if (segment_pids[started] < 0)
+        {
+            close(segment_fds[started]);
+            result = -1;
+            break;
+        }
+
+        if (segment_pids[started] == 0)
+        {
+            off_t offset = started * segment_size;
+            off_t length = offset + segment_size > in_stat.st_size ? in_stat.st_size - offset : segment_size;
+
+            _exit(codec_run_range(&codec, 1, in_fd, offset, length, segment_fds[started], stats) < 0 ? CODEC_ERROR : EXIT_SUCCESS);
+        }
+    }
+
+    /* Members are appended as soon as they're ready, in order. */
+    for (int i = 0; i < started; i++)
+    {
+        int status;
+        if (waitpid(segment_pids[i], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) 
+            result = -1;
+
+        off_t member_size = lseek(segment_fds[i], 0, SEEK_END);
+        if (result == 0 && (member_size < 0 || lseek(segment_fds[i], 0, SEEK_SET) < 0 || copy_file(segment_fds[i], out_fd) < 0)) 
+            result = -1;
+
+        close(segment_fds[i]);
+    }
+
+    return result;
+}
@@ -1,40 +1,406 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <spawn.h>
+#include <time.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 
 #include "../includes/utils.h"
 #include "../includes/server.h"
+#include "../includes/codec.h"
+#include "../includes/worker.h"
+#include "../includes/cache.h"
+
+/**
+ * @brief Runs a group of in-process operations inside the current process and exits.
+ * Used by the children of the pipeline, so it never returns.
+ *
+ * @param codecs Operations of the group.
+ * @param codecs_len Number of operations of the group.
+ * @param stats Statistics of the stage (bytes read and written).
+ */
+static void run_codecs_and_exit(Codec *codecs, int codecs_len, StageStats *stats)
+{
+    if (codec_run(codecs, codecs_len, STDIN_FILENO, STDOUT_FILENO, stats) < 0)
+    {
+        print_error("Failed to execute operations (codec).\n");
+        _exit(CODEC_ERROR);
+    }
+
+    _exit(EXIT_SUCCESS);
+}
+
+extern char **environ;
+
+/**
+ * @brief Starts a tool with posix_spawn (a vfork-like clone, so the page tables of the process 
+ * are not copied), its standard input and output redirected and every other descriptor of the
+ * pipeline closed.
+ *
+ * @param tool Path of the tool.
+ * @param stdin_fd Input of the tool.
+ * @param stdout_fd Output of the tool.
+ * @param close_fds Descriptors closed in the tool (pipes and job files).
+ * @param close_len Number of descriptors to close.
+ * @return Pid of the tool, -1 if it couldn't be started.
+ */
+static pid_t spawn_tool(char *tool, int stdin_fd, int stdout_fd, int *close_fds, int close_len)
+{
+    posix_spawn_file_actions_t actions;
+    if (posix_spawn_file_actions_init(&actions) != 0) return -1;
+
+    posix_spawn_file_actions_adddup2(&actions, stdin_fd, STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, stdout_fd, STDOUT_FILENO);
+
+    for (int i = 0; i < close_len; i++)
+        if (close_fds[i] > STDERR_FILENO) posix_spawn_file_actions_addclose(&actions, close_fds[i]);
+
+    char *argv[] = {tool, NULL};
+    pid_t pid;
+    int error = posix_spawn(&pid, tool, &actions, NULL, argv, environ);
+
+    posix_spawn_file_actions_destroy(&actions);
+    return error == 0 ? pid : -1;
+}
+
+/**
+ * @brief Opens the input and the output of a job, unless the client passed them as descriptors
+ * (streamed job), which are then used as the ends of the pipeline. The output is written to a 
+ * temporary file, published once the job succeeded (see close_job_files). Exits the process if 
+ * one of them can't be opened.
+ *
+ * @param job Job to be executed.
+ * @param in_fd Output, input descriptor.
+ * @param out_fd Output, output descriptor.
+ * @param temporary Output, whether the output is a temporary file.
+ */
+static void open_job_files(Job job, int *in_fd, int *out_fd, bool *temporary)
+{
+    *temporary = false;
+    *in_fd = job.in_fd >= 0 ? job.in_fd : open(job.from, O_RDONLY, 0666);
+    *out_fd = job.out_fd >= 0 ? job.out_fd : open_output(job.to, job.id, temporary);
+
+    if (*in_fd < 0 || *out_fd < 0)
+    {
+        print_error("Could not open file descriptor. (execute.c)\n");
+        exit(OPEN_ERROR);
+    }
+}
+
+/**
+ * @brief Closes the input and the output of a job, publishing the output if the job succeeded
+ * (see publish_output) or removing it otherwise. A successful output is stored in the cache
+ * before it is published, if it is a temporary file (a regular file, whose content can be read back),
+ * and linked aside for the identical jobs waiting for it, if the server asked for it (see keep_output).
+ *
+ * @param job Executed job.
+ * @param in_fd Input descriptor.
+ * @param out_fd Output descriptor.
+ * @param temporary Whether the output is a temporary file.
+ * @param cache_id Cache key of the job, NULL if its output isn't cached.
+ * @param result Result of the job, 0 if it succeeded.
+ * @return The result of the job, -1 if the output couldn't be published.
+ */
+static int close_job_files(Job job, int in_fd, int out_fd, bool temporary, char *cache_id, int result)
+{
+    if (result == 0 && temporary && cache_id) cache_store(cache_id, out_fd);
+
+    /* Identical jobs wait for this output (see complete_coalesced_jobs in server.c). */
+    if (result == 0 && temporary && job.stats && __atomic_load_n(&job.stats->keep_output, __ATOMIC_ACQUIRE))
+        job.stats->output_kept = keep_output(job.to, job.id) == 0;
+
+    /* Cancelled while identical jobs wait for it: the output was only kept for them (cut to its size, as published). */
+    if (result == 0 && temporary && job.stats && __atomic_load_n(&job.stats->unpublished, __ATOMIC_ACQUIRE))
+    {
+        off_t size = lseek(out_fd, 0, SEEK_CUR);
+        if (size < 0 || ftruncate(out_fd, size) < 0) result = -1;
+
+        char temp[strlen(job.to) + 32];
+        output_temp_path(temp, job.to, job.id);
+        unlink(temp);
+    }
+    else if (result == 0 && publish_output(out_fd, job.to, job.id, job.durability, temporary) < 0)
+    {
+        print_error("Could not publish the output file. (execute.c)\n");
+        result = -1;
+    }
+    else if (result < 0 && temporary) discard_output(job.to, job.id);
+
+    close(in_fd);
+    close(out_fd);
+    return result;
+}
+
+/**
+ * @brief Preallocates the output of a job (a single extent, no growing a write at a time), 
+ * from the size of the input and the operations: compressing is expected to keep at most 
+ * the size, decompressing to triple it. The output is truncated to its real size when it is published.
+ *
+ * @param job Job to be executed.
+ * @param in_fd Input descriptor.
+ * @param out_fd Output descriptor (a temporary file).
+ */
+static void preallocate_output(Job job, int in_fd, int out_fd)
+{
+    struct stat in_stat;
+    if (fstat(in_fd, &in_stat) < 0 || !S_ISREG(in_stat.st_mode) || in_stat.st_size == 0) return;
+
+    off_t estimate = in_stat.st_size;
+    for (int i = 0; i < job.op_len; i++)
+        if (job.operations[i] == OP_GDECOMPRESS || job.operations[i] == OP_BDECOMPRESS) estimate *= 3;
+
+    /* Only a hint: the output grows as usual if the space isn't available or the estimate is short. */
+    fallocate(out_fd, 0, 0, estimate);
+}
+
+/**
+ * @brief Copies the input of a job to its output SYNC_BATCH_SIZE bytes at a time, writing each
+ * batch back (sync_file_range) before the next one (DURABILITY_BATCH, see wait_stages for the pipelines).
+ *
+ * @param in_fd Input descriptor.
+ * @param out_fd Output descriptor (a temporary file, at its start).
+ * @return 0 on success, -1 on error.
+ */
+static int copy_in_batches(int in_fd, int out_fd)
+{
+    off_t synced = 0;
+    ssize_t copied;
+
+    while ((copied = copy_file_range(in_fd, NULL, out_fd, NULL, SYNC_BATCH_SIZE, 0)) > 0)
+    {
+        sync_file_range(out_fd, synced, copied, SYNC_FILE_RANGE_WRITE);
+        synced += copied;
+    }
+
+    /* Inputs that copy_file_range doesn't support (eg. a pipe) are copied as usual, written back once published. */
+    return copied == 0 ? 0 : copy_file(in_fd, out_fd);
+}
+
+/**
+ * @brief Process of a stage of the pipeline, while it runs.
+ * @param pid Process of the stage, -1 if it couldn't be started.
+ * @param spawned Whether the stage is an exec'd tool, whose bytes are counted by the kernel (/proc/<pid>/io).
+ * The other stages count their own bytes.
+ * @param started When the stage was started (CLOCK_MONOTONIC).
+ */
+typedef struct stage_process
+{
+    pid_t pid;
+    bool spawned;
+    struct timespec started;
+
+} StageProcess;
+
+/**
+ * @brief Microseconds elapsed since a given time (CLOCK_MONOTONIC).
+ */
+static long long elapsed_us(struct timespec *since)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec - since->tv_sec) * 1000000LL + (now.tv_nsec - since->tv_nsec) / 1000;
+}
+
+/**
+ * @brief CPU time (user and system) of a resource usage, in microseconds.
+ */
+static long long usage_cpu_us(struct rusage *usage)
+{
+    return (usage->ru_utime.tv_sec + usage->ru_stime.tv_sec) * 1000000LL + usage->ru_utime.tv_usec + usage->ru_stime.tv_usec;
+}
+
+/**
+ * @brief CPU time of the calling process and of the children it waited for, in microseconds.
+ */
+static long long process_cpu_us()
+{
+    struct rusage self, children;
+    getrusage(RUSAGE_SELF, &self);
+    getrusage(RUSAGE_CHILDREN, &children);
+
+    return usage_cpu_us(&self) + usage_cpu_us(&children);
+}
+
+/**
+ * @brief Waits for the processes of a pipeline, filling the statistics of their stages (times,
+ * and bytes of the exec'd tools, read before they are reaped). With DURABILITY_BATCH, the 
+ * output written so far is sent to the disk meanwhile (sync_file_range), every SYNC_BATCH_SIZE bytes.
+ *
+ * @param processes Processes of the stages.
+ * @param stats Statistics of the job (one stage per process).
+ * @param out_fd Output descriptor (its offset tells how much was written).
+ * @param batch Whether the output is written back while waiting.
+ * @return 0 if every process succeeded, -1 otherwise.
+ */
+static int wait_stages(StageProcess *processes, JobStats *stats, int out_fd, bool batch)
+{
+    int children = 0;
+    for (int i = 0; i < stats->stages_len; i++) children += processes[i].pid > 0;
+
+    /* Blocked after the processes were created (they keep the usual mask), a SIGCHLD then stays pending until sigtimedwait. */
+    sigset_t sigchld_mask;
+    sigemptyset(&sigchld_mask);
+    sigaddset(&sigchld_mask, SIGCHLD);
+    if (batch) sigprocmask(SIG_BLOCK, &sigchld_mask, NULL);
+
+    int result = 0;
+    off_t synced = 0;
+
+    while (children > 0)
+    {
+        /* The process is only looked at (WNOWAIT), its /proc entry stays until it is reaped. */
+        siginfo_t info = {.si_pid = 0};
+        if (waitid(P_ALL, 0, &info, WEXITED | WNOWAIT | (batch ? WNOHANG : 0)) < 0)
+        {
+            if (errno == EINTR) continue;
+
+            result = -1;
+            break;
+        }
+
+        if (info.si_pid != 0)
+        {
+            int stage = 0;
+            while (stage < stats->stages_len && processes[stage].pid != info.si_pid) stage++;
+            if (stage < stats->stages_len && processes[stage].spawned)
+            {
+                StageStats *stage_stats = &stats->stages[stage];
+                read_process_io(info.si_pid, 0, &stage_stats->bytes_in, &stage_stats->bytes_out);
+
+                /* Before it is reaped, so the server stops sampling it (see job_progress in server.c). */
+                __atomic_store_n(&stage_stats->pid, 0, __ATOMIC_RELEASE);
+            }
+
+            int status;
+            struct rusage usage;
+            if (wait4(info.si_pid, &status, 0, &usage) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) result = -1;
+
+            if (stage < stats->stages_len)
+            {
+                stats->stages[stage].wall_us = elapsed_us(&processes[stage].started);
+                stats->stages[stage].cpu_us = usage_cpu_us(&usage);
+                children--;
+            }
+
+            continue;
+        }
+
+        off_t written = lseek(out_fd, 0, SEEK_CUR);
+        if (written - synced >= SYNC_BATCH_SIZE)
+        {
+            sync_file_range(out_fd, synced, written - synced, SYNC_FILE_RANGE_WRITE);
+            synced = written;
+        }
+
+        struct timespec interval = {.tv_sec = 0, .tv_nsec = SYNC_BATCH_INTERVAL * 1000000L};
+        sigtimedwait(&sigchld_mask, NULL, &interval);
+    }
+
+    return result;
+}
 
 /**
  * @brief Function that executes a job using system pipes.
+ * Consecutive operations known by the codec engine (nop, gcompress, gdecompress, bcompress
+ * and bdecompress) are grouped and run by a single process without exec'ing any tool, 
+ * the remaining operations are exec'd from the tools directory (or run by a warm worker, see worker.c).
  *
  * @param job Job to be executed.
+ * @param exec_path Path where the executables are.
+ * @param pipe_size Size in bytes of the pipes between the stages, 0 keeps the system default.
+ * @param cache_id Cache key of the job (its output is stored in the cache), NULL if it isn't cached.
+ * @return 0 if every operation succeeded, -1 otherwise. The statistics of the stages are in 'job.stats'.
  */
-void execute(Job job)
+int execute(Job job, char *exec_path, int pipe_size, char *cache_id)
 {
+    /* Without a shared mapping the statistics are only kept by this process (the stages' own counts are lost). */
+    JobStats local_stats = {0};
+    JobStats *stats = job.stats ? job.stats : &local_stats;
+
     /*
     Exemplos de comandos:
     ./bcompress < in.txt | ./nop | ./gcompress | ./encrypt | ./nop > out.txt
     char *operations[4] = {"ls", "lolcat", "wc", "figlet"};
     */
 
-    int num_commands = job.op_len;
+    /* The planner removed every operation, the output is just a copy of the input. */
+    if (job.op_len == 0)
+    {
+        int in_fd, out_fd; bool temporary;
+        open_job_files(job, &in_fd, &out_fd, &temporary);
+
+        int result = temporary && job.durability == DURABILITY_BATCH ? copy_in_batches(in_fd, out_fd) : copy_file(in_fd, out_fd);
+        if (result < 0) print_error("Failed to copy the input file. (execute.c)\n");
+
+        return close_job_files(job, in_fd, out_fd, temporary, cache_id, result);
+    }
+
+    /* Splitting the operations in groups, each group is run by a single process. */
+    Codec codecs[job.op_len];
+    int group_start[job.op_len], group_len[job.op_len];
+    int num_commands = 0;
+
+    for (int i = 0; i < job.op_len; i++)
+    {
+        codecs[i] = codec_from_operation(job.operations[i]);
+
+        /* A first operation split in segments always runs on its own. */
+        bool joins_previous = i > 0 && codecs[i] != CODEC_NONE && codecs[i - 1] != CODEC_NONE && 
+                              !(i == 1 && job.segments > 1);
+        if (joins_previous) group_len[num_commands - 1]++;
+        else
+        {
+            group_start[num_commands] = i;
+            group_len[num_commands] = 1;
+            num_commands++;
+        }
+    }
+
     int num_pipes = num_commands - 1;
 
-    int pipes[2 * num_pipes]; /* n pipes require n*2 channels */
+    stats->stages_len = num_commands;
+    for (int i = 0; i < num_commands; i++) stats->stages[i] = (StageStats) {.first = group_start[i], .ops = group_len[i]};
+
+    int pipes[num_pipes > 0 ? 2 * num_pipes : 1]; /* n pipes require n*2 channels */
     pid_t pid;
 
     /* Opening input and output file descriptors. */
-    int in_fd = open(job.from, O_RDONLY, 0666);
-    int out_fd = open(job.to, O_WRONLY | O_TRUNC | O_CREAT, 0666);
+    int in_fd, out_fd; bool temporary;
+    open_job_files(job, &in_fd, &out_fd, &temporary);
+    if (temporary) preallocate_output(job, in_fd, out_fd);
 
-    if (in_fd < 0 || out_fd < 0)
+    bool batch = temporary && job.durability == DURABILITY_BATCH;
+
+    struct stat in_stat;
+    if (fstat(in_fd, &in_stat) == 0 && S_ISREG(in_stat.st_mode)) stats->input_size = in_stat.st_size;
+
+    /* Every operation is in-process: no need to create any pipe or process. With DURABILITY_BATCH
+    the operations still run in a process of their own, so this one writes the output back meanwhile. */
+    if (num_commands == 1 && codecs[0] != CODEC_NONE && !batch)
     {
-        print_error("Could not open file descriptor. (execute.c)\n");
-        exit(OPEN_ERROR);
+        struct timespec started;
+        clock_gettime(CLOCK_MONOTONIC, &started);
+        long long cpu_before = process_cpu_us();
+
+        int result = job.segments > 1 ? codec_run_segments(codecs[0], in_fd, out_fd, job.segments, &stats->stages[0])
+                                      : codec_run(codecs, job.op_len, in_fd, out_fd, &stats->stages[0]);
+
+        stats->stages[0].wall_us = elapsed_us(&started);
+        stats->stages[0].cpu_us = process_cpu_us() - cpu_before;
+
+        if (result < 0) print_error("Failed to execute operations (codec).\n");
+
+        return close_job_files(job, in_fd, out_fd, temporary, cache_id, result);
     }
 
     /* Opening requiered pipes. */
@@ -45,12 +411,51 @@ void execute(Job job)
             print_error("Could not open pipe. (execute.c)\n");
             exit(PIPE_ERROR);
         }
+
+        /* Bigger pipes let a stage write a whole block (eg. 900 KB of bzip2) without waiting for the next 
+        one, it is not an error if the system refuses the size. */
+        if (pipe_size > 0) fcntl(pipes[i * 2], F_SETPIPE_SZ, pipe_size);
     }
 
+    /* Descriptors closed by the spawned tools. */
+    int spawn_close[2 * num_pipes + 2];
+    for (int i = 0; i < 2 * num_pipes; i++) spawn_close[i] = pipes[i];
+    spawn_close[2 * num_pipes] = in_fd;
+    spawn_close[2 * num_pipes + 1] = out_fd;
+
     /* Pipeline start. */
-    int j = 0, command_count = 0;
+    StageProcess processes[num_commands];
+    int j = 0, command_count = 0, result = 0;
     while (command_count < num_commands)
     {
+        int first = group_start[command_count];
+        StageProcess *process = &processes[command_count];
+
+        *process = (StageProcess) {.pid = -1, .spawned = codecs[first] == CODEC_NONE && job.worker_fds[first] < 0};
+        clock_gettime(CLOCK_MONOTONIC, &process->started);
+
+        /* A tool exec'd as is doesn't need a copy of this process, it is spawned. The other 
+        stages run code of the server, so they are forked. */
+        if (process->spawned)
+        {
+            char tool[strlen(exec_path) + 16];
+            sprintf(tool, "%s/%s", exec_path, operation_name(job.operations[first]));
+
+            int stage_in = command_count == 0 ? in_fd : pipes[j - 2];
+            int stage_out = command_count == num_commands - 1 ? out_fd : pipes[j + 1];
+
+            if ((process->pid = spawn_tool(tool, stage_in, stage_out, spawn_close, 2 * num_pipes + 2)) < 0)
+            {
+                print_error("Failed to execute operations.\n");
+                result = -1;
+            }
+            else stats->stages[command_count].pid = process->pid;
+
+            command_count++;
+            j+=2;
+            continue;
+        }
+
         pid = fork();
         if (pid < 0)
         {
@@ -101,18 +506,33 @@ void execute(Job job)
             }
 
             for (int u = 0; u < 2 * num_pipes; u++) close(pipes[u]);
+            close(in_fd);
+            close(out_fd);
 
-            if (execlp(job.operations[command_count], job.operations[command_count], NULL) < 0)
+            if (first == 0 && job.segments > 1)
             {
-                print_error("Failed to execute operations.\n");
-                exit(EXEC_ERROR);
+                if (codec_run_segments(codecs[0], STDIN_FILENO, STDOUT_FILENO, job.segments, &stats->stages[command_count]) < 0)
+                {
+                    print_error("Failed to execute operations (codec).\n");
+                    _exit(CODEC_ERROR);
+                }
+
+                _exit(EXIT_SUCCESS);
             }
+
+            if (codecs[first] != CODEC_NONE) run_codecs_and_exit(codecs + first, group_len[command_count], &stats->stages[command_count]);
+
+            /* A warm worker runs the tool's operation, no exec needed. */
+            _exit(worker_run(job.worker_fds[first], job.id, STDIN_FILENO, STDOUT_FILENO, &stats->stages[command_count]) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
         }
 
+        process->pid = pid;
         command_count++;
         j+=2;
     }
 
     for (int i = 0; i < 2 * num_pipes; i++) close(pipes[i]);
-    for (int i = 0; i < num_pipes + 1; i++) wait(NULL);
+    if (wait_stages(processes, stats, out_fd, batch) < 0) result = -1;
+
+    return close_job_files(job, in_fd, out_fd, temporary, cache_id, result);
 }
\ No newline at end of file
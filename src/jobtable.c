@@ -0,0 +1,229 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../includes/jobtable.h"
+#include "../includes/utils.h"
+
+/**
+ * @brief Slot where the search for a job id starts (Fibonacci hashing, spreads consecutive ids).
+ */
+static size_t job_table_hash(JobTable *table, uint64_t id)
+{
+    return (id * 0x9E3779B97F4A7C15ULL) >> table->shift;
+}
+
+/**
+ * @brief Finds the slot of a job id, or the empty slot where it would be inserted.
+ */
+static JobRecord *job_table_slot(JobTable *table, uint64_t id)
+{
+    size_t mask = table->capacity - 1;
+    size_t index = job_table_hash(table, id);
+
+    while (table->slots[index].id && table->slots[index].id != id) index = (index + 1) & mask;
+    return &table->slots[index];
+}
+
+/**
+ * @brief Allocates the slots of a table with the given capacity (a power of two).
+ */
+static void job_table_alloc(JobTable *table, size_t capacity)
+{
+    table->slots = calloc(capacity, sizeof(JobRecord));
+    if (!table->slots)
+    {
+        print_error("Failed to allocate memory.\n");
+        _exit(MALLOC_ERROR);
+    }
+
+    table->capacity = capacity;
+    table->shift = 64 - __builtin_ctzll(capacity);
+}
+
+/**
+ * @brief Doubles the number of slots, moving every record.
+ */
+static void job_table_grow(JobTable *table)
+{
+    JobRecord *old_slots = table->slots;
+    size_t old_capacity = table->capacity;
+
+    job_table_alloc(table, old_capacity * 2);
+
+    for (size_t i = 0; i < old_capacity; i++)
+        if (old_slots[i].id) *job_table_slot(table, old_slots[i].id) = old_slots[i];
+
+    free(old_slots);
+}
+
+/**
+ * @brief Initializes an empty job table.
+ *
+ * @param table Table to initialize.
+ * @param retention Seconds a result is kept after the job ends.
+ */
+void job_table_init(JobTable *table, int retention)
+{
+    *table = (JobTable) {.retention = retention};
+    job_table_alloc(table, JOB_TABLE_SIZE);
+}
+
+/**
+ * @brief Adds the record of a new job.
+ *
+ * @param table Job table.
+ * @param job The job (its id must not be in the table).
+ * @return The record, with the job's status.
+ */
+JobRecord *job_table_add(JobTable *table, Job *job)
+{
+    if ((table->size + 1) * 2 > table->capacity) job_table_grow(table);
+
+    JobRecord *record = job_table_slot(table, job->id);
+    *record = (JobRecord) {.id = job->id, .status = job->status, .job = job};
+    table->size++;
+
+    return record;
+}
+
+/**
+ * @brief Looks up the record of a job.
+ *
+ * @param table Job table.
+ * @param id Job id.
+ * @return The record, NULL if the job is unknown or its result expired.
+ */
+JobRecord *job_table_get(JobTable *table, uint64_t id)
+{
+    if (!id) return NULL;
+
+    JobRecord *record = job_table_slot(table, id);
+    return record->id ? record : NULL;
+}
+
+/**
+ * @brief Deletes the record of a job (its result is freed, it must have no waiters).
+ * The records after it in the same run are moved back, so no tombstones are needed.
+ *
+ * @param table Job table.
+ * @param id Job id.
+ */
+void job_table_delete(JobTable *table, uint64_t id)
+{
+    JobRecord *record = job_table_get(table, id);
+    if (!record) return;
+
+    free(record->result);
+
+    size_t mask = table->capacity - 1;
+    size_t hole = record - table->slots;
+
+    for (size_t index = (hole + 1) & mask; table->slots[index].id; index = (index + 1) & mask)
+    {
+        /* A record can fill the hole if the hole is between its home slot and its slot. */
+        size_t home = job_table_hash(table, table->slots[index].id);
+        if (((index - home) & mask) < ((index - hole) & mask)) continue;
+
+        table->slots[hole] = table->slots[index];
+        hole = index;
+    }
+
+    table->slots[hole] = (JobRecord) {0};
+    table->size--;
+}
+
+/**
+ * @brief Marks a job as ended, its result is kept until it expires (see job_table_expire).
+ *
+ * @param table Job table.
+ * @param record Record of the job.
+ * @param result Message sent when the job ended (copied).
+ * @param status COMPLETED or FAILED.
+ */
+void job_table_set_ended(JobTable *table, JobRecord *record, char *result, Status status)
+{
+    record->status = status;
+    record->job = NULL;
+    record->result = strdup(result);
+    record->ended_at = time(NULL);
+
+    if (table->ended_size == table->ended_capacity)
+    {
+        size_t capacity = table->ended_capacity ? table->ended_capacity * 2 : 256;
+        EndedJob *ended = xmalloc(sizeof(EndedJob) * capacity);
+
+        for (size_t i = 0; i < table->ended_size; i++)
+            ended[i] = table->ended[(table->ended_head + i) % table->ended_capacity];
+
+        free(table->ended);
+        table->ended = ended;
+        table->ended_head = 0;
+        table->ended_capacity = capacity;
+    }
+
+    size_t tail = (table->ended_head + table->ended_size++) % table->ended_capacity;
+    table->ended[tail] = (EndedJob) {.id = record->id, .ended_at = record->ended_at};
+}
+
+/**
+ * @brief Deletes the records of the jobs that ended more than the retention period ago.
+ *
+ * @param table Job table.
+ * @param now Current time.
+ */
+void job_table_expire(JobTable *table, time_t now)
+{
+    while (table->ended_size && table->ended[table->ended_head].ended_at + table->retention <= now)
+    {
+        job_table_delete(table, table->ended[table->ended_head].id);
+
+        table->ended_head = (table->ended_head + 1) % table->ended_capacity;
+        table->ended_size--;
+    }
+}
+
+/**
+ * @brief Orders jobs by id.
+ */
+static int compare_job_ids(const void *a, const void *b)
+{
+    uint64_t id_a = (*(Job **) a)->id, id_b = (*(Job **) b)->id;
+    return (id_a > id_b) - (id_a < id_b);
+}
+
+/**
+ * @brief Lists the jobs with a given status (eg. for the server status).
+ *
+ * @param table Job table.
+ * @param status Status of the listed jobs (QUEUED or EXECUTING).
+ * @param jobs_len Output, number of jobs.
+ * @return Array of the jobs, by id (to be freed), NULL if there are none.
+ */
+Job **job_table_jobs(JobTable *table, Status status, size_t *jobs_len)
+{
+    Job **jobs = NULL;
+    *jobs_len = 0;
+
+    for (size_t i = 0, capacity = 0; i < table->capacity; i++)
+    {
+        JobRecord *record = &table->slots[i];
+        if (!record->id || record->status != status || !record->job) continue;
+
+        if (*jobs_len == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 64;
+            jobs = realloc(jobs, sizeof(Job *) * capacity);
+            if (!jobs)
+            {
+                print_error("Failed to allocate memory.\n");
+                _exit(MALLOC_ERROR);
+            }
+        }
+
+        jobs[(*jobs_len)++] = record->job;
+    }
+
+    if (jobs) qsort(jobs, *jobs_len, sizeof(Job *), compare_job_ids);
+    return jobs;
+}
@@ -0,0 +1,229 @@
+/**
+ * @file metrics.c
+ * @author gweebg ; johnny_longo
+ * @brief Metrics of the server: histograms of the queue wait, execution time and throughput of
+ * the jobs (per operation and priority) and counters of the jobs submitted, completed and failed.
+ * They are periodically exported to METRICS_PATH in the Prometheus text format (eg. for the
+ * textfile collector of the node exporter). Only the scheduler thread updates them.
+ * @version 0.1
+ * @date 2022-06-05
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include <stdio.h>
+
+#include "../includes/metrics.h"
+
+/* Histograms of each operation (the last one for the jobs left without operations by the planner) and priority. */
+static Histogram queue_wait[OP_COUNT + 1][PRIORITY_LEVELS],
+                 run_time[OP_COUNT + 1][PRIORITY_LEVELS],
+                 throughput[OP_COUNT + 1][PRIORITY_LEVELS];
+
+/* Jobs received, completed and ended without output (refused, failed, dropped or cancelled), per priority. */
+static long long jobs_submitted[PRIORITY_LEVELS],
+                 jobs_completed[PRIORITY_LEVELS],
+                 jobs_failed[PRIORITY_LEVELS];
+
+/* Times queued jobs were left waiting because the free slots weren't enough for any of them. */
+static long long slot_denials = 0;
+
+/**
+ * @brief Bucket of a value: values below HISTOGRAM_SUB_BUCKETS have their own bucket, the others
+ * go by their highest bit (the power of two) and the HISTOGRAM_SUB_BITS bits that follow it.
+ * Values above the last bucket have none (-1).
+ */
+static int histogram_bucket(long long value)
+{
+    if (value < HISTOGRAM_SUB_BUCKETS) return value < 0 ? 0 : value;
+
+    int shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+    int bucket = (shift + 1) * HISTOGRAM_SUB_BUCKETS + (int) (value >> shift) - HISTOGRAM_SUB_BUCKETS;
+
+    return bucket < HISTOGRAM_BUCKETS ? bucket : -1;
+}
+
+/**
+ * @brief Biggest value of a bucket (see histogram_bucket).
+ */
+static long long histogram_upper_bound(int bucket)
+{
+    if (bucket < HISTOGRAM_SUB_BUCKETS) return bucket;
+
+    int shift = bucket / HISTOGRAM_SUB_BUCKETS - 1;
+    return ((long long) (HISTOGRAM_SUB_BUCKETS + bucket % HISTOGRAM_SUB_BUCKETS + 1) << shift) - 1;
+}
+
+/**
+ * @brief Adds a value to a histogram.
+ */
+static void histogram_add(Histogram *histogram, long long value)
+{
+    int bucket = histogram_bucket(value);
+    if (bucket >= 0) histogram->buckets[bucket]++;
+
+    histogram->count++;
+    histogram->sum += value;
+}
+
+/**
+ * @brief Priority of a job as an index of the metrics.
+ */
+static int priority_index(Job *job)
+{
+    if (job->priority < 0) return 0;
+    return job->priority < PRIORITY_LEVELS ? job->priority : PRIORITY_LEVELS - 1;
+}
+
+/**
+ * @brief Counts a job received by the scheduler.
+ *
+ * @param job Job.
+ */
+void metrics_job_submitted(Job *job)
+{
+    jobs_submitted[priority_index(job)]++;
+}
+
+/**
+ * @brief Counts a job that ended. A completed job that was executed also adds its queue wait and
+ * execution time to the histograms of each of its operations, and the throughput of each stage
+ * of its pipeline (bytes read per second) to the histograms of the operations of the stage.
+ *
+ * @param job Job that ended.
+ * @param completed Whether the job produced its output.
+ * @param now Current time (milliseconds, see monotonic_ms).
+ */
+void metrics_job_ended(Job *job, bool completed, long long now)
+{
+    int priority = priority_index(job);
+
+    if (!completed) jobs_failed[priority]++;
+    else jobs_completed[priority]++;
+
+    /* Identical jobs that waited for another one (coalesced) never started. */
+    if (!completed || job->started == 0) return;
+
+    bool counted[OP_COUNT + 1] = {false};
+    for (int i = 0; i <= job->op_len; i++)
+    {
+        int operation = i < job->op_len ? (int) job->operations[i] : OP_COUNT;
+        if (counted[operation] || (operation == OP_COUNT && job->op_len > 0)) continue;
+
+        counted[operation] = true;
+        histogram_add(&queue_wait[operation][priority], job->started - job->queued);
+        histogram_add(&run_time[operation][priority], now - job->started);
+    }
+
+    for (int i = 0; job->stats && i < job->stats->stages_len; i++)
+    {
+        StageStats *stage = &job->stats->stages[i];
+        if (stage->wall_us <= 0) continue;
+
+        long long bytes_per_second = stage->bytes_in * 1000000 / stage->wall_us;
+        for (int j = stage->first; j < stage->first + stage->ops; j++) histogram_add(&throughput[job->operations[j]][priority], bytes_per_second);
+    }
+}
+
+/**
+ * @brief Counts a dispatch that left the queued jobs waiting for slots.
+ */
+void metrics_slot_denied()
+{
+    slot_denials++;
+}
+
+/**
+ * @brief Writes a family of histograms, only the series with values. Every series has the same
+ * buckets, whatever its values: the kept buckets are summed up to the end of every
+ * HISTOGRAM_EXPORT_STEP-th power of two (the last one included), and the values above the
+ * last bucket are only in +Inf.
+ *
+ * @param file Output.
+ * @param name Name of the metric.
+ * @param help Description of the metric.
+ * @param series Histograms of each operation and priority.
+ * @param scale Unit of the metric in units of the values (eg. 0.001 for values in milliseconds exported in seconds).
+ */
+static void write_histograms(FILE *file, const char *name, const char *help, Histogram series[][PRIORITY_LEVELS], double scale)
+{
+    fprintf(file, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+
+    for (int operation = 0; operation <= OP_COUNT; operation++)
+    {
+        for (int priority = 0; priority < PRIORITY_LEVELS; priority++)
+        {
+            Histogram *histogram = &series[operation][priority];
+            if (histogram->count == 0) continue;
+
+            char labels[64];
+            sprintf(labels, "operation=\"%s\",priority=\"%d\"", operation < OP_COUNT ? operation_name(operation) : "none", priority);
+
+            long long cumulative = 0;
+            for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+            {
+                cumulative += histogram->buckets[i];
+
+                int octave = i / HISTOGRAM_SUB_BUCKETS;
+                if (i % HISTOGRAM_SUB_BUCKETS != HISTOGRAM_SUB_BUCKETS - 1 || (HISTOGRAM_OCTAVES - octave) % HISTOGRAM_EXPORT_STEP != 0) continue;
+
+                fprintf(file, "%s_bucket{%s,le=\"%.10g\"} %lld\n", name, labels, histogram_upper_bound(i) * scale, cumulative);
+            }
+
+            fprintf(file, "%s_bucket{%s,le=\"+Inf\"} %lld\n", name, labels, histogram->count);
+            fprintf(file, "%s_sum{%s} %.10g\n", name, labels, histogram->sum * scale);
+            fprintf(file, "%s_count{%s} %lld\n", name, labels, histogram->count);
+        }
+    }
+}
+
+/**
+ * @brief Writes a counter (or gauge) with one value per priority.
+ */
+static void write_per_priority(FILE *file, const char *name, const char *type, const char *help, long long *values)
+{
+    fprintf(file, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+    for (int priority = 0; priority < PRIORITY_LEVELS; priority++) fprintf(file, "%s{priority=\"%d\"} %lld\n", name, priority, values[priority]);
+}
+
+/**
+ * @brief Exports the metrics to METRICS_PATH, with the current state of the scheduler. The file
+ * is written aside and renamed over the previous one, so its readers never see half of it.
+ *
+ * @param queued Number of queued jobs.
+ * @param executing Number of executing jobs.
+ * @param resources Slots of each operation in use.
+ * @param config Configuration object with the limit values.
+ */
+void metrics_export(int queued, int executing, int *resources, Configuration config)
+{
+    FILE *file = fopen(METRICS_PATH ".tmp", "w");
+    if (!file)
+    {
+        print_error("Could not write the metrics file.\n");
+        return;
+    }
+
+    write_per_priority(file, "sdstore_jobs_submitted_total", "counter", "Jobs received by the scheduler.", jobs_submitted);
+    write_per_priority(file, "sdstore_jobs_completed_total", "counter", "Jobs that produced their output.", jobs_completed);
+    write_per_priority(file, "sdstore_jobs_failed_total", "counter", "Jobs that ended without their output (refused, failed, dropped or cancelled).", jobs_failed);
+
+    fprintf(file, "# HELP sdstore_slot_denials_total Times the queued jobs were left waiting because no slots were free for them.\n"
+                  "# TYPE sdstore_slot_denials_total counter\nsdstore_slot_denials_total %lld\n", slot_denials);
+
+    fprintf(file, "# HELP sdstore_jobs_queued Jobs waiting for slots.\n# TYPE sdstore_jobs_queued gauge\nsdstore_jobs_queued %d\n", queued);
+    fprintf(file, "# HELP sdstore_jobs_executing Jobs being executed.\n# TYPE sdstore_jobs_executing gauge\nsdstore_jobs_executing %d\n", executing);
+
+    fprintf(file, "# HELP sdstore_slots_in_use Slots of each operation in use.\n# TYPE sdstore_slots_in_use gauge\n");
+    for (int i = 0; i < OP_COUNT; i++) fprintf(file, "sdstore_slots_in_use{operation=\"%s\"} %d\n", operation_name(i), resources[i]);
+
+    fprintf(file, "# HELP sdstore_slots_limit Slots of each operation (configuration).\n# TYPE sdstore_slots_limit gauge\n");
+    for (int i = 0; i < OP_COUNT; i++) fprintf(file, "sdstore_slots_limit{operation=\"%s\"} %d\n", operation_name(i), get_operation_limit(config, i));
+
+    write_histograms(file, "sdstore_queue_wait_seconds", "Time the completed jobs spent queued.", queue_wait, 1e-3);
+    write_histograms(file, "sdstore_run_seconds", "Execution time of the completed jobs.", run_time, 1e-3);
+    write_histograms(file, "sdstore_stage_throughput_bytes_per_second", "Bytes read per second by the pipeline stages running each operation.", throughput, 1);
+
+    if (fclose(file) != 0 || rename(METRICS_PATH ".tmp", METRICS_PATH) < 0) print_error("Could not write the metrics file.\n");
+}
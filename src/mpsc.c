@@ -0,0 +1,72 @@
+#include <stddef.h>
+
+#include "../includes/mpsc.h"
+
+/**
+ * @brief Initializes an empty MPSC queue.
+ *
+ * @param queue Queue to initialize.
+ */
+void mpsc_init(MPSCQueue *queue)
+{
+    queue->stub.next = NULL;
+    queue->head = &queue->stub;
+    queue->tail = &queue->stub;
+}
+
+/**
+ * @brief Appends a node to the queue. Can be called by any number of threads at once.
+ *
+ * @param queue Queue where the node is pushed.
+ * @param node Node to push (owned by the queue until it's popped).
+ */
+void mpsc_push(MPSCQueue *queue, MPSCNode *node)
+{
+    __atomic_store_n(&node->next, NULL, __ATOMIC_RELAXED);
+
+    /* The exchange orders the producers, the node becomes visible to the consumer once linked. */
+    MPSCNode *previous = __atomic_exchange_n(&queue->head, node, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&previous->next, node, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Removes the oldest node of the queue. Must only be called by the consumer thread.
+ *
+ * @param queue Queue to pop from.
+ * @return The oldest node, NULL if the queue is empty or a producer is halfway through a push
+ * (that producer signals the consumer again once it finishes).
+ */
+MPSCNode *mpsc_pop(MPSCQueue *queue)
+{
+    MPSCNode *tail = queue->tail;
+    MPSCNode *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+    if (tail == &queue->stub)
+    {
+        if (!next) return NULL;
+
+        queue->tail = next;
+        tail = next;
+        next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    }
+
+    if (next)
+    {
+        queue->tail = next;
+        return tail;
+    }
+
+    if (tail != __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE)) return NULL;
+
+    /* Last node: the stub is pushed behind it so it can be detached. */
+    mpsc_push(queue, &queue->stub);
+
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (next)
+    {
+        queue->tail = next;
+        return tail;
+    }
+
+    return NULL;
+}
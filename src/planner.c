@@ -0,0 +1,118 @@
+/**
+ * @file planner.c
+ * @author gweebg ; johnny_longo
+ * @brief Planning pass that simplifies the operations of a job before it is executed.
+ * @version 0.1
+ * @date 2022-05-20
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+
+#include "../includes/planner.h"
+#include "../includes/utils.h"
+#include "../includes/codec.h"
+
+/**
+ * @brief Pairs of operations where the second one undoes the first one.
+ * The opposite order is not an identity (eg. 'gdecompress gcompress' may not give back the
+ * same bytes and fails on input that isn't gzip) so those pairs are never cancelled.
+ */
+static const Operation inverse_operations[][2] = 
+{
+    {OP_GCOMPRESS, OP_GDECOMPRESS},
+    {OP_BCOMPRESS, OP_BDECOMPRESS},
+    {OP_ENCRYPT,   OP_DECRYPT    }
+};
+
+/**
+ * @brief Checks whether 'second' undoes 'first'.
+ *
+ * @param first The first operation.
+ * @param second The operation that follows it.
+ * @return true, if executing both is the same as executing none, false otherwise.
+ */
+static bool cancels(Operation first, Operation second)
+{
+    int pairs = sizeof(inverse_operations) / sizeof(inverse_operations[0]);
+    for (int i = 0; i < pairs; i++)
+    {
+        if (first == inverse_operations[i][0] && second == inverse_operations[i][1]) 
+            return true;
+    }
+
+    return false;
+}
+
+/**
+ * @brief Decides in how many segments the first operation of a job is split.
+ * Only compressions of large regular files are split, and never in more segments than 
+ * there are processors or than the configured limit for the operation (each segment takes one slot).
+ *
+ * @param job Planned job.
+ * @param config Configuration object with the limit values.
+ * @return Number of segments, 1 if the operation should not be split.
+ */
+static int plan_segments(Job *job, Configuration config)
+{
+    if (job->op_len == 0) return 1;
+
+    Codec first = codec_from_operation(job->operations[0]);
+    if (first != CODEC_GCOMPRESS && first != CODEC_BCOMPRESS) return 1;
+
+    struct stat in_stat;
+    int result = job->in_fd >= 0 ? fstat(job->in_fd, &in_stat) : stat(job->from, &in_stat);
+    if (result < 0 || !S_ISREG(in_stat.st_mode)) return 1;
+
+    long segments = in_stat.st_size / SEGMENT_SIZE;
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+    int limit = get_operation_limit(config, job->operations[0]);
+
+    if (segments > processors) segments = processors;
+    if (segments > limit) segments = limit;
+    if (segments > MAX_SEGMENTS) segments = MAX_SEGMENTS;
+
+    return segments > 1 ? segments : 1;
+}
+
+/**
+ * @brief Rewrites the operations of a job with an equivalent, shorter, list.
+ * Every 'nop' is dropped and adjacent inverse pairs are cancelled (also the ones that
+ * only become adjacent after others are cancelled, eg. 'gcompress bcompress bdecompress gdecompress').
+ * A job may end up with no operations at all, meaning the output is a copy of the input.
+ * Also decides whether the first operation is executed in parallel segments.
+ *
+ * @param job Job to rewrite, 'operations', 'op_len', 'segments' and 'resources' are updated.
+ * @param config Configuration object with the limit values.
+ */
+void plan_job(Job *job, Configuration config)
+{
+    int planned_len = 0;
+
+    for (int i = 0; i < job->op_len; i++)
+    {
+        Operation operation = job->operations[i];
+
+        if (operation == OP_NOP) continue;
+
+        if (planned_len > 0 && cancels(job->operations[planned_len - 1], operation))
+        {
+            planned_len--;
+            continue;
+        }
+
+        job->operations[planned_len++] = operation;
+    }
+
+    job->op_len = planned_len;
+    job->segments = plan_segments(job, config);
+
+    for (int i = 0; i < OP_COUNT; i++) job->resources[i] = 0;
+    get_job_resources(*job, job->resources);
+}
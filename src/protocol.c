@@ -0,0 +1,178 @@
+/**
+ * @file protocol.c
+ * @author gweebg ; johnny_longo
+ * @brief Framing of the messages sent by the clients to the server.
+ * @version 0.1
+ * @date 2022-05-27
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include <string.h>
+
+#include "../includes/protocol.h"
+
+/*
+Frame layout (integers in host byte order, both ends run on the same machine):
+
+    uint32 payload length | uint8 version | uint8 type | uint8 flags | uint8 reserved | payload
+
+MSG_PROC_FILE payload: the priority (uint8), the number of operations (uint8), one uint8 per 
+operation, the input path and the output path ('\0' terminated). FRAME_FLAG_DETACH may be set, and
+FRAME_FLAG_STREAM_IN and FRAME_FLAG_STREAM_OUT when the client passes descriptors (SCM_RIGHTS) instead of paths.
+The durability of the output is in the FRAME_DURABILITY_MASK bits of the flags.
+
+MSG_WAIT, MSG_POLL and MSG_CANCEL payload: the number of job ids (uint16), one uint64 per id.
+*/
+
+/**
+ * @brief Appends a '\0' terminated string to a frame being encoded.
+ *
+ * @return The new frame size, -1 if the string doesn't fit.
+ */
+static int put_string(char *frame, int size, const char *string)
+{
+    int length = strlen(string) + 1;
+    if (size + length > FRAME_MAX_SIZE) return -1;
+
+    memcpy(frame + size, string, length);
+    return size + length;
+}
+
+/**
+ * @brief Reads a '\0' terminated string from a payload being decoded.
+ *
+ * @return The string (inside the payload), NULL if the payload ends before the '\0'.
+ */
+static char *get_string(char *payload, size_t length, size_t *offset)
+{
+    if (*offset >= length) return NULL;
+
+    char *string = payload + *offset;
+    char *end = memchr(string, '\0', length - *offset);
+    if (!end) return NULL;
+
+    *offset += end - string + 1;
+    return string;
+}
+
+/**
+ * @brief Encodes a request in a frame.
+ *
+ * @param request Request to encode.
+ * @param frame Output buffer, at least FRAME_MAX_SIZE bytes.
+ * @return Size of the frame, -1 if the request doesn't fit in a frame.
+ */
+int protocol_encode(Request *request, char *frame)
+{
+    int size = FRAME_HEADER_SIZE;
+
+    if (request->type == MSG_PROC_FILE)
+    {
+        if (request->priority < 0 || request->priority > 255 || request->op_len > MAX_OPERATIONS ||
+            size + 2 + request->op_len > FRAME_MAX_SIZE)
+            return -1;
+
+        frame[size++] = request->priority;
+        frame[size++] = request->op_len;
+        for (int i = 0; i < request->op_len; i++) frame[size++] = request->operations[i];
+
+        size = put_string(frame, size, request->from);
+        if (size >= 0) size = put_string(frame, size, request->to);
+    }
+    else if (request->type == MSG_WAIT || request->type == MSG_POLL || request->type == MSG_CANCEL)
+    {
+        uint16_t ids_len = request->ids_len;
+        if (request->ids_len < 1 || request->ids_len > MAX_WAIT_IDS) return -1;
+
+        memcpy(frame + size, &ids_len, sizeof(ids_len));
+        memcpy(frame + size + sizeof(ids_len), request->ids, sizeof(uint64_t) * ids_len);
+        size += sizeof(ids_len) + sizeof(uint64_t) * ids_len;
+    }
+
+    if (size < 0) return -1;
+
+    uint32_t length = size - FRAME_HEADER_SIZE;
+    memcpy(frame, &length, sizeof(length));
+    frame[4] = PROTOCOL_VERSION;
+    frame[5] = request->type;
+    frame[6] = request->type != MSG_PROC_FILE ? 0 : (request->detach ? FRAME_FLAG_DETACH : 0) |
+               (request->stream_in ? FRAME_FLAG_STREAM_IN : 0) | (request->stream_out ? FRAME_FLAG_STREAM_OUT : 0) |
+               (request->durability << FRAME_DURABILITY_SHIFT);
+    frame[7] = 0;
+
+    return size;
+}
+
+/**
+ * @brief Decodes the first frame of a buffer.
+ *
+ * @param buffer Received bytes.
+ * @param available Number of received bytes.
+ * @param request Output request, its strings point inside 'buffer'.
+ * @param frame_size Output, number of bytes to consume from the buffer (when the result isn't 0).
+ * @return 1 if a request was decoded, 0 if the frame is incomplete, -1 if the frame is invalid.
+ * An invalid header can't be skipped, so every available byte is consumed.
+ */
+int protocol_decode(char *buffer, size_t available, Request *request, int *frame_size)
+{
+    if (available < FRAME_HEADER_SIZE) return 0;
+
+    uint32_t length;
+    memcpy(&length, buffer, sizeof(length));
+
+    if (buffer[4] != PROTOCOL_VERSION || length > FRAME_MAX_SIZE - FRAME_HEADER_SIZE)
+    {
+        *frame_size = available;
+        return -1;
+    }
+
+    if (available < FRAME_HEADER_SIZE + length) return 0;
+    *frame_size = FRAME_HEADER_SIZE + length;
+
+    char *payload = buffer + FRAME_HEADER_SIZE;
+    size_t offset = 0;
+
+    request->type = (unsigned char) buffer[5];
+    request->detach = buffer[6] & FRAME_FLAG_DETACH;
+    request->stream_in = buffer[6] & FRAME_FLAG_STREAM_IN;
+    request->stream_out = buffer[6] & FRAME_FLAG_STREAM_OUT;
+    request->durability = (buffer[6] & FRAME_DURABILITY_MASK) >> FRAME_DURABILITY_SHIFT;
+
+    if (request->type == MSG_HELP || request->type == MSG_STATUS) return 1;
+
+    if (request->type == MSG_WAIT || request->type == MSG_POLL || request->type == MSG_CANCEL)
+    {
+        uint16_t ids_len;
+        if (length < sizeof(ids_len)) return -1;
+
+        memcpy(&ids_len, payload, sizeof(ids_len));
+        if (ids_len < 1 || ids_len > MAX_WAIT_IDS || length != sizeof(ids_len) + sizeof(uint64_t) * ids_len) return -1;
+
+        request->ids_len = ids_len;
+        memcpy(request->ids, payload + sizeof(ids_len), sizeof(uint64_t) * ids_len);
+        return 1;
+    }
+
+    if (request->type != MSG_PROC_FILE || offset + 2 > length) return -1;
+
+    request->priority = (unsigned char) payload[offset++];
+    request->op_len = (unsigned char) payload[offset++];
+    if (request->op_len > MAX_OPERATIONS || offset + request->op_len > length) return -1;
+
+    for (int i = 0; i < request->op_len; i++)
+    {
+        unsigned char operation = payload[offset++];
+        if (operation >= OP_COUNT) return -1;
+
+        request->operations[i] = operation;
+    }
+
+    if (request->durability > DURABILITY_BATCH) return -1;
+
+    request->from = get_string(payload, length, &offset);
+    request->to = get_string(payload, length, &offset);
+
+    return request->from && request->to ? 1 : -1;
+}
@@ -8,14 +8,21 @@
 #include "../includes/utils.h"
 
 /**
- * @brief Initializes a priority queue (sorted stack) with size as 0 and allocates memory for
- * it elements.
+ * @brief Initializes a priority queue with size as 0 and allocates memory for the 
+ * elements of each priority level.
  * 
  * @param queue Given PriorityQueue object.
  */
 void init_queue(PriorityQueue *queue)
 {
-    queue->values = xmalloc(sizeof(PreProcessedInput) * QSIZE);
+    for (int i = 0; i < PRIORITY_LEVELS; i++)
+    {
+        queue->buckets[i].values = xmalloc(sizeof(Job *) * BUCKET_SIZE);
+        queue->buckets[i].head = 0;
+        queue->buckets[i].size = 0;
+        queue->buckets[i].capacity = queue->buckets[i].values ? BUCKET_SIZE : 0;
+    }
+
     queue->size = 0;
 }
 
@@ -32,63 +39,208 @@ bool is_empty(PriorityQueue *queue)
 }
 
 /**
- * @brief Compares to Input elements. Used in sorting by the qsort function.
- *
- * @param a First element to compare.
- * @param b Seconde element to compare.
- * @return An integer value, -1 if a < b, 1 if a > b and 0 if a == b.
+ * @brief Doubles the capacity of a bucket, keeping its elements in order.
+ * 
+ * @param bucket Full bucket.
+ * @return true, if the bucket grew, false if there was no memory available.
  */
-int compare_input(const void *a, const void *b)
+static bool grow_bucket(Bucket *bucket)
 {
-    PreProcessedInput *input_a = *(PreProcessedInput **)a;
-    PreProcessedInput *input_b = *(PreProcessedInput **)b;
+    int capacity = bucket->capacity ? bucket->capacity * 2 : BUCKET_SIZE;
+
+    Job **values = xmalloc(sizeof(Job *) * capacity);
+    if (values == NULL) return false;
+
+    /* Unwraps the ring so the oldest element goes to index 0. */
+    for (int i = 0; i < bucket->size; i++)
+        values[i] = bucket->values[(bucket->head + i) % bucket->capacity];
+
+    free(bucket->values);
+
+    bucket->values = values;
+    bucket->head = 0;
+    bucket->capacity = capacity;
 
-    if (input_a->priority < input_b->priority) return -1;
-    if (input_a->priority > input_b->priority) return 1;
-    else return 0;
+    return true;
 }
 
 /**
- * @brief Pushes an Input element onto the PriorityQueue.
+ * @brief Pushes a job onto the PriorityQueue, after every job with the same priority.
  * 
- * @param queue Queue where to store the element.
- * @param input Element to store.
+ * @param queue Queue where to store the job.
+ * @param input Job to store (the queue keeps the pointer).
+ * @return true, if the job was pushed, false if its priority is invalid or there's no memory.
  */
-void push(PriorityQueue *queue, PreProcessedInput input)
+bool push(PriorityQueue *queue, Job *input)
 {
-    if (queue->size == QSIZE)
+    if (input->priority < 0 || input->priority >= PRIORITY_LEVELS)
     {
-        PreProcessedInput *queue_temp = realloc(queue->values, queue->size * sizeof(PreProcessedInput));
+        print_error("Invalid priority value.\n");
+        return false;
+    }
 
-        if (queue_temp == NULL) print_error("Failed to allocate memory.\n");
-        else queue->values = queue_temp;
+    Bucket *bucket = &queue->buckets[input->priority];
+    if (bucket->size == bucket->capacity && !grow_bucket(bucket))
+    {
+        print_error("Failed to allocate memory.\n");
+        return false;
     }
 
-    queue->values[queue->size] = input;
-    queue->size = queue->size + 1;
-    qsort(queue->values, queue->size, sizeof(PreProcessedInput), &compare_input);
+    bucket->values[(bucket->head + bucket->size) % bucket->capacity] = input;
+    bucket->size++;
+    queue->size++;
+
+    return true;
 }
 
 /**
- * @brief Pops the element with highest priority of the queue.
+ * @brief Pops the oldest element with highest priority of the queue.
  * 
  * @param queue Queue where to pop from.
- * @return The popped element.
+ * @return The popped job, NULL if the queue is empty.
  */
-PreProcessedInput pop(PriorityQueue *queue)
+Job *pop(PriorityQueue *queue)
 {
-
-    if (queue->size > 0)
+    for (int priority = PRIORITY_LEVELS - 1; priority >= 0 && queue->size > 0; priority--)
     {
-        PreProcessedInput elem = queue->values[queue->size - 1];
+        Bucket *bucket = &queue->buckets[priority];
+        if (bucket->size == 0) continue;
+
+        Job *elem = bucket->values[bucket->head];
+        bucket->head = (bucket->head + 1) % bucket->capacity;
+        bucket->size--;
         queue->size--;
+
         return elem;
     }
-    else 
+
+    return NULL;
+}
+
+/**
+ * @brief Removes the element at position 'index' (0 being the oldest) of a bucket.
+ * Moves the older elements, so it costs O(index).
+ */
+static Job *remove_at(Bucket *bucket, int index)
+{
+    Job *elem = bucket->values[(bucket->head + index) % bucket->capacity];
+
+    for (int i = index; i > 0; i--)
+        bucket->values[(bucket->head + i) % bucket->capacity] = bucket->values[(bucket->head + i - 1) % bucket->capacity];
+
+    bucket->head = (bucket->head + 1) % bucket->capacity;
+    bucket->size--;
+
+    return elem;
+}
+
+/**
+ * @brief Pops the first job, in priority order, whose resources fit the free ones (backfilling).
+ * A job that doesn't fit doesn't block the ones behind it, but after being overtaken 
+ * BACKFILL_SKIPS times the resources it needs are reserved: the jobs behind it are then only
+ * dispatched if they fit alongside it, so big jobs are not starved by smaller ones.
+ * 
+ * @param queue Queue where to pop from.
+ * @param config Configuration object with the limit values.
+ * @param in_use_operations Resources currently in use.
+ * @return The popped job, NULL if no queued job fits.
+ */
+Job *pop_fitting(PriorityQueue *queue, Configuration config, int *in_use_operations)
+{
+    int reserved[OP_COUNT];
+    for (int i = 0; i < OP_COUNT; i++) reserved[i] = in_use_operations[i];
+
+    Job *overtaken[BACKFILL_WINDOW];
+    int overtaken_len = 0, scanned = 0;
+    bool reserving = false;
+
+    for (int priority = PRIORITY_LEVELS - 1; priority >= 0 && scanned < BACKFILL_WINDOW; priority--)
+    {
+        Bucket *bucket = &queue->buckets[priority];
+
+        for (int i = 0; i < bucket->size && scanned < BACKFILL_WINDOW; i++, scanned++)
+        {
+            Job *elem = bucket->values[(bucket->head + i) % bucket->capacity];
+
+            if (check_execute(elem->resources, config, reserved))
+            {
+                for (int j = 0; j < overtaken_len; j++) overtaken[j]->skipped++;
+
+                queue->size--;
+                return remove_at(bucket, i);
+            }
+
+            overtaken[overtaken_len++] = elem;
+
+            /* Only the first starving job gets a reservation. */
+            if (!reserving && elem->skipped >= BACKFILL_SKIPS)
+            {
+                reserving = true;
+                for (int j = 0; j < OP_COUNT; j++) reserved[j] += elem->resources[j];
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Returns the oldest job of a priority level, without removing it.
+ *
+ * @param queue Queue to look at.
+ * @param priority Priority level.
+ * @return The oldest job with that priority, NULL if there is none.
+ */
+Job *peek_priority(PriorityQueue *queue, int priority)
+{
+    Bucket *bucket = &queue->buckets[priority];
+    return bucket->size ? bucket->values[bucket->head] : NULL;
+}
+
+/**
+ * @brief Removes a given job from the queue (eg. a cancelled job), O(jobs with its priority).
+ *
+ * @param queue Queue where the job is.
+ * @param job Job to remove.
+ * @return true, if the job was queued and was removed, false otherwise.
+ */
+bool remove_job(PriorityQueue *queue, Job *job)
+{
+    if (job->priority < 0 || job->priority >= PRIORITY_LEVELS) return false;
+
+    Bucket *bucket = &queue->buckets[job->priority];
+    for (int i = 0; i < bucket->size; i++)
+    {
+        if (bucket->values[(bucket->head + i) % bucket->capacity] != job) continue;
+
+        remove_at(bucket, i);
+        queue->size--;
+        return true;
+    }
+
+    return false;
+}
+
+/**
+ * @brief Lists the next jobs to leave the queue, in priority order (without removing them).
+ * Jobs that don't fit the free resources may be overtaken (see pop_fitting), so it is only a guess.
+ *
+ * @param queue Queue to look at.
+ * @param jobs Output array of jobs.
+ * @param max Size of the array.
+ * @return Number of jobs listed.
+ */
+int peek_jobs(PriorityQueue *queue, Job **jobs, int max)
+{
+    int len = 0;
+    for (int priority = PRIORITY_LEVELS - 1; priority >= 0 && len < max; priority--)
     {
-        PreProcessedInput error = {.valid = -1};
-        return error;
+        Bucket *bucket = &queue->buckets[priority];
+        for (int i = 0; i < bucket->size && len < max; i++)
+            jobs[len++] = bucket->values[(bucket->head + i) % bucket->capacity];
     }
+
+    return len;
 }
 
 /**
@@ -9,119 +9,1380 @@
  * 
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <signal.h>
 #include <stdbool.h>
+#include <poll.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <sys/wait.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "../includes/server.h"
+#include "../includes/utils.h"
+#include "../includes/queue.h"
+#include "../includes/execute.h"
+#include "../includes/planner.h"
+#include "../includes/cache.h"
+#include "../includes/mpsc.h"
+#include "../includes/metrics.h"
+#include "../includes/protocol.h"
+#include "../includes/jobtable.h"
+#include "../includes/worker.h"
+#include "../includes/codec.h"
+#include "../includes/coalesce.h"
+
+/**
+ * @brief Growable array of jobs (the scheduler keeps pointers, the jobs are owned elsewhere).
+ * 
+ * @param jobs Array of jobs.
+ * @param size Number of jobs.
+ * @param capacity Size of the 'jobs' array.
+ */
+typedef struct job_list
+{
+    Job **jobs;
+    int size,
+        capacity;
+
+} JobList;
+
+/**
+ * @brief Appends a job to a JobList.
+ */
+static void job_list_add(JobList *list, Job *job)
+{
+    if (list->size == list->capacity)
+    {
+        int capacity = list->capacity ? list->capacity * 2 : 64;
+        Job **jobs = realloc(list->jobs, sizeof(Job *) * capacity);
+        if (!jobs)
+        {
+            print_error("Failed to allocate memory.\n");
+            _exit(MALLOC_ERROR);
+        }
+
+        list->jobs = jobs;
+        list->capacity = capacity;
+    }
+
+    list->jobs[list->size++] = job;
+}
+
+/**
+ * @brief Removes a job from a JobList (the order is not kept).
+ */
+static void job_list_remove(JobList *list, Job *job)
+{
+    for (int i = 0; i < list->size; i++)
+    {
+        if (list->jobs[i] != job) continue;
+
+        list->jobs[i] = list->jobs[--list->size];
+        return;
+    }
+}
+
+/**
+ * @brief Takes a reference to a client connection.
+ * 
+ * @param client Connection.
+ * @return The same connection.
+ */
+static Connection *connection_acquire(Connection *client)
+{
+    __atomic_add_fetch(&client->refs, 1, __ATOMIC_RELAXED);
+    return client;
+}
+
+/**
+ * @brief Releases a reference to a client connection, the socket is closed with the last one.
+ * 
+ * @param client Connection.
+ */
+static void connection_release(Connection *client)
+{
+    if (__atomic_sub_fetch(&client->refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+
+    discard_client_messages(client);
+    pthread_mutex_destroy(&client->lock);
+    close(client->fd);
+    free(client);
+}
+
+/**
+ * @brief Sends a message about a job to the client that submitted it.
+ * 
+ * @param job Job.
+ * @param format Message, with a %llu where the job id goes.
+ */
+static void send_job_message(Job *job, const char *format)
+{
+    char message[128];
+    snprintf(message, sizeof(message), format, (unsigned long long) job->id);
+    send_status_to_client(job->client, message);
+}
+
+/**
+ * @brief Creates a Job record from a decoded job request, and plans it (see planner.c).
+ * 
+ * @param request Decoded MSG_PROC_FILE request (see protocol.c).
+ * @param client Connection of the client (the job takes a reference).
+ * @param fds Input and output descriptors passed by the client, -1 when the path is used (the job owns them).
+ * @param config Configuration object with the limit values (used by the planner).
+ * @return The job (freed with free_job), NULL if the request is invalid.
+ */
+static Job *create_job(Request *request, Connection *client, int *fds, Configuration config)
+{
+    static uint64_t job_number = 0;
+
+    if (request->priority > 5 || request->op_len == 0) return NULL;
+
+    Job *job = calloc(1, sizeof(Job));
+    if (!job) return NULL;
+
+    job->id = ++job_number;
+    job->client = connection_acquire(client);
+    job->in_fd = fds[0];
+    job->out_fd = fds[1];
+    for (int i = 0; i < MAX_OPERATIONS; i++) job->worker_fds[i] = -1;
+    job->from = strdup(request->from);
+    job->to = strdup(request->to);
+    job->priority = request->priority;
+    job->detached = request->detach;
+    job->durability = request->durability;
+    job->status = PENDING;
+
+    job->op_len = request->op_len;
+    for (int i = 0; i < job->op_len; i++) job->operations[i] = request->operations[i];
+
+    /* Description shown by status, eg. "12 proc-file -p 5 in.txt out.txt nop bcompress". */
+    size_t desc_size = strlen(job->from) + strlen(job->to) + 48 + job->op_len * 16;
+    job->desc = xmalloc(desc_size);
+
+    int written = sprintf(job->desc, "%llu proc-file -p %d %s %s", (unsigned long long) job->id, job->priority, job->from, job->to);
+    for (int i = 0; i < job->op_len; i++) written += sprintf(job->desc + written, " %s", operation_name(job->operations[i]));
+
+    plan_job(job, config);
+    return job;
+}
+
+/**
+ * @brief Frees a job created by create_job.
+ */
+static void free_job(Job *job)
+{
+    connection_release(job->client);
+    if (job->in_fd >= 0) close(job->in_fd);
+    if (job->out_fd >= 0) close(job->out_fd);
+    free(job->from);
+    free(job->to);
+    free(job->desc);
+    free(job->coalesce_key);
+    if (job->stats) munmap(job->stats, sizeof(JobStats));
+    free(job);
+}
+
+/**
+ * @brief Generates the key used to find identical jobs: same input file (device, inode, size
+ * and modification time) and same planned operations.
+ * 
+ * @param job Planned job, 'coalesce_key' is set (NULL if the job can't be coalesced, eg. the input doesn't exist).
+ */
+static void coalesce_key(Job *job)
+{
+    /* Streamed data can only be read once, and a streamed output can't be copied to other jobs. */
+    if (job->in_fd >= 0 || job->out_fd >= 0) return;
+
+    /* Nor can an output that isn't written through a temporary file (see open_output), eg. /dev/null or a FIFO. */
+    struct stat out_stat;
+    if (lstat(job->to, &out_stat) == 0 && !S_ISREG(out_stat.st_mode)) return;
+
+    struct stat in_stat;
+    if (stat(job->from, &in_stat) < 0) return;
+
+    char key[1024];
+    size_t written = snprintf(key, sizeof(key), "%lu:%lu:%lld:%ld.%09ld", 
+                              (unsigned long) in_stat.st_dev, (unsigned long) in_stat.st_ino, (long long) in_stat.st_size,
+                              (long) in_stat.st_mtim.tv_sec, (long) in_stat.st_mtim.tv_nsec);
+
+    for (int i = 0; i < job->op_len && written < sizeof(key); i++)
+        written += snprintf(key + written, sizeof(key) - written, " %d", job->operations[i]);
+
+    if (written < sizeof(key)) job->coalesce_key = strdup(key);
+}
+
+/**
+ * @brief State of the scheduler (main thread): the queue, the job lists and the resources in use.
+ * Only the scheduler thread reads or writes it, the receiver thread goes through the submission queue.
+ * 
+ * @param pqueue Queue of jobs waiting for resources.
+ * @param inflight_jobs Jobs that identical jobs can wait for (queued or executing, with a key), by key.
+ * @param running_jobs Jobs being executed by a child process.
+ * @param copying_jobs Coalesced jobs whose output is being copied by a child process.
+ * @param jobs Job table: every queued and executing job (status, wait and poll) and the results of the ended ones.
+ * @param resources Resources in use.
+ * @param workers Warm workers of each operation (empty unless the 'workers' setting is on and the tool supports it).
+ * @param prefetched Bytes of the inputs of queued jobs read ahead (at most the 'prefetch' setting).
+ * @param progress_due When the next progress messages are due (milliseconds, see monotonic_ms).
+ * @param metrics_due When the metrics are next exported (milliseconds, see monotonic_ms).
+ * @param config Configuration object with the limit values.
+ * @param exec_path Path where the executables are.
+ * @param log_file Log file descriptor.
+ * @param stats_file File where a record is appended for each completed job (see generate_stats_record).
+ */
+typedef struct scheduler
+{
+    PriorityQueue *pqueue;
+
+    CoalesceMap inflight_jobs;
+
+    JobList running_jobs,
+            copying_jobs;
+
+    JobTable jobs;
+
+    int resources[OP_COUNT];
+
+    WorkerPool workers[OP_COUNT];
+
+    long long prefetched,
+              progress_due,
+              metrics_due;
+
+    Configuration config;
+    char *exec_path;
+    int log_file,
+        stats_file;
+
+} Scheduler;
+
+/**
+ * @brief Arguments of the receiver thread.
+ * 
+ * @param submissions Queue where the requests are handed to the scheduler.
+ * @param wakeup_fd Eventfd signaled after each submission.
+ * @param flush_fd Eventfd signaled when a message is queued for a client (see send_status_to_client).
+ * @param listen_fd Listening socket where the clients connect.
+ * @param log_file Log file descriptor.
+ * @param config Configuration object (used to plan the jobs).
+ */
+typedef struct receiver_args
+{
+    MPSCQueue *submissions;
+
+    int wakeup_fd,
+        flush_fd,
+        listen_fd,
+        log_file;
+
+    Configuration config;
+
+} ReceiverArgs;
+
+/**
+ * @brief Hands a request to the scheduler (which is woken up by wake_scheduler).
+ * 
+ * @param args Receiver arguments (queue).
+ * @param status Kind of request.
+ * @param job Parsed job (PENDING), NULL otherwise.
+ * @param client Connection of the client (all but PENDING, with a reference for the scheduler), NULL otherwise.
+ * @param ids Job ids (WAIT, POLL and CANCEL), NULL otherwise.
+ * @param ids_len Number of job ids.
+ */
+static void submit(ReceiverArgs *args, Status status, Job *job, Connection *client, uint64_t *ids, int ids_len)
+{
+    Submission *submission = xmalloc(sizeof(Submission) + sizeof(uint64_t) * ids_len);
+    submission->status = status;
+    submission->job = job;
+    submission->client = client;
+    submission->ids_len = ids_len;
+    if (ids_len) memcpy(submission->ids, ids, sizeof(uint64_t) * ids_len);
+
+    mpsc_push(args->submissions, &submission->node);
+}
+
+/**
+ * @brief Wakes up the scheduler, once for every request submitted since the last wake up.
+ * 
+ * @param args Receiver arguments (eventfd).
+ */
+static void wake_scheduler(ReceiverArgs *args)
+{
+    uint64_t wakeup = 1;
+    if (write(args->wakeup_fd, &wakeup, sizeof(wakeup)) < 0)
+    {
+        print_error("Could not wake up the scheduler.\n");
+        _exit(WRITE_ERROR);
+    }
+}
+
+/**
+ * @brief Receives a packet (one frame) from a client, with the descriptors passed along with it.
+ * 
+ * @param client_fd Socket of the connection.
+ * @param frame Output buffer, FRAME_MAX_SIZE bytes.
+ * @param passed_fds Output, descriptors passed with the frame (close-on-exec), FRAME_MAX_FDS at most.
+ * @param passed_len Output, number of passed descriptors.
+ * @return Size of the packet, 0 if the client has gone away, -1 on error (see recvmsg).
+ */
+static ssize_t receive_frame(int client_fd, char *frame, int *passed_fds, int *passed_len)
+{
+    char control[CMSG_SPACE(sizeof(int) * FRAME_MAX_FDS)];
+    struct iovec iov = {.iov_base = frame, .iov_len = FRAME_MAX_SIZE};
+    struct msghdr message = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control)};
+
+    *passed_len = 0;
+
+    ssize_t size = recvmsg(client_fd, &message, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+    if (size < 0) return size;
+
+    /* Descriptors beyond FRAME_MAX_FDS are discarded by the kernel (MSG_CTRUNC). */
+    for (struct cmsghdr *control_message = CMSG_FIRSTHDR(&message); control_message; control_message = CMSG_NXTHDR(&message, control_message))
+    {
+        if (control_message->cmsg_level != SOL_SOCKET || control_message->cmsg_type != SCM_RIGHTS) continue;
+
+        int count = (control_message->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (int i = 0; i < count && *passed_len < FRAME_MAX_FDS; i++)
+            memcpy(&passed_fds[(*passed_len)++], CMSG_DATA(control_message) + i * sizeof(int), sizeof(int));
+    }
+
+    return size;
+}
+
+/**
+ * @brief Closes the descriptors passed with a frame that doesn't use them.
+ */
+static void close_passed_fds(int *passed_fds, int passed_len)
+{
+    for (int i = 0; i < passed_len; i++) close(passed_fds[i]);
+}
+
+/**
+ * @brief Handles a request (one packet) received from a client.
+ * 
+ * @param args Receiver arguments.
+ * @param client Connection of the client.
+ * @param frame Received packet.
+ * @param size Size of the packet.
+ * @param passed_fds Descriptors passed with the packet (given to the job or closed).
+ * @param passed_len Number of passed descriptors.
+ * @return true, if a request was handed to the scheduler, false otherwise.
+ */
+static bool handle_request(ReceiverArgs *args, Connection *client, char *frame, size_t size, int *passed_fds, int passed_len)
+{
+    Request request;
+    int frame_size;
+
+    /* Refusals name the request by its position, the client may have many in flight (proc-batch). */
+    char refusal[96];
+    unsigned long long position = ++client->requests;
+
+    /* Only jobs with a streamed input or output come with descriptors, one per streamed side. */
+    if (protocol_decode(frame, size, &request, &frame_size) != 1 || (size_t) frame_size != size ||
+        passed_len != (request.type == MSG_PROC_FILE ? request.stream_in + request.stream_out : 0))
+    {
+        close_passed_fds(passed_fds, passed_len);
+        print_log("Invalid frame received.\n", args->log_file, false);
+
+        sprintf(refusal, "[!] Invalid request (request %llu).\n", position);
+        send_status_to_client(client, refusal);
+        return false;
+    }
+
+    switch(request.type)
+    {
+        case MSG_HELP:
+            print_log("Help requested.\n", args->log_file, false);
+            send_help_message(client);
+            return false;
+
+        case MSG_STATUS:
+            print_log("Status requested.\n", args->log_file, false);
+            submit(args, STATUS, NULL, connection_acquire(client), NULL, 0);
+            return true;
+
+        case MSG_WAIT:
+        case MSG_POLL:
+        case MSG_CANCEL:
+            submit(args, request.type == MSG_WAIT ? WAIT : request.type == MSG_POLL ? POLL : CANCEL, 
+                   NULL, connection_acquire(client), request.ids, request.ids_len);
+            return true;
+
+        case MSG_PROC_FILE:
+            int fds[2] = {request.stream_in ? passed_fds[0] : -1, request.stream_out ? passed_fds[passed_len - 1] : -1};
+
+            Job *job = create_job(&request, client, fds, args->config);
+            if (!job)
+            {
+                close_passed_fds(passed_fds, passed_len);
+                print_log("Invalid job received.\n", args->log_file, false);
+
+                sprintf(refusal, "[!] Invalid job, priority or operations (request %llu).\n", position);
+                send_status_to_client(client, refusal);
+                return false;
+            }
+
+            send_job_message(job, "[*] Pending (job %llu)...\n");
+            submit(args, PENDING, job, NULL, NULL, 0);
+
+            print_log("New job received.\n", args->log_file, false);
+            return true;
+    }
+
+    return false;
+}
+
+/**
+ * @brief Receiver thread: accepts the client connections, reads their requests, answers help
+ * requests and hands the parsed jobs and the status requests to the scheduler. Also sends the
+ * messages queued for the clients that didn't read them in time, once they do.
+ * 
+ * @param arg ReceiverArgs.
+ * @return Never returns.
+ */
+static void *receiver(void *arg)
+{
+    ReceiverArgs *args = arg;
+
+    /* Index 0 is the listening socket, 1 the eventfd of the queued messages, the others are the client connections. */
+    int capacity = 64, count = 2;
+    struct pollfd *fds = xmalloc(sizeof(struct pollfd) * capacity);
+    Connection **clients = xmalloc(sizeof(Connection *) * capacity);
+    fds[0] = (struct pollfd) {.fd = args->listen_fd, .events = POLLIN};
+    fds[1] = (struct pollfd) {.fd = args->flush_fd, .events = POLLIN};
+
+    char frame[FRAME_MAX_SIZE];
+    while (true)
+    {
+        /* The clients with queued messages are sent them as soon as their socket is writable. */
+        for (int i = 2; i < count; i++)
+            fds[i].events = __atomic_load_n(&clients[i]->queued_bytes, __ATOMIC_RELAXED) ? POLLIN | POLLOUT : POLLIN;
+
+        if (poll(fds, count, -1) < 0)
+        {
+            if (errno == EINTR) continue;
+
+            print_error("Could not poll for events (receiver).\n");
+            _exit(READ_ERROR);
+        }
+
+        uint64_t flushes;
+        if ((fds[1].revents & POLLIN) && read(args->flush_fd, &flushes, sizeof(flushes)) < 0)
+        {
+            print_error("Could not read the queued messages eventfd (receiver).\n");
+            _exit(READ_ERROR);
+        }
+
+        bool submitted = false;
+
+        /* Backwards, so a closed connection can be replaced by the last one. */
+        for (int i = count - 1; i >= 2; i--)
+        {
+            if (fds[i].revents & POLLOUT) flush_client_messages(clients[i]);
+            if (!(fds[i].revents & ~POLLOUT)) continue;
+
+            /* Batches send many requests at once: up to RECV_BATCH of them are handled per round. */
+            ssize_t size = 1;
+            for (int received = 0; received < RECV_BATCH; received++)
+            {
+                int passed_fds[FRAME_MAX_FDS], passed_len;
+                size = receive_frame(fds[i].fd, frame, passed_fds, &passed_len);
+                if (size <= 0) break;
+
+                submitted |= handle_request(args, clients[i], frame, size, passed_fds, passed_len);
+            }
+
+            if (size > 0 || (size < 0 && (errno == EAGAIN || errno == EINTR))) continue;
+
+            /* The client has gone away, its jobs that didn't start yet won't be executed. */
+            __atomic_store_n(&clients[i]->closed, true, __ATOMIC_RELEASE);
+            connection_release(clients[i]);
+
+            count--;
+            fds[i] = fds[count];
+            clients[i] = clients[count];
+        }
+
+        if (submitted) wake_scheduler(args);
+
+        if (!(fds[0].revents & POLLIN)) continue;
+
+        int client_fd = accept4(args->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (client_fd < 0)
+        {
+            print_error("Could not accept a client connection.\n");
+            continue;
+        }
+
+        if (count == capacity)
+        {
+            capacity *= 2;
+            fds = realloc(fds, sizeof(struct pollfd) * capacity);
+            clients = realloc(clients, sizeof(Connection *) * capacity);
+            if (!fds || !clients)
+            {
+                print_error("Failed to allocate memory.\n");
+                _exit(MALLOC_ERROR);
+            }
+        }
+
+        Connection *client = xmalloc(sizeof(Connection));
+        *client = (Connection) {.fd = client_fd, .refs = 1, .flush_fd = args->flush_fd, .closed = false, .uid = (uid_t) -1};
+        pthread_mutex_init(&client->lock, NULL);
+
+        /* Unknown users can't cancel any job. */
+        struct ucred credentials;
+        socklen_t credentials_size = sizeof(credentials);
+        if (getsockopt(client_fd, SOL_SOCKET, SO_PEERCRED, &credentials, &credentials_size) == 0) client->uid = credentials.uid;
+
+        fds[count] = (struct pollfd) {.fd = client_fd, .events = POLLIN};
+        clients[count++] = client;
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Changes the status of a job, in the job and in the job table.
+ * 
+ * @param scheduler Scheduler state.
+ * @param job Job.
+ * @param status New status.
+ */
+static void set_job_status(Scheduler *scheduler, Job *job, Status status)
+{
+    job->status = status;
+
+    JobRecord *record = job_table_get(&scheduler->jobs, job->id);
+    if (record) record->status = status;
+}
+
+/**
+ * @brief Ends a job: the client and the clients waiting for it get the result, which is kept
+ * in the job table for the retention period. The job itself isn't freed.
+ * 
+ * @param scheduler Scheduler state.
+ * @param job Job that ended.
+ * @param format Message of a failure, with a %llu where the job id goes, NULL if the job completed.
+ */
+static void end_job(Scheduler *scheduler, Job *job, const char *format)
+{
+    char result[MESSAGE_MAX_SIZE];
+    bool completed = !format && generate_completed_message(result, job) == 0;
+    if (!completed) snprintf(result, sizeof(result), format ? format : "[!] Job failed (job %llu).\n", (unsigned long long) job->id);
+
+    metrics_job_ended(job, completed, monotonic_ms());
+
+    if (completed && scheduler->stats_file >= 0)
+    {
+        char record[MESSAGE_MAX_SIZE];
+        write(scheduler->stats_file, record, generate_stats_record(record, job));
+    }
+
+    send_status_to_client(job->client, result);
+
+    JobRecord *record = job_table_get(&scheduler->jobs, job->id);
+    if (!record) return;
+
+    job_table_set_ended(&scheduler->jobs, record, result, strncmp(result, "[*] Completed", 13) == 0 ? COMPLETED : FAILED);
+
+    while (record->waiters)
+    {
+        Waiter *waiter = record->waiters;
+        record->waiters = waiter->next;
+
+        send_status_to_client(waiter->client, result);
+        connection_release(waiter->client);
+        free(waiter);
+    }
+
+    job_table_expire(&scheduler->jobs, time(NULL));
+}
+
+static int compare_descriptors(const void *a, const void *b)
+{
+    return *(const int *) a - *(const int *) b;
+}
+
+/**
+ * @brief Closes, in a new child process, every descriptor inherited from the server but the
+ * standard ones and the ones it keeps. Otherwise the child would hold the descriptors passed
+ * for the other jobs (including the ones still in the submission queue), and the readers of
+ * those outputs wouldn't see the end of the data until it exits.
+ * 
+ * @param keep Descriptors kept (-1 entries are ignored, the array is sorted).
+ * @param keep_len Number of descriptors kept.
+ */
+static void close_inherited_descriptors(int *keep, int keep_len)
+{
+    if (keep_len > 1) qsort(keep, keep_len, sizeof(int), compare_descriptors);
+
+    unsigned int first = STDERR_FILENO + 1;
+    for (int i = 0; i < keep_len; i++)
+    {
+        if (keep[i] < (int) first) continue;
+
+        if (keep[i] > (int) first) close_range(first, keep[i] - 1, 0);
+        first = keep[i] + 1;
+    }
+
+    close_range(first, ~0U, 0);
+}
+
+/**
+ * @brief Queues again the jobs waiting for a job that won't give them its output: the first one
+ * is executed and the others wait for it instead.
+ * 
+ * @param scheduler Scheduler state.
+ * @param leader Job whose followers are queued again (it has none left).
+ */
+static void requeue_followers(Scheduler *scheduler, Job *leader)
+{
+    Job *follower = leader->followers;
+    leader->followers = NULL;
+    if (!follower) return;
+
+    follower->followers = follower->next;
+    follower->leader = follower->next = NULL;
+    for (Job *other = follower->followers; other; other = other->next) other->leader = follower;
+
+    if (!push(scheduler->pqueue, follower))
+    {
+        /* The others wait for it, they fail with it. */
+        end_job(scheduler, follower, "[!] Job failed (job %llu).\n");
+        while (follower->followers)
+        {
+            Job *other = follower->followers;
+            follower->followers = other->next;
+
+            end_job(scheduler, other, "[!] Job failed (job %llu).\n");
+            free_job(other);
+        }
+
+        free_job(follower);
+        return;
+    }
+
+    coalesce_map_add(&scheduler->inflight_jobs, follower);
+}
+
+/**
+ * @brief Completes every job that was waiting for a job that just finished executing. 
+ * The output the job kept for them (see keep_output) is copied (reflink or copy_file_range) to
+ * each of their output paths by a child process, so the scheduler doesn't block. The jobs end
+ * when those children are reaped. If the job didn't keep its output (eg. they joined it too late),
+ * they are queued again.
+ * 
+ * @param scheduler Scheduler state.
+ * @param leader Job that finished executing (its followers are moved to 'copying_jobs').
+ */
+static void complete_coalesced_jobs(Scheduler *scheduler, Job *leader)
+{
+    int kept_fd = leader->stats && leader->stats->output_kept ? open_kept_output(leader->to, leader->id) : -1;
+
+    /* The jobs that waited for it may have been cancelled meanwhile. */
+    if (!leader->followers)
+    {
+        if (kept_fd >= 0) close(kept_fd);
+        return;
+    }
+
+    if (kept_fd < 0)
+    {
+        print_log("Identical jobs queued again, the output wasn't kept for them (scheduler).\n", scheduler->log_file, false);
+        requeue_followers(scheduler, leader);
+        return;
+    }
+
+    while (leader->followers)
+    {
+        Job *follower = leader->followers;
+        leader->followers = follower->next;
+        follower->leader = follower->next = NULL;
+
+        set_job_status(scheduler, follower, EXECUTING);
+
+        pid_t pid = fork();
+        if (pid < 0)
+        {
+            print_error("Could not fork process @ completing coalesced job.\n");
+            end_job(scheduler, follower, "[!] Job failed (job %llu).\n");
+            free_job(follower);
+            continue;
+        }
+
+        if (pid == 0)
+        {
+            setpgid(0, 0);
+            close_inherited_descriptors(&kept_fd, 1);
+
+            int result = 0;
+            if (strcmp(leader->to, follower->to) != 0)
+            {
+                /* Opened again, so the copies of the followers don't share an offset. */
+                char kept_path[32];
+                sprintf(kept_path, "/proc/self/fd/%d", kept_fd);
+
+                bool temporary;
+                int in_fd = open(kept_path, O_RDONLY);
+                int out_fd = open_output(follower->to, follower->id, &temporary);
+
+                if (in_fd < 0 || out_fd < 0 || copy_file(in_fd, out_fd) < 0 ||
+                    publish_output(out_fd, follower->to, follower->id, follower->durability, temporary) < 0)
+                {
+                    print_error("Could not copy the output of a coalesced job.\n");
+                    result = -1;
+                }
+
+                if (in_fd >= 0) close(in_fd);
+                if (out_fd >= 0) close(out_fd);
+            }
+
+            _exit(result == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+
+        setpgid(pid, pid);
+        follower->pid = pid;
+        job_list_add(&scheduler->copying_jobs, follower);
+    }
+
+    close(kept_fd);
+}
+
+/**
+ * @brief Executes a job in a new process (cache lookup, then the operations), whose exit status
+ * tells if the job succeeded. The job's resources must already be counted as in use.
+ * 
+ * @param scheduler Scheduler state.
+ * @param job Job to execute ('pid' is set).
+ */
+static void start_job(Scheduler *scheduler, Job *job)
+{
+    /* Taken before the fork, the child only knows the sockets of its own workers. */
+    for (int i = 0; i < job->op_len; i++) job->worker_fds[i] = worker_pool_acquire(&scheduler->workers[job->operations[i]]);
+
+    /* Filled by the process of the job and its stages, read once the job is reaped. */
+    job->stats = mmap(NULL, sizeof(JobStats), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (job->stats == MAP_FAILED) job->stats = NULL;
+    if (job->stats && job->followers) job->stats->keep_output = true;
+
+    pid_t exec_fork = fork();
+    if (exec_fork < 0)
+    {
+        print_error("Could not fork process @ executing job.\n");
+        _exit(FORK_ERROR);
+    }
+
+    if (exec_fork == 0)
+    {
+        /* Every process of the job (see execute) is in this group, so a single kill reaches the whole pipeline. */
+        setpgid(0, 0);
+
+        int keep[MAX_OPERATIONS + 3] = {scheduler->log_file, job->in_fd, job->out_fd};
+        memcpy(keep + 3, job->worker_fds, sizeof(int) * job->op_len);
+        close_inherited_descriptors(keep, job->op_len + 3);
+
+        sigset_t sigchld_mask;
+        sigemptyset(&sigchld_mask);
+        sigaddset(&sigchld_mask, SIGCHLD);
+        sigprocmask(SIG_UNBLOCK, &sigchld_mask, NULL);
+        signal(SIGPIPE, SIG_DFL);
+
+        /* Identical input and operations already executed: just copy the output. */
+        char cache_id[CACHE_KEY_SIZE];
+        bool cacheable = cache_enabled() && job->in_fd < 0 && job->out_fd < 0 && cache_key(*job, cache_id) == 0;
+        int result = 0;
+
+        if (cacheable && cache_fetch(cache_id, *job))
+        {
+            print_log("Job output served from the cache.\n", scheduler->log_file, false);
+        }
+        else
+        {
+            print_log("Executing a job.\n", scheduler->log_file, false);
+            result = execute(*job, scheduler->exec_path, scheduler->config.pipe_size, cacheable ? cache_id : NULL);
+        }
+
+        char *exec_string = xmalloc(sizeof(char) * 128);
+        sprintf(exec_string, "Executed job (%llu).\n", (unsigned long long) job->id);
+        print_info(exec_string);
+        free(exec_string);
+
+        _exit(result == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    /* Also set by the parent, so the group exists as soon as fork returns (no race with a cancel). */
+    setpgid(exec_fork, exec_fork);
+
+    job->pid = exec_fork;
+    job->started = monotonic_ms();
+    set_job_status(scheduler, job, EXECUTING);
+    job_list_add(&scheduler->running_jobs, job);
+}
+
+/**
+ * @brief Preemption mode: when the oldest queued priority 5 job doesn't fit the free resources,
+ * stops (SIGSTOP to their process groups) executing jobs with a lower priority until it fits,
+ * lowest priority and newest first. Their resources are released until they are resumed.
+ * Nothing is stopped if stopping every candidate still wouldn't be enough.
+ * 
+ * @param scheduler Scheduler state.
+ * @return true, if jobs were stopped (the priority 5 job fits now), false otherwise.
+ */
+static bool preempt_jobs(Scheduler *scheduler)
+{
+    Job *urgent = peek_priority(scheduler->pqueue, PRIORITY_LEVELS - 1);
+    if (!urgent) return false;
+
+    int freed[OP_COUNT];
+    for (int i = 0; i < OP_COUNT; i++) freed[i] = scheduler->resources[i];
+
+    Job *victims[scheduler->running_jobs.size + 1];
+    int victims_len = 0;
+
+    while (!check_execute(urgent->resources, scheduler->config, freed))
+    {
+        Job *victim = NULL;
+        for (int i = 0; i < scheduler->running_jobs.size; i++)
+        {
+            Job *job = scheduler->running_jobs.jobs[i];
+            if (job->stopped || job->cancelled || job->priority >= urgent->priority) continue;
+
+            /* Only jobs using some of the operations of the urgent job help. */
+            bool helps = false;
+            for (int j = 0; j < OP_COUNT && !helps; j++) helps = job->resources[j] && urgent->resources[j];
+
+            bool chosen = false;
+            for (int j = 0; j < victims_len && !chosen; j++) chosen = victims[j] == job;
+
+            if (!helps || chosen) continue;
+            if (!victim || job->priority < victim->priority || (job->priority == victim->priority && job->id > victim->id))
+                victim = job;
+        }
+
+        if (!victim) return false;
+
+        victims[victims_len++] = victim;
+        for (int i = 0; i < OP_COUNT; i++) freed[i] -= victim->resources[i];
+    }
+
+    int stopped = 0;
+    for (int i = 0; i < victims_len; i++)
+    {
+        if (kill(-victims[i]->pid, SIGSTOP) < 0) continue;
 
-#include "../includes/server.h"
-#include "../includes/utils.h"
-#include "../includes/queue.h"
-#include "../includes/execute.h"
-#include "../includes/llist.h"
+        stopped++;
+        victims[i]->stopped = true;
+        update_resources_usage_del(scheduler->resources, *victims[i]);
 
-/* Global Variables */
-int active_jobs = 0, 
-    job_number = 0;
+        char *stop_string = xmalloc(sizeof(char) * 96);
+        sprintf(stop_string, "Stopped job %llu for job %llu (scheduler).\n", (unsigned long long) victims[i]->id, (unsigned long long) urgent->id);
+        print_info(stop_string);
+        free(stop_string);
+    }
+
+    return victims_len > 0 && stopped == victims_len;
+}
 
 /**
- * @brief Create a PreProcessedInput object.
+ * @brief Resumes (SIGCONT) the jobs stopped by preempt_jobs that fit the free resources again, 
+ * once no priority 5 job is waiting. They go before the queued jobs, as they already hold work.
  * 
- * @param string Input string to be 'converted' to a PreProcessedInput struct.
- * @return PreProcessedInput 
+ * @param scheduler Scheduler state.
  */
-PreProcessedInput create_ppinput(char *string)
+static void resume_jobs(Scheduler *scheduler)
 {
-    PreProcessedInput p = {.valid = 1, 
-                           .id = job_number, 
-                           .desc = strdup(string), 
-                           .status = PENDING};
-    
-    char *token = strtok(string, " ");
-    p.fifo = strdup(token);
+    if (peek_priority(scheduler->pqueue, PRIORITY_LEVELS - 1)) return;
+
+    for (int i = 0; i < scheduler->running_jobs.size; i++)
+    {
+        Job *job = scheduler->running_jobs.jobs[i];
+        if (!job->stopped || !check_execute(job->resources, scheduler->config, scheduler->resources)) continue;
+
+        kill(-job->pid, SIGCONT);
+
+        job->stopped = false;
+        update_resources_usage_add(scheduler->resources, *job);
+
+        char *resume_string = xmalloc(sizeof(char) * 64);
+        sprintf(resume_string, "Resumed job %llu (scheduler).\n", (unsigned long long) job->id);
+        print_info(resume_string);
+        free(resume_string);
+    }
+}
+
+/**
+ * @brief Asks the kernel to read ahead the inputs of the next jobs to be dispatched (the first
+ * PREFETCH_JOBS of the queue), so their first stage doesn't wait for the disk once the job holds
+ * its resources. The bytes read ahead for queued jobs stay within the 'prefetch' setting, an input
+ * that doesn't fit the rest of it is only read ahead from its start.
+ *
+ * @param scheduler Scheduler state.
+ */
+static void prefetch_inputs(Scheduler *scheduler)
+{
+    Job *next_jobs[PREFETCH_JOBS];
+    int next_len = peek_jobs(scheduler->pqueue, next_jobs, PREFETCH_JOBS);
 
-    token = strtok(NULL, " ");
-    if (strcmp(token, "help") == 0)
+    for (int i = 0; i < next_len && scheduler->prefetched < scheduler->config.prefetch_size; i++)
     {
-        p.status = HELP;
-        return p;
+        Job *job = next_jobs[i];
+        if (job->prefetched) continue;
+
+        int fd = job->in_fd >= 0 ? job->in_fd : open(job->from, O_RDONLY);
+        if (fd < 0) continue;
+
+        struct stat in_stat;
+        if (fstat(fd, &in_stat) == 0 && S_ISREG(in_stat.st_mode) && in_stat.st_size > 0)
+        {
+            long long length = scheduler->config.prefetch_size - scheduler->prefetched;
+            if (in_stat.st_size < length) length = in_stat.st_size;
+
+            for (long long offset = 0; offset < length; offset += PREFETCH_CHUNK)
+                posix_fadvise(fd, offset, length - offset < PREFETCH_CHUNK ? length - offset : PREFETCH_CHUNK, POSIX_FADV_WILLNEED);
+
+            job->prefetched = length;
+            scheduler->prefetched += length;
+        }
+
+        if (fd != job->in_fd) close(fd);
     }
-    else if (strcmp(token, "status") == 0)
+}
+
+/**
+ * @brief Gives back the read ahead budget of a job leaving the queue (dispatched or cancelled).
+ *
+ * @param scheduler Scheduler state.
+ * @param job Job leaving the queue.
+ */
+static void prefetch_release(Scheduler *scheduler, Job *job)
+{
+    scheduler->prefetched -= job->prefetched;
+    job->prefetched = 0;
+}
+
+/**
+ * @brief Starts every queued job that fits the free resources (see pop_fitting), counting their
+ * resources as in use. Called whenever a job arrives or resources are released.
+ * Stopped jobs are resumed first and, in preemption mode, a priority 5 job that doesn't fit
+ * stops lower priority jobs (see preempt_jobs).
+ * 
+ * @param scheduler Scheduler state.
+ */
+static void dispatch_fitting_jobs(Scheduler *scheduler)
+{
+    if (scheduler->config.preemption) resume_jobs(scheduler);
+
+    while (!is_empty(scheduler->pqueue))
     {
-        p.status = STATUS;
-        return p;
+        Job *job_to_send = pop_fitting(scheduler->pqueue, scheduler->config, scheduler->resources);
+        if (!job_to_send)
+        {
+            if (scheduler->config.preemption && preempt_jobs(scheduler)) continue;
+
+            metrics_slot_denied();
+            break;
+        }
+
+        prefetch_release(scheduler, job_to_send);
+
+        /* Nobody is waiting for the output (unless the job is detached or identical jobs of other clients wait for it). */
+        if (__atomic_load_n(&job_to_send->client->closed, __ATOMIC_ACQUIRE) && !job_to_send->detached && !job_to_send->followers)
+        {
+            print_log("Job dropped, the client has gone away (scheduler).\n", scheduler->log_file, false);
+
+            if (job_to_send->coalesce_key) coalesce_map_remove(&scheduler->inflight_jobs, job_to_send);
+            end_job(scheduler, job_to_send, "[!] Job dropped, the client has gone away (job %llu).\n");
+            free_job(job_to_send);
+            continue;
+        }
+
+        char *pop_string = xmalloc(sizeof(char) * 64);
+        sprintf(pop_string, "Pop request received from job %llu (scheduler).\n", (unsigned long long) job_to_send->id);
+        print_info(pop_string);
+        free(pop_string);
+
+        /* Resources are taken right away, so the next pop already sees them in use. */
+        update_resources_usage_add(scheduler->resources, *job_to_send);
+
+        start_job(scheduler, job_to_send);
     }
 
-    token = strtok(NULL, " ");
-    if (strcmp(token, "-p") == 0)
+    /* The jobs left in the queue changed: the next ones get their inputs read ahead. */
+    if (scheduler->config.prefetch_size > 0) prefetch_inputs(scheduler);
+}
+
+/**
+ * @brief Queues a new job (or attaches it to an identical one), then starts the jobs that fit.
+ * 
+ * @param scheduler Scheduler state.
+ * @param job Parsed and planned job (owned by the scheduler from now on).
+ */
+static void schedule_job(Scheduler *scheduler, Job *job)
+{
+    print_log("Push requested received (scheduler).\n", scheduler->log_file, false);
+    metrics_job_submitted(job);
+
+    job_table_add(&scheduler->jobs, job);
+
+    int no_resources[OP_COUNT] = {0};
+    if (!check_execute(job->resources, scheduler->config, no_resources))
     {
-        token = strtok(NULL, " ");
-        p.priority = atoi(token);
+        print_log("Job needs more resources than the configuration allows (scheduler).\n", scheduler->log_file, false);
+        end_job(scheduler, job, "[!] Job needs more resources than the server allows (job %llu).\n");
+
+        free_job(job);
+        return;
     }
-    else p.priority = 0;
 
-    if (p.priority < 0 || p.priority > 5)
+    /* An identical job is queued or executing: wait for it instead of executing again. */
+    coalesce_key(job);
+    Job *leader = job->coalesce_key ? coalesce_map_find(&scheduler->inflight_jobs, job) : NULL;
+
+    set_job_status(scheduler, job, QUEUED);
+    job->queued = monotonic_ms();
+
+    char *push_string = xmalloc(sizeof(char) * 64);
+    sprintf(push_string, "Push request received from job %llu (scheduler).\n", (unsigned long long) job->id);
+    print_info(push_string);
+    free(push_string);
+
+    /* Sent before the job can start, so it always comes before the completion message. */
+    send_job_message(job, "[*] Job queued (job %llu)...\n");
+
+    if (leader)
+    {
+        job->next = leader->followers;
+        job->leader = leader;
+        leader->followers = job;
+
+        /* An executing job is told to keep its output for it (see keep_output). */
+        if (leader->stats) __atomic_store_n(&leader->stats->keep_output, true, __ATOMIC_RELEASE);
+
+        print_log("Job coalesced with an identical job (scheduler).\n", scheduler->log_file, false);
+    }
+    else if (push(scheduler->pqueue, job))
+    {
+        if (job->coalesce_key) coalesce_map_add(&scheduler->inflight_jobs, job);
+    }
+    else
     {
-        print_error("Invalid priority value.\n");
-        p.valid = -1;
+        end_job(scheduler, job, "[!] Job failed (job %llu).\n");
+        free_job(job);
     }
 
-    job_number++;
-    return p;
+    dispatch_fitting_jobs(scheduler);
+}
+
+/**
+ * @brief Sends the status of the server (queued and executing jobs, resources) to a client.
+ * 
+ * @param scheduler Scheduler state.
+ * @param client Connection of the client.
+ */
+static void send_server_status(Scheduler *scheduler, Connection *client)
+{
+    print_log("Status message received (scheduler).\n", scheduler->log_file, false);
+
+    char *status_first_half = generate_status_message_from_queued(&scheduler->jobs);
+    char *second_status_half = generate_status_message_from_executing(&scheduler->jobs);
+
+    char *third_status_half = xmalloc(sizeof(char) * 2048);
+    generate_status_message_from_resources(third_status_half, scheduler->resources, scheduler->config, cache_get_stats());
+
+    char *status = xmalloc(sizeof(char) * (strlen(status_first_half) + strlen(second_status_half) + strlen(third_status_half) + 32));
+    sprintf(status, "[SERVER STATUS] %s%s%s\n", status_first_half, second_status_half, third_status_half);
+
+    send_status_to_client(client, status);
+    free(status_first_half); free(second_status_half); free(third_status_half); free(status);
 }
 
 /**
- * @brief Populates an Job struct when given a valid string.
+ * @brief Gives the workers used by a job back to their pools.
  * 
- * @param base Input string to be 'converted' to a Job struct.
- * @param exec_path Path where the custom (or not) executables are.
+ * @param scheduler Scheduler state.
+ * @param job Job that ended.
+ * @param clean Whether the job succeeded (otherwise its workers are restarted).
  */
-Job create_job(char *base, char *exec_path)
+static void release_workers(Scheduler *scheduler, Job *job, bool clean)
 {
-    /* stc_19284 proc-file -p 5 tests/in1.txt tests/out1.txt nop bcompress encrypt */
-    Job job = {.desc = strdup(base),
-               .op_len = total_operations(strdup(base))};
+    for (int i = 0; i < job->op_len; i++)
+    {
+        if (job->worker_fds[i] < 0) continue;
 
-    char *token = strtok(base, " "); /* fifo */
-    job.fifo = strdup(token);
+        worker_pool_release(&scheduler->workers[job->operations[i]], job->worker_fds[i], clean);
+        job->worker_fds[i] = -1;
+    }
+}
 
-    token = strtok(NULL, " "); /* job type */
-    token = strtok(NULL, " "); /* -p ? */
+/**
+ * @brief Message sent when a job ends without its output (see end_job).
+ */
+static const char *failure_format(Job *job)
+{
+    return job->cancelled ? "[!] Job cancelled (job %llu).\n" : "[!] Job failed (job %llu).\n";
+}
 
-    if (strcmp(token, "-p") == 0) 
+/**
+ * @brief Reaps every child that ended. For the ones executing jobs the resources are released,
+ * the jobs waiting for them are completed and the queued jobs that now fit are started.
+ * 
+ * @param scheduler Scheduler state.
+ */
+static void reap_jobs(Scheduler *scheduler)
+{
+    pid_t ended; int wstatus;
+    while ((ended = waitpid(-1, &wstatus, WNOHANG)) > 0)
     {
-        token = strtok(NULL, " ");
-        token = strtok(NULL, " "); 
-        
-        job.from = strdup(token);
+        bool succeeded = WIFEXITED(wstatus) && WEXITSTATUS(wstatus) == EXIT_SUCCESS;
+
+        /* A worker that died is replaced. */
+        bool worker = false;
+        for (int i = 0; i < OP_COUNT && !worker; i++) worker = worker_pool_reap(&scheduler->workers[i], ended);
+        if (worker) continue;
+
+        Job *ended_job = NULL;
+        for (int i = 0; i < scheduler->running_jobs.size && !ended_job; i++)
+            if (scheduler->running_jobs.jobs[i]->pid == ended) ended_job = scheduler->running_jobs.jobs[i];
+
+        /* Child that copied the output of a coalesced job. */
+        if (!ended_job)
+        {
+            for (int i = 0; i < scheduler->copying_jobs.size && !ended_job; i++)
+                if (scheduler->copying_jobs.jobs[i]->pid == ended) ended_job = scheduler->copying_jobs.jobs[i];
+
+            if (!ended_job) continue;
+            job_list_remove(&scheduler->copying_jobs, ended_job);
+            if (!succeeded) discard_output(ended_job->to, ended_job->id);
+
+            end_job(scheduler, ended_job, succeeded ? NULL : failure_format(ended_job));
+            free_job(ended_job);
+            continue;
+        }
+
+        job_list_remove(&scheduler->running_jobs, ended_job);
+        release_workers(scheduler, ended_job, succeeded);
+
+        /* A stopped job (preemption) already released its resources. */
+        if (!ended_job->stopped) update_resources_usage_del(scheduler->resources, *ended_job);
+
+        if (ended_job->coalesce_key) coalesce_map_remove(&scheduler->inflight_jobs, ended_job);
+
+        if (!succeeded)
+        {
+            print_log("Job failed (scheduler).\n", scheduler->log_file, false);
+
+            /* A killed job leaves its temporary output behind. */
+            if (ended_job->out_fd < 0) discard_output(ended_job->to, ended_job->id);
+
+            /* The identical jobs of a cancelled job are executed on their own, the others would fail as well. */
+            if (ended_job->cancelled && !ended_job->orphaned) requeue_followers(scheduler, ended_job);
+
+            while (ended_job->followers)
+            {
+                Job *follower = ended_job->followers;
+                ended_job->followers = follower->next;
+
+                end_job(scheduler, follower, "[!] Job failed (job %llu).\n");
+                free_job(follower);
+            }
+        }
+
+        /* An orphaned job already ended for its client (see cancel_job). */
+        if (!ended_job->orphaned) end_job(scheduler, ended_job, succeeded ? NULL : failure_format(ended_job));
+        complete_coalesced_jobs(scheduler, ended_job);
+
+        free_job(ended_job);
     }
-    else job.from = strdup(token);
 
+    /* Resources were released, queued jobs may fit now. */
+    dispatch_fitting_jobs(scheduler);
+}
+
+/**
+ * @brief Bytes of the input of an executing job consumed by its first stage: counted by the
+ * stage itself if it runs in-process (or on a worker), sampled from /proc if it is an exec'd tool.
+ * The pid of the tool may be reaped (and reused) between its load and the read, or after the job
+ * process was killed, so the sample is only taken if the process is still in the job's group.
+ *
+ * @param job Executing job (with statistics).
+ * @return Bytes consumed.
+ */
+static long long job_progress(Job *job)
+{
+    StageStats *first = &job->stats->stages[0];
+    long long read_bytes, written_bytes;
+
+    int pid = __atomic_load_n(&first->pid, __ATOMIC_ACQUIRE);
+    if (pid > 0 && read_process_io(pid, job->pid, &read_bytes, &written_bytes)) return read_bytes;
 
-    token = strtok(NULL, " "); 
-    job.to = strdup(token);
+    return __atomic_load_n(&first->bytes_in, __ATOMIC_RELAXED);
+}
 
-    job.operations = malloc(sizeof(char) * job.op_len * 16); 
-    int i = 0;
+/**
+ * @brief Sends a progress message to the client of each executing job (see generate_progress_message).
+ * A client that doesn't keep up with the messages misses some, the scheduler never waits for it.
+ * 
+ * @param scheduler Scheduler state.
+ */
+static void send_progress(Scheduler *scheduler)
+{
+    long long now = monotonic_ms();
 
-    token = strtok(NULL, " ");
-    while(token) 
+    for (int i = 0; i < scheduler->running_jobs.size; i++)
     {
-        char *temp = malloc(sizeof(char) * (strlen(exec_path) + strlen(token) + 1));
-        sprintf(temp, "%s/%s", exec_path, token);
+        Job *job = scheduler->running_jobs.jobs[i];
 
-        job.operations[i++] = strdup(temp);
+        /* Jobs that just started (or are copied from the cache) are soon over, they get no progress. */
+        if (!job->stats || job->stats->stages_len == 0 || now - job->started < scheduler->config.progress_interval) continue;
+        if (job->detached || job->stopped || job->cancelled || __atomic_load_n(&job->client->closed, __ATOMIC_ACQUIRE)) continue;
 
-        free(temp);
-        token = strtok(NULL, " \n");
+        char message[256];
+        generate_progress_message(message, job, job_progress(job), now);
+        send_progress_to_client(job->client, message);
     }
+}
 
-    return job;
+/**
+ * @brief Sends the state of a job to a client (sdstore poll): its result if it ended.
+ * 
+ * @param scheduler Scheduler state.
+ * @param client Connection of the client.
+ * @param id Job id.
+ */
+static void poll_job(Scheduler *scheduler, Connection *client, uint64_t id)
+{
+    char message[128];
+    JobRecord *record = job_table_get(&scheduler->jobs, id);
+
+    if (!record) sprintf(message, "[!] Unknown job (job %llu).\n", (unsigned long long) id);
+    else if (record->result) 
+    {
+        send_status_to_client(client, record->result);
+        return;
+    }
+    else sprintf(message, "[*] %s (job %llu).\n", record->status != EXECUTING ? "Queued" : record->job->stopped ? "Stopped" : "Executing", 
+                 (unsigned long long) id);
+
+    send_status_to_client(client, message);
+}
+
+/**
+ * @brief Sends the result of each job to a client (sdstore wait) as soon as the job ends.
+ * 
+ * @param scheduler Scheduler state.
+ * @param client Connection of the client.
+ * @param ids Job ids.
+ * @param ids_len Number of job ids.
+ */
+static void wait_jobs(Scheduler *scheduler, Connection *client, uint64_t *ids, int ids_len)
+{
+    for (int i = 0; i < ids_len; i++)
+    {
+        JobRecord *record = job_table_get(&scheduler->jobs, ids[i]);
+
+        /* Unknown or ended: answered right away. */
+        if (!record || record->result)
+        {
+            poll_job(scheduler, client, ids[i]);
+            continue;
+        }
+
+        Waiter *waiter = xmalloc(sizeof(Waiter));
+        waiter->client = connection_acquire(client);
+        waiter->next = record->waiters;
+        record->waiters = waiter;
+    }
+}
+
+/**
+ * @brief Removes a queued job from the followers of the identical job it waits for.
+ * 
+ * @param job Coalesced job.
+ */
+static void remove_follower(Job *job)
+{
+    Job *leader = job->leader;
+    if (!leader) return;
+
+    for (Job **follower = &leader->followers; *follower; follower = &(*follower)->next)
+    {
+        if (*follower != job) continue;
+
+        *follower = job->next;
+        break;
+    }
+
+    job->leader = NULL;
+    job->next = NULL;
+
+    /* A cancelled job only executes for the jobs that wait for it. */
+    if (leader->orphaned && !leader->followers) kill(-leader->pid, SIGKILL);
+}
+
+/**
+ * @brief Cancels a job (sdstore cancel), if the client's user submitted it (or is root). A queued
+ * job leaves the queue and ends right away, the identical jobs waiting for it are queued again.
+ * An executing job has its process group killed and ends when it's reaped (which releases its
+ * resources), unless identical jobs wait for it: it then ends right away for its client but keeps
+ * executing for them, and its output is only copied to theirs.
+ * 
+ * @param scheduler Scheduler state.
+ * @param client Connection of the client.
+ * @param id Job id.
+ */
+static void cancel_job(Scheduler *scheduler, Connection *client, uint64_t id)
+{
+    char message[128];
+    JobRecord *record = job_table_get(&scheduler->jobs, id);
+    Job *job = record ? record->job : NULL;
+
+    if (!record) sprintf(message, "[!] Unknown job (job %llu).\n", (unsigned long long) id);
+    else if (!job) sprintf(message, "[!] Job already ended (job %llu).\n", (unsigned long long) id);
+    else if (client->uid != 0 && (client->uid == (uid_t) -1 || client->uid != job->client->uid))
+        sprintf(message, "[!] Job of another user, it can't be cancelled (job %llu).\n", (unsigned long long) id);
+    else
+    {
+        print_log("Job cancelled (scheduler).\n", scheduler->log_file, false);
+        sprintf(message, "[*] Job cancelled (job %llu).\n", (unsigned long long) id);
+
+        job->cancelled = true;
+        if (job->status == EXECUTING && job->followers && job->stats)
+        {
+            job->orphaned = true;
+            __atomic_store_n(&job->stats->unpublished, true, __ATOMIC_RELEASE);
+            end_job(scheduler, job, failure_format(job));
+        }
+        else if (job->status == EXECUTING) kill(-job->pid, SIGKILL);
+        else
+        {
+            if (!remove_job(scheduler->pqueue, job)) remove_follower(job);
+            prefetch_release(scheduler, job);
+            if (job->coalesce_key) coalesce_map_remove(&scheduler->inflight_jobs, job);
+
+            requeue_followers(scheduler, job);
+            end_job(scheduler, job, failure_format(job));
+            free_job(job);
+        }
+    }
+
+    send_status_to_client(client, message);
+
+    /* The cancelled job may have been a priority 5 job holding back stopped jobs, or a reservation. */
+    dispatch_fitting_jobs(scheduler);
 }
 
 /**
@@ -138,9 +1399,6 @@ int main(int argc, char *argv[])
     argv[0]: executable name
     argv[1]: configuration file
     argv[2]: operations directory
-
-    fd[0] - read
-    fd[1] - write
     */
 
    /* If the command is './server help' print the help menu. */
@@ -156,640 +1414,190 @@ int main(int argc, char *argv[])
         return FORMAT_ERROR;
     }
 
-    /* Opening communication with the client (client to server). */
-    int client_to_server;
-    const char *cts_fifo = "tmp/cts";
-    mkfifo(cts_fifo, 0666);
-
     print_info("Server is online!\n");
 
-    /* Set up of the genereal job queue and config struct containing the max amount of resources. */
-    Configuration config = generate_config(argv[1]);
+    /* Set up of the scheduler state: job queue and config struct containing the max amount of resources. */
+    Scheduler scheduler = {.config = generate_config(argv[1]), .exec_path = argv[2]};
+    cache_init(scheduler.config.cache_size);
+    job_table_init(&scheduler.jobs, scheduler.config.retention);
+    coalesce_map_init(&scheduler.inflight_jobs);
     
-    PriorityQueue *pqueue = malloc(sizeof(PriorityQueue) + sizeof(PreProcessedInput) * QSIZE);
-    init_queue(pqueue);
+    scheduler.pqueue = xmalloc(sizeof(PriorityQueue));
+    init_queue(scheduler.pqueue);
 
     print_info("Listening for data... \n");
 
-    client_to_server = open(cts_fifo, O_RDONLY);
-    if (client_to_server < 0) /* Opening cts_fifo */
+    /* Opening communication with the clients: one connection per client, one packet per message. */
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    strncpy(address.sun_path, SOCKET_PATH, sizeof(address.sun_path) - 1);
+    unlink(SOCKET_PATH);
+
+    int listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *) &address, sizeof(address)) < 0 || listen(listen_fd, SOMAXCONN) < 0)
     {
-        print_error("Failed to open FIFO <cts in server.c>\n");
+        print_error("Failed to create the server socket.\n");
         _exit(OPEN_ERROR);
     }
 
-    int log_file = open("logs/log.txt", O_WRONLY | O_TRUNC | O_CREAT, 0666);
-    if (log_file < 0) /* Opening log file */
+    scheduler.log_file = open("logs/log.txt", O_WRONLY | O_TRUNC | O_CREAT | O_CLOEXEC, 0666);
+    if (scheduler.log_file < 0) /* Opening log file */
     {
         print_error("Failed to open log file.\n");
         _exit(OPEN_ERROR);
     }
 
-    /* In between processes pipes */
-    int input_com[2], dispacher_com[2], job_string[2], pop_com[2] , stat_com[2], 
-        exec_com[2] , check_pipe[2]   , del_pipe[2]  , add_pipe[2], ask_pipe[2];
+    /* Kept across restarts, the records are meant to be analysed later. */
+    scheduler.stats_file = open("logs/stats.jsonl", O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+    if (scheduler.stats_file < 0) print_error("Failed to open the stats file, no records are kept.\n");
+
+    /* 
+    SIGCHLD is blocked in every thread (the receiver inherits the mask) and received through a
+    signalfd, so the scheduler waits for submissions and ended jobs with a single poll.
+    */
+    sigset_t sigchld_mask;
+    sigemptyset(&sigchld_mask);
+    sigaddset(&sigchld_mask, SIGCHLD);
 
-    if (pipe(input_com)  == -1 || pipe(dispacher_com) == -1 || pipe(exec_com) == -1 ||
-        pipe(job_string) == -1 || pipe(pop_com)       == -1 || pipe(stat_com) == -1 ||
-        pipe(check_pipe) == -1 || pipe(del_pipe)      == -1 || pipe(add_pipe) == -1 || 
-        pipe(ask_pipe)   == -1 )
+    int sigchld_fd, wakeup_fd, flush_fd;
+    if (sigprocmask(SIG_BLOCK, &sigchld_mask, NULL) < 0 || (sigchld_fd = signalfd(-1, &sigchld_mask, SFD_CLOEXEC)) < 0 ||
+        (wakeup_fd = eventfd(0, EFD_CLOEXEC)) < 0 || (flush_fd = eventfd(0, EFD_CLOEXEC)) < 0)
     {
-        print_error("Something went wrong while creating the pipe.\n");
+        print_error("Could not create the scheduler file descriptors.\n");
         return PIPE_ERROR;
     }
 
-    pid_t pid_main = fork();
-    if (pid_main < 0)
+    /* A client that leaves early must not take the whole server down. */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Warm workers of the operations executed by tools (the others run in-process, see codec.c). */
+    for (int i = 0; i < OP_COUNT && scheduler.config.workers; i++)
     {
-        print_error("Something went wrong while creating a new process.\n");
-        return FORK_ERROR;
+        if (codec_from_operation(i) != CODEC_NONE) continue;
+
+        worker_pool_init(&scheduler.workers[i], i, get_operation_limit(scheduler.config, i), scheduler.exec_path);
+
+        char workers_string[96];
+        sprintf(workers_string, "%d warm workers for %s.\n", scheduler.workers[i].size, operation_name(i));
+        print_info(workers_string);
     }
 
+    MPSCQueue submissions;
+    mpsc_init(&submissions);
+
     /* 
     !Receiver
-    Listener dos pedidos enviados pelo servidor e tambem, atraves de um pipe, envia o pedido
-    para o queue manager para que este seja armazenado de acordo com a prioridade numa priority
-    queue. 
+    Listener dos pedidos enviados pelos clientes, entrega-os ao scheduler pela submission queue. 
+    */
+    ReceiverArgs receiver_args = {.submissions = &submissions, .wakeup_fd = wakeup_fd, .flush_fd = flush_fd, .listen_fd = listen_fd, 
+                                  .log_file = scheduler.log_file, .config = scheduler.config};
+
+    pthread_t receiver_thread;
+    if (pthread_create(&receiver_thread, NULL, receiver, &receiver_args) != 0)
+    {
+        print_error("Something went wrong while creating the receiver thread.\n");
+        return FORK_ERROR;
+    }
+
+    /*
+    !Scheduler
+    Queues the submitted jobs, starts the ones that fit the free resources and releases the
+    resources of the jobs that ended.
     */
-    if (pid_main == 0)
+    while (true)
     {
-        close(input_com[0]);
-        close(job_string[0]);
-        close(stat_com[0]);
+        /* The poll also wakes up for the metrics and, while jobs are executing, for their progress messages. */
+        long long now = monotonic_ms();
+        int timeout = -1;
 
-        char arguments[BUFSIZ];
-        while(true)
+        if (scheduler.config.progress_interval > 0 && scheduler.running_jobs.size > 0)
         {
-            /* 
-            Ler o valor dos argumentos enviados pelo client (str) (primeiro o tamanho e depois a string)
-            int args_len, read_bytes;
-            if ((read_bytes = read(client_to_server, &args_len, sizeof(int))) < 0) raise_read_error();
-            else if (read_bytes != 0) printf("[>] %d\n", args_len);
-            */
-
-            if (read(client_to_server, arguments, BUFSIZ) < 0) 
+            if (scheduler.progress_due <= now)
             {
-                print_error("Could not read from FIFO.\n");
-                _exit(READ_ERROR);
+                send_progress(&scheduler);
+                scheduler.progress_due = now + scheduler.config.progress_interval;
             }
-            
-            if (strncmp(arguments, "tmp", 3) == 0) 
-            {
-                char *stc_fifo = xmalloc(sizeof(char) * 1024);
-                int message_status = get_status(strdup(arguments), stc_fifo);
-
-                /* Making sure the '\0' is present to avoid any memory leaks. */
-                stc_fifo[strlen(stc_fifo)] = '\0';
-                arguments[strlen(arguments)] = '\0';
-
-                /* printf("String: %s\nSize: %ld\n", arguments, strlen(arguments));
-                printf("Status: %d\nFifo: %s\n", message_status, stc_fifo);
-                printf("Fifo size: %ld\n", strlen(stc_fifo)); */
 
-                int server_to_client = open(stc_fifo, O_WRONLY);
-                if (server_to_client < 0)
-                {
-                    print_error("Could not open server to client fifo.\n");
-                    _exit(OPEN_ERROR);
-                }
-
-                switch(message_status)
-                {
-                    case HELP:
-                        print_log("Help requested.\n", log_file, false);
-                        send_help_message(server_to_client);
-                        break;
-
-                    case STATUS:
-                        print_log("Status requested.\n", log_file, false);
-
-                        int status_signal = STAT;
-                        if (write(input_com[1], &status_signal, sizeof(int)) < 0)
-                        {
-                            print_error("Could not write 'STAT' message to input_com.\n");
-                            _exit(WRITE_ERROR);
-                        }
-
-                        /* Enviar o fifo ao q_manager pelo stat_com. */
-                        int fifo_length = strlen(stc_fifo) + 1;
-                        if (write(stat_com[1], &fifo_length, sizeof(int)) < 0)
-                        {
-                            print_error("Could not write 'fifo_length' integer to stat_com.\n");
-                            _exit(WRITE_ERROR);
-                        }
-
-                        if (write(stat_com[1], stc_fifo, fifo_length) < 0)
-                        {
-                            print_error("Could not write 'stc_fifo' fifo to stat_com.\n");
-                            _exit(WRITE_ERROR);
-                        }
-                        break;
-
-                    case PENDING:
-
-                        char *status_message = "[*] Pending...\n";
-                        if (write(server_to_client, status_message, strlen(status_message)) < 0)
-                        {
-                            print_error("Something went wrong while writing to pipe.\n");
-                            exit(WRITE_ERROR);
-                        }
-
-                        int input_length = strlen(arguments) + 1; 
-                        if (write(input_com[1], &input_length, sizeof(int)) < 0)
-                        {
-                            print_error("Something went wrong while writing to pipe.\n");
-                            _exit(WRITE_ERROR);
-                        }
-
-                        if (write(job_string[1], arguments, input_length) < 0)
-                        {
-                            print_error("Something went wrong while writing to pipe.\n");
-                            exit(WRITE_ERROR);
-                        }
-
-                        print_log("New job received.\n", log_file, false);
-                        break;
-
-                    default:
-                        break;
-                }
+            timeout = scheduler.progress_due - now;
+        }
 
-                free(stc_fifo);
-                close(server_to_client);
+        if (scheduler.config.metrics_interval > 0)
+        {
+            if (scheduler.metrics_due <= now)
+            {
+                metrics_export(scheduler.pqueue->size, scheduler.running_jobs.size, scheduler.resources, scheduler.config);
+                scheduler.metrics_due = now + scheduler.config.metrics_interval;
             }
 
-            /* Reset buffer */
-            memset(arguments, 0, BUFSIZ);
+            if (timeout < 0 || scheduler.metrics_due - now < timeout) timeout = scheduler.metrics_due - now;
         }
 
-        close(client_to_server);
-        
-        close(stat_com[1]);
-        close(input_com[1]);
-        close(job_string[1]);
+        struct pollfd events[2 + OP_COUNT * WORKER_POOL_MAX] = {{.fd = wakeup_fd, .events = POLLIN}, {.fd = sigchld_fd, .events = POLLIN}};
+        int events_len = 2;
 
-        _exit(EXIT_SUCCESS);
-    }
-    else
-    {
+        /* Restarted workers are waited for here, they join their pool once they announce themselves. */
+        long long workers_due = -1;
+        for (int i = 0; i < OP_COUNT; i++) events_len += worker_pool_watch(&scheduler.workers[i], events + events_len, now, &workers_due);
+        if (workers_due >= 0 && (timeout < 0 || workers_due - now < timeout)) timeout = workers_due - now;
 
-        pid_t pid_dispacher = fork();
-        if (pid_dispacher < 0)
+        if (poll(events, events_len, timeout) < 0)
         {
-            print_error("Something went wrong while creating a new process.\n");
-            return FORK_ERROR;
+            if (errno == EINTR) continue;
+
+            print_error("Could not poll for events (scheduler).\n");
+            _exit(READ_ERROR);
         }
 
-        if (pid_dispacher == 0)
+        /* Before reaping, which may restart workers and reuse the descriptors of the polled ones. */
+        for (int i = 0; i < OP_COUNT && events_len > 2; i++) worker_pool_started(&scheduler.workers[i], events + 2, events_len - 2);
+
+        if (events[1].revents & POLLIN)
         {
-            /*
-            !Queue Manager
-            Takes a string sent from the pipe (Receiver) and inserts the, newly originated,
-            Input struct into the priority queue.
-            */
-
-            close(stat_com[1]);
-            close(job_string[1]);
-            close(input_com[1]);
-            close(check_pipe[1]);
-            close(add_pipe[1]);
-            close(del_pipe[1]);
-
-            close(dispacher_com[0]);
-            close(pop_com[0]);
-            close(exec_com[0]);
-            close(ask_pipe[0]);
-
-            /* Queued Jobs, In Executing and Resources Struct */
-            struct Node *queued_jobs = NULL;
-            struct Node *executing_jobs = NULL;
-            int resources[7] = {0};
-
-            while (true)
+            /* Several children may end with a single signal, reap_jobs waits for all of them. */
+            struct signalfd_siginfo info;
+            if (read(sigchld_fd, &info, sizeof(info)) < 0)
             {
-                int size;
-                if (read(input_com[0], &size, sizeof(int)) < 0)
-                {
-                    print_error("Something went wrong while reading from pipe.\n");
-                    _exit(READ_ERROR);
-                }
-
-                if (size == UPDATE_ADD)
-                {
-                    int add_message_size;
-                    if (read(add_pipe[0], &add_message_size, sizeof(int)) < 0)
-                    {
-                        print_error("Could not read from add_pipe[0].\n");
-                        _exit(READ_ERROR);
-                    }
-
-                    char message[add_message_size];
-                    if (read(add_pipe[0], message, add_message_size) < 0)
-                    {
-                        print_error("Could not read from add_pipe[0].\n");
-                        _exit(READ_ERROR);
-                    }
-
-                    /* Completamente ineficiente. */
-                    Job temp_job = create_job(strdup(message), argv[2]);
-
-                    update_resources_usage_add(resources, temp_job);
-                    llist_push(&executing_jobs, message);
-
-                }
-                else if (size == UPDATE_DEL)
-                {
-                    int del_message_size;
-                    if (read(del_pipe[0], &del_message_size, sizeof(int)) < 0)
-                    {
-                        print_error("Could not read from del_pipe[0].\n");
-                        _exit(READ_ERROR);
-                    }
-
-                    char message[del_message_size];
-                    if (read(del_pipe[0], message, del_message_size) < 0)
-                    {
-                        print_error("Could not read from del_pipe[0].\n");
-                        _exit(READ_ERROR);
-                    }
-
-                    /* Completamente ineficiente. */
-                    Job temp_job = create_job(strdup(message), argv[2]);
-
-                    update_resources_usage_del(resources, temp_job);
-                    llist_delete(&executing_jobs, temp_job.fifo);
-
-                }
-                else if (size == CHECK_RESOURCES)
-                {
-                    int job_resources[7];
-                    for (int i = 0; i < 7; i++)
-                    {
-                        read(check_pipe[0], &job_resources[i], sizeof(int));
-                    }
-
-                    char *can_execute = check_execute(job_resources, config, resources) ? "ye" : "no";
-                    write(ask_pipe[1], can_execute, strlen(can_execute) + 1);
-
-                }
-                else if (size == EMPTY) /* Get status of the queue (is empty or not). */
-                {
-                    char *status = is_empty(pqueue) ? "empty" : "false";
-                    if (write(dispacher_com[1], status, strlen(status) + 1) < 0)
-                    {
-                        print_error("Could not write to server to client fifo.\n");
-                        _exit(WRITE_ERROR);
-                    }
-                }
-                else if (size == POP) /* Pop an element from the queue. */
-                {
-                    PreProcessedInput job_to_send = pop(pqueue);
-
-                    if (job_to_send.valid == -1)
-                    {
-                        char *error_status = "invalid";
-
-                        int error_length = 8;
-                        if (write(pop_com[1], &error_length, sizeof(int)) < 0)
-                        {
-                            print_error("Could not write job.desc length (POP reques) to pop_com.\n");
-                            _exit(WRITE_ERROR);
-                        }
-
-                        if (write(pop_com[1], error_status, error_length) < 0)
-                        {
-                            print_error("Could not write job.desc (POP request) to pop_com.\n");
-                            _exit(WRITE_ERROR);
-                        }
-                    }
-                    else
-                    {  
-                        char *pop_string = xmalloc(sizeof(char) * (45 + strlen(job_to_send.fifo)));
-                        sprintf(pop_string, "Pop request received from job %s (q_manager).\n", job_to_send.fifo);
-                        print_info(pop_string);
-                        free(pop_string);
-
-                        int message_length = strlen(job_to_send.desc) + 1;
-                        if (write(pop_com[1], &message_length, sizeof(int)) < 0)
-                        {
-                            print_error("Could not write job.desc length (POP reques) to pop_com.\n");
-                            _exit(WRITE_ERROR);
-                        }
-
-                        if (write(pop_com[1], job_to_send.desc, message_length) < 0)
-                        {
-                            print_error("Could not write job.desc (POP request) to pop_com.\n");
-                            _exit(WRITE_ERROR);
-                        }
-
-                        /* Using the PreProcessedInput id parameter, find the job and remove it from the queued_jobs list */
-                        llist_delete(&queued_jobs, job_to_send.fifo);
-                    }
-                    
-                }
-                else if (size == STAT) /* Retrieve informataion about the state of the queue. */
-                {
-                    print_log("Status message received (q_manager).\n", log_file, false);
-
-                    int message_length;
-                    if (read(stat_com[0], &message_length, sizeof(int)) < 0)
-                    {
-                        print_error("Something went wrong while reading 'message_length' from stat_com.\n");
-                        _exit(READ_ERROR);
-                    }                
-
-                    char received_str[message_length];  
-                    if (read(stat_com[0], received_str, message_length) < 0)
-                    {
-                        print_error("Something went wrong while reading string from stat_com.\n");
-                        _exit(READ_ERROR);
-                    }    
-
-                    char *finished_part;
-                    char *cts_fifo = strtok_r(received_str, "\n", &finished_part);  
-
-                    char *status_first_half = xmalloc(sizeof(char) * 2048);
-                    generate_status_message_from_queued(status_first_half, queued_jobs, received_str);
-
-                    char *second_status_half = xmalloc(sizeof(char) * 2048);
-                    generate_status_message_from_executing(second_status_half, executing_jobs);
-
-                    char *third_status_half = xmalloc(sizeof(char) * 2048);
-                    generate_status_message_from_resources(third_status_half, resources, config);
-
-                    char *status = xmalloc(sizeof(char) * (strlen(status_first_half) + strlen(second_status_half) + strlen(third_status_half) + 16));
-                    sprintf(status, "[SERVER STATUS] %s%s%s\n", status_first_half, second_status_half, third_status_half);
-
-                    send_status_to_client(cts_fifo, status);
-                    free(status_first_half); free(second_status_half); free(third_status_half); free(status);
-                }
-                else /* Push element to the stack. */ 
-                {
-                    if (size > 0)
-                    {
-                        char job_str[size];
-                    
-                        if (read(job_string[0], job_str, size) < 0)
-                        {
-                            print_error("Something went wrong while reading from pipe.\n");
-                            _exit(READ_ERROR);
-                        }
-
-                        job_str[size] = '\0';
-
-                        print_log("Push requested received (q_manager).\n", log_file, false);
-
-                        PreProcessedInput job = create_ppinput(strdup(job_str));
-                        
-                        // printf("Valid: %d\nPriority: %d\nDesc: %s\nFifo: %s\n", 
-                        //        job.valid, job.priority, job.desc, job.fifo);
-                        
-                        if (job.valid) 
-                        {
-                            push(pqueue, job);
-                            llist_push(&queued_jobs, job.desc);
-                        }
-
-                        char *push_string = xmalloc(sizeof(char) * (46 + strlen(job.fifo)));
-                        sprintf(push_string, "Push request received from job %s (q_manager).\n", job.fifo);
-                        print_info(push_string);
-                        free(push_string);
-
-                        int server_to_client = open(job.fifo, O_WRONLY);
-                        if (server_to_client < 0)
-                        {
-                            print_error("Could not open server to client fifo.\n");
-                            _exit(OPEN_ERROR);
-                        }
-
-                        char *queued_messase = "[*] Job queued...\n";
-                        if (write(server_to_client, queued_messase, strlen(queued_messase)) < 0)
-                        {
-                            print_error("Could not write to server to client fifo.\n");
-                            _exit(WRITE_ERROR);
-                        }
-
-                        close(server_to_client);
-                        memset(job_str, 0, size);
-                    }
-                }
+                print_error("Could not read from the SIGCHLD signalfd.\n");
+                _exit(READ_ERROR);
             }
 
-            close(dispacher_com[1]);
-            close(exec_com[1]);
-            close(pop_com[1]);
-            close(ask_pipe[1]);
-
-            close(job_string[0]);
-            close(input_com[0]);
-            close(stat_com[0]);
-            close(check_pipe[0]);
-            close(add_pipe[0]);
-            close(del_pipe[0]);
-
-            _exit(EXIT_SUCCESS);
+            reap_jobs(&scheduler);
         }
-        else
-        {
-            close(dispacher_com[1]);
-            close(pop_com[1]);
-            close(exec_com[1]);
-            close(ask_pipe[1]);
-
-            close(input_com[0]);
-            close(check_pipe[0]);
-            close(add_pipe[0]);
-            close(del_pipe[0]);
 
-            while (true)
+        if (events[0].revents & POLLIN)
+        {
+            uint64_t wakeups;
+            if (read(wakeup_fd, &wakeups, sizeof(wakeups)) < 0)
             {
-                /* Check if the queue is empty or not. */
-                /* If it has elements then we pop the queue. */
+                print_error("Could not read from the scheduler eventfd.\n");
+                _exit(READ_ERROR);
+            }
 
-                int status_message = EMPTY;
-                if (write(input_com[1], &status_message, sizeof(int)) < 0)
-                {
-                    print_error("Could not write 'EMPTY' message to input_com.\n");
-                    _exit(WRITE_ERROR);
-                }
+            MPSCNode *node;
+            while ((node = mpsc_pop(&submissions)))
+            {
+                Submission *submission = (Submission *) node;
 
-                char status[6]; /* dispacher_com : sends empty or false to is_empty. */
-                if (read(dispacher_com[0], status, 6) < 0)
+                switch (submission->status)
                 {
-                    print_error("Could not read 'EMPTY' response from dispacher_com.\n");
-                    _exit(READ_ERROR);
+                    case PENDING: schedule_job(&scheduler, submission->job); break;
+                    case STATUS:  send_server_status(&scheduler, submission->client); break;
+                    case WAIT:    wait_jobs(&scheduler, submission->client, submission->ids, submission->ids_len); break;
+                    case POLL:    poll_job(&scheduler, submission->client, submission->ids[0]); break;
+                    case CANCEL:  cancel_job(&scheduler, submission->client, submission->ids[0]); break;
+                    default: break;
                 }
 
-                status[5] = '\0';
+                if (submission->client) connection_release(submission->client);
 
-                /* If status == 'false' we pop the queue sending a POP message to input_com[0] */
-                if (strncmp(status, "false", 5) == 0)
-                {
-                    int pop_message = POP;
-                    if (write(input_com[1], &pop_message, sizeof(int)) < 0)
-                    {
-                        print_error("Could not write 'POP' to input_com.\n");
-                        _exit(WRITE_ERROR);
-                    }
-
-                    int response_size; /* size of the response string */
-                    if (read(pop_com[0], &response_size, sizeof(int)) < 0)
-                    {
-                        print_error("Could not read 'EMPTY' response from dispacher_com.\n");
-                        _exit(READ_ERROR);
-                    }
-
-                    char response_job[response_size];
-                    if (read(pop_com[0], response_job, response_size) < 0)
-                    {
-                        print_error("Could not read 'EMPTY' response from dispacher_com.\n");
-                        _exit(READ_ERROR);
-                    }
-                    
-                    if (strncmp(response_job, "invalid", 7) != 0)
-                    {
-
-                        Job current_job = create_job(strdup(response_job), argv[2]);
-                        /* Dont need to check for validity because it was already checked on PreProcessedInput. */
-
-                        // printf("From: %s\nTo: %s\n#OP: %d\nFIFO: %s\n", 
-                        //         current_job.from, current_job.to, current_job.op_len, current_job.fifo);
-                        
-                        // for (int i = 0; i < current_job.op_len; i++) printf("%s\n",current_job.operations[i]);
-
-                        bool should_wait = true;
-                        while (should_wait)
-                        {
-                            int value = CHECK_RESOURCES;
-                            if (write(input_com[1], &value, sizeof(int)) < 0)
-                            {
-                                print_error("Could not write CHECK_RESOURCES to input_com[1].\n");
-                                _exit(WRITE_ERROR);
-                            }
-
-                            int job_resources[7] = {0};
-                            get_job_resources(current_job, job_resources);
-
-                            for (int i = 0; i < 7; i++)
-                            {
-                                if (write(check_pipe[1], &job_resources[i], sizeof(int)) < 0)
-                                {
-                                    print_error("Could not write RESOURCE_VALUE to check_pipe[1].\n");
-                                    _exit(WRITE_ERROR);
-                                }
-                            }
-
-                            char can_execute[3];
-                            if (read(ask_pipe[0], can_execute, 3) < 0)
-                            {
-                                print_error("Could not read can_execute from ask_pipe[1].\n");
-                                _exit(READ_ERROR);
-                            }
-
-                            if (strncmp(can_execute, "ye", 2) == 0)
-                            {
-                                should_wait = false;
-                                // update_resources_usage_add(resources, current_job);
-
-                                /* Escrever para input_com[1] -> UPDATE_ADD */
-
-                                int add_message = UPDATE_ADD;
-                                if (write(input_com[1], &add_message, sizeof(int)) < 0)
-                                {
-                                    print_error("Could not write UPDATE_ADD to input_com[1].\n");
-                                    _exit(WRITE_ERROR);
-                                }
-
-                                int string_size = strlen(current_job.desc) + 1;
-                                if (write(add_pipe[1], &string_size, sizeof(int)) < 0)
-                                {
-                                    print_error("Could not write to add_pipe[1].\n");
-                                    _exit(WRITE_ERROR);
-                                }
-
-                                if (write(add_pipe[1], current_job.desc, string_size) < 0)
-                                {
-                                    print_error("Could not write to add_pipe[1].\n");
-                                    _exit(WRITE_ERROR);
-                                }
-
-                                pid_t exec_fork = fork();
-                                if (exec_fork < 0)
-                                {
-                                    print_error("Could not fork process @ executing job.\n");
-                                    _exit(FORK_ERROR);
-                                }
-
-                                if (exec_fork == 0)
-                                {
-                                    close(input_com[0]);
-                                    close(del_pipe[0]);
-
-                                    print_log("Executing a job.\n", log_file, false);
-                                    execute(current_job);
-
-                                    char *exec_string = xmalloc(sizeof(char) * 128);
-                                    sprintf(exec_string, "Executed job (%s).\n", current_job.fifo);
-                                    print_info(exec_string);
-                                    free(exec_string);
-
-                                    char *completed_message = xmalloc(sizeof(char) * 128);
-                                    generate_completed_message(completed_message, current_job.from, current_job.to);
-
-                                    send_status_to_client(current_job.fifo, completed_message);
-
-                                    int del_message = UPDATE_DEL;
-                                    if (write(input_com[1], &del_message, sizeof(int)) < 0)
-                                    {
-                                        print_error("Could not write UPDATE_ADD to input_com[1].\n");
-                                        _exit(WRITE_ERROR);
-                                    }
-
-                                    int string_size = strlen(current_job.desc) + 1;
-                                    if (write(del_pipe[1], &string_size, sizeof(int)) < 0)
-                                    {
-                                        print_error("Could not write to add_pipe[1].\n");
-                                        _exit(WRITE_ERROR);
-                                    }
-
-                                    if (write(del_pipe[1], current_job.desc, string_size) < 0)
-                                    {
-                                        print_error("Could not write to add_pipe[1].\n");
-                                        _exit(WRITE_ERROR);
-                                    }
-
-                                    close(input_com[0]);
-                                    close(del_pipe[0]);
-
-                                    _exit(EXIT_SUCCESS);
-                                }   
-
-                            }
-                            else print_log("Waiting for resources to clear up.\n", log_file, false);
-                        }
-                    }
-                }    
-                
-                memset(status, 0, strlen(status));
-                sleep(0.1);
+                free(submission);
             }
-
-            close(dispacher_com[0]);
-            close(exec_com[0]);
-            close(pop_com[0]);
-            close(ask_pipe[0]);
-
-            close(input_com[1]);
-            close(check_pipe[1]);
-            close(add_pipe[1]);
-            close(del_pipe[1]);
         }
-
-        wait(NULL);
     }
 
-    wait(NULL);
-
-    close(log_file);
+    close(sigchld_fd);
+    close(wakeup_fd);
+    close(listen_fd);
+    unlink(SOCKET_PATH);
+    close(scheduler.log_file);
     return 0;
-}
\ No newline at end of file
+}
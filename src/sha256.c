@@ -0,0 +1,123 @@
+#include <string.h>
+
+#include "../includes/sha256.h"
+
+static const uint32_t round_constants[64] =
+{
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint32_t rotate(uint32_t value, int bits)
+{
+    return (value >> bits) | (value << (32 - bits));
+}
+
+/**
+ * @brief Adds a 64 byte block to the hash.
+ */
+static void sha256_block(SHA256 *sha, const unsigned char *block)
+{
+    uint32_t words[64];
+    for (int i = 0; i < 16; i++)
+        words[i] = (uint32_t) block[i * 4] << 24 | (uint32_t) block[i * 4 + 1] << 16 | (uint32_t) block[i * 4 + 2] << 8 | block[i * 4 + 3];
+
+    for (int i = 16; i < 64; i++)
+    {
+        uint32_t s0 = rotate(words[i - 15], 7) ^ rotate(words[i - 15], 18) ^ (words[i - 15] >> 3);
+        uint32_t s1 = rotate(words[i - 2], 17) ^ rotate(words[i - 2], 19) ^ (words[i - 2] >> 10);
+        words[i] = words[i - 16] + s0 + words[i - 7] + s1;
+    }
+
+    uint32_t a = sha->state[0], b = sha->state[1], c = sha->state[2], d = sha->state[3],
+             e = sha->state[4], f = sha->state[5], g = sha->state[6], h = sha->state[7];
+
+    for (int i = 0; i < 64; i++)
+    {
+        uint32_t t1 = h + (rotate(e, 6) ^ rotate(e, 11) ^ rotate(e, 25)) + ((e & f) ^ (~e & g)) + round_constants[i] + words[i];
+        uint32_t t2 = (rotate(a, 2) ^ rotate(a, 13) ^ rotate(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+
+    sha->state[0] += a; sha->state[1] += b; sha->state[2] += c; sha->state[3] += d;
+    sha->state[4] += e; sha->state[5] += f; sha->state[6] += g; sha->state[7] += h;
+}
+
+/**
+ * @brief Starts a hash.
+ *
+ * @param sha Hash.
+ */
+void sha256_init(SHA256 *sha)
+{
+    *sha = (SHA256) {.state = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19}};
+}
+
+/**
+ * @brief Adds bytes to a hash.
+ *
+ * @param sha Hash.
+ * @param data Bytes.
+ * @param size Number of bytes.
+ */
+void sha256_update(SHA256 *sha, const void *data, size_t size)
+{
+    const unsigned char *bytes = data;
+    size_t filled = sha->length % 64;
+    sha->length += size;
+
+    if (filled)
+    {
+        size_t taken = size < 64 - filled ? size : 64 - filled;
+        memcpy(sha->block + filled, bytes, taken);
+        bytes += taken;
+        size -= taken;
+
+        if (filled + taken < 64) return;
+        sha256_block(sha, sha->block);
+    }
+
+    for (; size >= 64; bytes += 64, size -= 64) sha256_block(sha, bytes);
+
+    memcpy(sha->block, bytes, size);
+}
+
+/**
+ * @brief Ends a hash (the padding and the length are added).
+ *
+ * @param sha Hash, not to be updated anymore.
+ * @param digest Output, SHA256_SIZE bytes.
+ */
+void sha256_final(SHA256 *sha, unsigned char digest[SHA256_SIZE])
+{
+    uint64_t bits = sha->length * 8;
+    size_t filled = sha->length % 64;
+
+    sha->block[filled++] = 0x80;
+    if (filled > 56)
+    {
+        memset(sha->block + filled, 0, 64 - filled);
+        sha256_block(sha, sha->block);
+        filled = 0;
+    }
+
+    memset(sha->block + filled, 0, 56 - filled);
+    for (int i = 0; i < 8; i++) sha->block[56 + i] = bits >> (56 - i * 8);
+    sha256_block(sha, sha->block);
+
+    for (int i = 0; i < 8; i++)
+    {
+        digest[i * 4] = sha->state[i] >> 24;
+        digest[i * 4 + 1] = sha->state[i] >> 16;
+        digest[i * 4 + 2] = sha->state[i] >> 8;
+        digest[i * 4 + 3] = sha->state[i];
+    }
+}
@@ -9,6 +9,8 @@
  * 
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <fcntl.h>
 #include <errno.h>
@@ -16,10 +18,18 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <time.h>
+#include <poll.h>
 #include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/fs.h>
 
 #include "../includes/utils.h"
+#include "../includes/protocol.h"
+#include "../includes/metrics.h"
 
 /**
  * @brief A better version of malloc that removes the work of checking for error->
@@ -38,27 +48,236 @@ void *xmalloc(size_t size)
     return result;
 }
 
+/* Names of the operations (and of their executables), indexed by Operation. */
+static const char *operation_names[OP_COUNT] = 
+{
+    "nop", "gcompress", "gdecompress", "bcompress", "bdecompress", "encrypt", "decrypt"
+};
+
+/**
+ * @brief Returns the name of an operation, which is also the name of its executable.
+ * 
+ * @param operation Operation.
+ * @return Name of the operation, eg. "gcompress".
+ */
+const char *operation_name(Operation operation)
+{
+    return operation_names[operation];
+}
+
+/**
+ * @brief Parses the name of an operation.
+ * 
+ * @param name Operation name, eg. "gcompress".
+ * @return The operation, or OP_COUNT if the name is unknown.
+ */
+Operation operation_from_name(char *name)
+{
+    for (int i = 0; i < OP_COUNT; i++)
+        if (strcmp(name, operation_names[i]) == 0) return i;
+
+    return OP_COUNT;
+}
+
 /**
- * @brief Returns the number of operations on an input string.
+ * @brief Copies the whole content of a file into another without going through user space.
+ * Tries, in order, to reflink the file (FICLONE), 'copy_file_range', 'splice' (when one of the
+ * descriptors is a pipe) and, as a last resort, plain 'read'/'write' (eg. sockets or terminals).
  * 
- * @param string Input string.
- * @return Number of operations (int).
+ * @param in_fd File to copy from, read from its current offset.
+ * @param out_fd File to copy to.
+ * @return 0 on success, -1 on error.
+ */
+int copy_file(int in_fd, int out_fd)
+{
+    /* A clone replaces the whole output, so only an output still at its start can be cloned to. */
+    struct stat in_stat;
+    if (fstat(in_fd, &in_stat) == 0 && S_ISREG(in_stat.st_mode) && lseek(in_fd, 0, SEEK_CUR) == 0 && lseek(out_fd, 0, SEEK_CUR) == 0)
+    {
+        /* The output may be preallocated further than the clone, its end isn't the end of the data. */
+        if (ioctl(out_fd, FICLONE, in_fd) == 0) return lseek(out_fd, in_stat.st_size, SEEK_SET) < 0 ? -1 : 0;
+    }
+
+    ssize_t copied;
+    while ((copied = copy_file_range(in_fd, NULL, out_fd, NULL, 1 << 30, 0)) > 0);
+    if (copied == 0) return 0;
+
+    /* The data moves between the pipe and the other descriptor without going through userspace. */
+    while ((copied = splice(in_fd, NULL, out_fd, NULL, 1 << 30, SPLICE_F_MOVE)) > 0);
+    if (copied == 0) return 0;
+
+    char buffer[BUFSIZ];
+    while ((copied = read(in_fd, buffer, BUFSIZ)) > 0)
+    {
+        if (write(out_fd, buffer, copied) != copied) return -1;
+    }
+
+    return copied < 0 ? -1 : 0;
+}
+
+/**
+ * @brief Path of the temporary file where the output of a job is written before being published,
+ * in the directory of the output (so the rename is atomic), eg. "out/.file.txt.12.tmp".
+ *
+ * @param dest Output buffer, at least strlen(path) + 32 bytes.
+ * @param path Output path of the job.
+ * @param id Job id.
  */
-int total_operations(char *string)
+void output_temp_path(char *dest, const char *path, uint64_t id)
 {
-    /* stc_19284 proc-file -p 5 tests/in1.txt tests/out1.txt nop bcompress encrypt */   
-    char *tok = strtok(string, " ");
+    const char *name = strrchr(path, '/');
+    int dir_len = name ? name - path + 1 : 0;
 
-    int i = 0, expecting = 4;
-    while(tok != NULL) 
+    sprintf(dest, "%.*s.%s.%llu.tmp", dir_len, path, name ? name + 1 : path, (unsigned long long) id);
+}
+
+/**
+ * @brief Opens the output of a job: its temporary file (see output_temp_path), or the output itself 
+ * if it exists and isn't a regular file (eg. /dev/null or a FIFO, which can't be replaced) or is
+ * a symbolic link (written through, the link is kept).
+ * The temporary file is also readable, so a finished output can be stored in the cache (see cache_store).
+ *
+ * @param path Output path of the job.
+ * @param id Job id.
+ * @param temporary Output, whether the temporary file was opened (it must then be published).
+ * @return The descriptor, -1 on error.
+ */
+int open_output(const char *path, uint64_t id, bool *temporary)
+{
+    struct stat out_stat;
+    *temporary = lstat(path, &out_stat) < 0 || S_ISREG(out_stat.st_mode);
+    if (!*temporary) return open(path, O_WRONLY | O_TRUNC | O_CREAT, 0666);
+
+    char temp[strlen(path) + 32];
+    output_temp_path(temp, path, id);
+
+    return open(temp, O_RDWR | O_TRUNC | O_CREAT, 0666);
+}
+
+/**
+ * @brief Publishes a fully written output: flushes it as asked (see Durability) and renames the
+ * temporary file to the output path, so readers only ever see complete outputs. With
+ * DURABILITY_FDATASYNC the directory is flushed too, so the rename survives a crash.
+ * An output that already exists keeps its permissions (and its owner, when allowed).
+ * The temporary file is removed if it can't be published.
+ *
+ * @param fd Descriptor of the output (see open_output), its offset is the size of the output
+ * (the file may have been preallocated further, it is truncated there).
+ * @param path Output path of the job.
+ * @param id Job id.
+ * @param durability How the output is flushed.
+ * @param temporary Whether 'fd' is the temporary file (see open_output), nothing is done otherwise.
+ * @return 0 on success, -1 on error.
+ */
+int publish_output(int fd, const char *path, uint64_t id, Durability durability, bool temporary)
+{
+    if (!temporary) return 0;
+
+    off_t size = lseek(fd, 0, SEEK_CUR);
+    int result = size < 0 ? -1 : ftruncate(fd, size);
+
+    if (result == 0 && durability == DURABILITY_FDATASYNC) result = fdatasync(fd);
+    else if (result == 0 && durability == DURABILITY_BATCH) 
+        result = sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+
+    /* The rename replaces the inode of the output, the new one takes its attributes. */
+    struct stat out_stat;
+    if (result == 0 && stat(path, &out_stat) == 0)
     {
-        if (strcmp(tok, "-p") == 0) expecting = 6;
+        /* Only root (or the same owner) can give the file away, the job's owner is kept otherwise. */
+        if (fchown(fd, out_stat.st_uid, out_stat.st_gid) < 0 && errno != EPERM) result = -1;
+        if (result == 0) result = fchmod(fd, out_stat.st_mode & 07777);
+    }
+
+    char temp[strlen(path) + 32];
+    output_temp_path(temp, path, id);
 
-        i++;
-        tok = strtok(NULL, " \n");
+    if (result == 0) result = rename(temp, path);
+    if (result < 0)
+    {
+        unlink(temp);
+        return -1;
     }
 
-    return i - expecting;
+    if (durability == DURABILITY_FDATASYNC)
+    {
+        const char *name = strrchr(path, '/');
+        char directory[strlen(path) + 2];
+        sprintf(directory, "%.*s", name ? (int) (name - path + 1) : 1, name ? path : ".");
+
+        int dir_fd = open(directory, O_RDONLY | O_DIRECTORY);
+        if (dir_fd < 0 || fsync(dir_fd) < 0) result = -1;
+        if (dir_fd >= 0) close(dir_fd);
+    }
+
+    return result;
+}
+
+/**
+ * @brief Path where the output of a job is linked for the identical jobs waiting for it (see
+ * keep_output), next to its temporary file, eg. "out/.file.txt.12.kept".
+ */
+static void output_kept_path(char *dest, const char *path, uint64_t id)
+{
+    const char *name = strrchr(path, '/');
+    int dir_len = name ? name - path + 1 : 0;
+
+    sprintf(dest, "%.*s.%s.%llu.kept", dir_len, path, name ? name + 1 : path, (unsigned long long) id);
+}
+
+/**
+ * @brief Removes the temporary file of a job that failed (or was killed) before publishing its
+ * output, and the link kept for identical jobs, if any.
+ *
+ * @param path Output path of the job.
+ * @param id Job id.
+ */
+void discard_output(const char *path, uint64_t id)
+{
+    char temp[strlen(path) + 32];
+    output_temp_path(temp, path, id);
+    unlink(temp);
+
+    output_kept_path(temp, path, id);
+    unlink(temp);
+}
+
+/**
+ * @brief Links the temporary file of a finished output aside, before it is published, so the
+ * identical jobs waiting for it copy exactly this output: the output path itself may be a
+ * different file by the time they copy it (eg. replaced by another job).
+ *
+ * @param path Output path of the job.
+ * @param id Job id.
+ * @return 0 on success, -1 on error.
+ */
+int keep_output(const char *path, uint64_t id)
+{
+    char temp[strlen(path) + 32], kept[strlen(path) + 32];
+    output_temp_path(temp, path, id);
+    output_kept_path(kept, path, id);
+
+    unlink(kept);
+    return link(temp, kept);
+}
+
+/**
+ * @brief Opens the output kept by a job (see keep_output) and removes its link: the descriptor
+ * is the only reference left to it.
+ *
+ * @param path Output path of the job.
+ * @param id Job id.
+ * @return The descriptor, -1 on error.
+ */
+int open_kept_output(const char *path, uint64_t id)
+{
+    char kept[strlen(path) + 32];
+    output_kept_path(kept, path, id);
+
+    int fd = open(kept, O_RDONLY | O_CLOEXEC);
+    unlink(kept);
+
+    return fd;
 }
 
 /**
@@ -84,15 +303,17 @@ ssize_t read_line(int fd, char* line, size_t size)
 }
 
 /**
- * @brief Using the 'read_line' function reads six lines from the configuration file and
+ * @brief Using the 'read_line' function reads the lines of the configuration file and
  * generates and populates a Configuration object.
+ * Besides the seven operations, the file may also contain optional settings ('cache', 'retention', 'preemption', 'workers', 'prefetch', 'pipe_size', 'progress', 'metrics').
  * 
  * @param path Path from where the configuration file is.
  * @return The configuration struct fully populated.
  */
 Configuration generate_config(char *path)
 {
-    Configuration result;
+    Configuration result = {.retention = DEFAULT_RETENTION, .progress_interval = DEFAULT_PROGRESS_INTERVAL,
+                             .metrics_interval = DEFAULT_METRICS_INTERVAL};
     int conf_file = open(path, O_RDONLY);
 
     if (conf_file == -1)
@@ -103,10 +324,11 @@ Configuration generate_config(char *path)
 
     char *current_line = xmalloc(sizeof(char) * 64);
     char *rest = xmalloc(sizeof(char) * 64);
-    for (int i = 0; i < 7; i++)
+    while (read_line(conf_file, current_line, 64) > 0)
     {
-        read_line(conf_file, current_line, 64);
-        char *operation = strtok_r(current_line, " ", &rest);
+        char *operation = strtok_r(current_line, " \n", &rest);
+        if (!operation) continue; /* Empty line. */
+
         int max = atoi(rest);
 
         if (strcmp(operation, "nop") == 0) result.nop = max;
@@ -116,6 +338,14 @@ Configuration generate_config(char *path)
         else if (strcmp(operation, "gdecompress") == 0) result.gdecompress = max;
         else if (strcmp(operation, "encrypt") == 0) result.encrypt = max;
         else if (strcmp(operation, "decrypt") == 0) result.decrypt = max;
+        else if (strcmp(operation, "cache") == 0) result.cache_size = atoll(rest);
+        else if (strcmp(operation, "retention") == 0) result.retention = max;
+        else if (strcmp(operation, "preemption") == 0) result.preemption = max != 0;
+        else if (strcmp(operation, "workers") == 0) result.workers = max != 0;
+        else if (strcmp(operation, "prefetch") == 0) result.prefetch_size = atoll(rest);
+        else if (strcmp(operation, "pipe_size") == 0) result.pipe_size = max;
+        else if (strcmp(operation, "progress") == 0) result.progress_interval = max;
+        else if (strcmp(operation, "metrics") == 0) result.metrics_interval = max;
         else
         {
             write(STDERR_FILENO, "[!] Invalid configuration file.\n", 33);
@@ -132,15 +362,22 @@ Configuration generate_config(char *path)
 /**
  * @brief Function that sends to the client the usage menu of the programm.
  * 
- * @param server_to_client Named pipe where to write.
+ * @param client Connection of the client.
  */
-void send_help_message(int server_to_client)
+void send_help_message(Connection *client)
 {
     char *help_menu = "usage: ./client [mode] priority input_file output_file [operations]\n"
                       "Submit jobs to be executed.\n"
                       "Options and arguments:\n"
                       "Modes:\n"
                       "proc-file   : submit a job to the server, requires [0<=priority<=5], [input_file], [output_file] and [operations]\n"
+                      "              with --detach, prints the job id and returns right away\n"
+                      "              with --durability none|fdatasync|batch, how the output is flushed before being published (default none)\n"
+                      "              '-' as input_file (output_file) streams the standard input (output) of the client, /dev/fd/N its descriptor N\n"
+                      "wait        : wait for one or more jobs to end (./client wait <id...>)\n"
+                      "poll        : display the state of a job (./client poll <id>)\n"
+                      "cancel      : cancel a queued or executing job (./client cancel <id>)\n"
+                      "proc-batch  : submit every job of a manifest (one line per job, the proc-file arguments), reads stdin if the manifest is '-' or missing\n"
                       "status      : display a status message containing the status of the server (./client status)\n"
                       "help        : display this message (./client help)\n"
                       "Operations:\n"
@@ -153,11 +390,7 @@ void send_help_message(int server_to_client)
                       "decrypt     : decrypts the file (ccrypt)\n"
                       "Do not forget to start the server application before running a request. Otherwise you will get a deadlock.\n";
 
-    if (write(server_to_client, help_menu, strlen(help_menu) + 1) < 0)
-    {
-        print_error("Could not write into FIFO. <stc> in server.c\n");
-        _exit(WRITE_ERROR);
-    }
+    send_status_to_client(client, help_menu);
 }
 
 /**
@@ -165,7 +398,7 @@ void send_help_message(int server_to_client)
  */
 void print_server_help()
 {
-    write(STDOUT_FILENO,
+    char *help_menu = 
           "usage: ./server config-file tools\n"
           "Listen to requests from the client as jobs and execute them.\n"
           "Arguments:\n"
@@ -176,11 +409,20 @@ void print_server_help()
           "example 'config.conf' :  gcompress 10\n"
           "                         gdecompress 10\n"
           "                         encrypt 10\n"
-          "                         decrypt 10\n\n"
+          "                         decrypt 10\n"
+          "                         cache 268435456\n\n"
+          "cache          : (optional) size in bytes of the cache of job outputs, 0 or absent disables it\n"
+          "preemption     : (optional) 1 lets priority 5 jobs stop lower priority jobs until they get their resources\n"
+          "workers        : (optional) 1 keeps warm workers of the tools that support it ('--worker'), as many as the operation limit\n"
+          "prefetch       : (optional) size in bytes of the inputs of the next queued jobs read ahead into memory, 0 or absent disables it\n"
+          "pipe_size      : (optional) size in bytes of the pipes between the stages of a job (eg. 1048576), up to /proc/sys/fs/pipe-max-size\n"
+          "progress       : (optional) milliseconds between two progress messages sent to the client of an executing job (default 1000), 0 disables them\n"
+          "metrics        : (optional) milliseconds between two exports of the metrics to logs/metrics.prom, Prometheus text format (default 10000), 0 disables them\n"
           "tools          : path to where the tools nop, bcompress, bdecompress, gcompress, gdecompress, encrypt and decrypt are stored\n"
           "You can run up to 1024 concurrent requests to the server and the queue is updated from 0.2 to 0.2 seconds.\n"
-          "Larger files will take longer to process (also depend on the operations).\n"
-          ,799);
+          "Larger files will take longer to process (also depend on the operations).\n";
+
+    write(STDOUT_FILENO, help_menu, strlen(help_menu));
 }
 
 /**
@@ -207,7 +449,8 @@ void print_info(char *content)
     struct timeval time_now;
     gettimeofday(&time_now, NULL);
 
-    struct tm *time_str_tm = gmtime(&time_now.tv_sec);
+    struct tm time_buffer;
+    struct tm *time_str_tm = gmtime_r(&time_now.tv_sec, &time_buffer);
     
     char* temp = malloc(sizeof(char) * (strlen(content) + 8) + 16);
     sprintf(temp, "[at %02i:%02i:%02i:%06li] %s", 
@@ -227,9 +470,11 @@ void print_log(char *content, int log_file, bool print_to_terminal)
     struct timeval time_now;
     gettimeofday(&time_now, NULL);
 
-    struct tm *time_str_tm = gmtime(&time_now.tv_sec);
+    /* gmtime_r: the receiver and scheduler threads log at the same time. */
+    struct tm time_buffer;
+    struct tm *time_str_tm = gmtime_r(&time_now.tv_sec, &time_buffer);
     
-    char* temp = malloc(sizeof(char) * (strlen(content) + 8) + 16);
+    char* temp = malloc(sizeof(char) * (strlen(content) + 8) + 32);
     sprintf(temp, "[DEBUG at %02i:%02i:%02i:%06li] %s", 
     time_str_tm->tm_hour, time_str_tm->tm_min, time_str_tm->tm_sec, time_now.tv_usec, content);
 
@@ -240,86 +485,244 @@ void print_log(char *content, int log_file, bool print_to_terminal)
 }
 
 /**
- * @brief Generate a string containing the dump of an struct llist.
- * Exclusive for queued up jobs.
- * @param dest Destination string.
- * @param llist List to dump.
- * @param fifo_id Fifo information to be able to send to client.
+ * @brief Generates the list of the jobs with a given status, one line per job. The list is cut
+ * so the status fits in a single message (the oldest jobs are shown).
+ * 
+ * @param jobs Job table.
+ * @param status Status of the listed jobs.
+ * @param title First line.
+ * @param empty Line used if there are no jobs.
+ * @return The list (to be freed).
  */
-void generate_status_message_from_queued(char *dest, struct Node *llist, char *fifo_id)
+static char *generate_job_list(JobTable *jobs, Status status, char *title, char *empty)
 {
-    sprintf(dest, "%s\nQueued Up Jobs:\n", fifo_id);
+    size_t jobs_len;
+    Job **listed = job_table_jobs(jobs, status, &jobs_len);
 
-    struct Node *temp = llist;
-    if (temp) /* If the list contains elements... */
-    {
-        int counter = 0;
-        while (temp)
-        {   
-            char *each_job = xmalloc(sizeof(char) * 256);
-            sprintf(each_job, "[%d] %s\n", counter, temp->data);
+    size_t max_size = (MESSAGE_MAX_SIZE - 4096) / 2;
+    char *dest = xmalloc(max_size + 64);
+    size_t written = sprintf(dest, "%s", title);
 
-            strcat(dest, each_job);
+    size_t shown = 0;
+    for (; shown < jobs_len && written + strlen(listed[shown]->desc) + 1 <= max_size; shown++)
+        written += sprintf(dest + written, "%s\n", listed[shown]->desc);
 
-            temp = temp->next; counter++;
-            free(each_job);
-        }
-    }
-    else strcat(dest, "-- no jobs queued up --\n");
+    if (!jobs_len) strcpy(dest + written, empty);
+    else if (shown < jobs_len) sprintf(dest + written, "-- and %zu more --\n", jobs_len - shown);
+
+    free(listed);
+    return dest;
+}
+
+/**
+ * @brief Generates the list of the queued jobs, by id.
+ * 
+ * @param jobs Job table.
+ * @return The list (to be freed).
+ */
+char *generate_status_message_from_queued(JobTable *jobs)
+{
+    return generate_job_list(jobs, QUEUED, "\nQueued Up Jobs:\n", "-- no jobs queued up --\n");
+}
+
+/**
+ * @brief Generates the list of the executing jobs, by id.
+ * 
+ * @param jobs Job table.
+ * @return The list (to be freed).
+ */
+char *generate_status_message_from_executing(JobTable *jobs)
+{
+    return generate_job_list(jobs, EXECUTING, "In Execution Jobs:\n", "-- no jobs currently executing --\n");
 }
 
 /**
- * @brief Generate a string containing the dump of an struct llist.
- * Exclusive for in execution jobs.
- * @param dest Destination string.
- * @param llist List to dump.
+ * @brief Size of the input or the output of a job, as shown in the completed message: the
+ * size of the file, or "-" for a streamed descriptor that isn't a regular file (eg. a pipe).
+ * 
+ * @return 0 on success, -1 if the file is missing.
  */
-void generate_status_message_from_executing(char *dest, struct Node *llist)
+static int job_file_size(char *dest, int fd, char *path)
 {
-    strcpy(dest, "In Execution Jobs:\n");
+    struct stat file_stat;
+    if ((fd >= 0 ? fstat(fd, &file_stat) : stat(path, &file_stat)) < 0) return -1;
+
+    if (S_ISREG(file_stat.st_mode)) sprintf(dest, "%lld", (long long) file_stat.st_size);
+    else strcpy(dest, "-");
+
+    return 0;
+}
 
-    struct Node *temp = llist;
-    if (temp)
+/**
+ * @brief Name of a stage of a job: its operations, joined by '+' (eg. "gcompress+nop").
+ *
+ * @param dest Output buffer (at least 16 bytes per operation of the stage).
+ */
+static void stage_name(char *dest, Job *job, StageStats *stage)
+{
+    int written = 0;
+    for (int i = stage->first; i < stage->first + stage->ops && i < job->op_len; i++)
+        written += sprintf(dest + written, "%s%s", i > stage->first ? "+" : "", operation_name(job->operations[i]));
+
+    if (written == 0) dest[0] = '\0';
+}
+
+/**
+ * @brief Generates the message sent when a job completes, with the sizes of its input and output
+ * and, if it was executed, one line per stage of its pipeline (bytes, wall time and CPU time).
+ * 
+ * @param dest Output buffer (MESSAGE_MAX_SIZE bytes).
+ * @param job Job that completed.
+ * @return 0 on success, -1 if the input or the output is missing.
+ */
+int generate_completed_message(char *dest, Job *job)
+{
+    char in_size[32], out_size[32];
+    if (job_file_size(in_size, job->in_fd, job->from) < 0 || job_file_size(out_size, job->out_fd, job->to) < 0) return -1;
+
+    int written = sprintf(dest, "[*] Completed (job %llu, bytes-input: %s, bytes-output: %s)\n", (unsigned long long) job->id, in_size, out_size);
+
+    for (int i = 0; job->stats && i < job->stats->stages_len; i++)
     {
-        int counter = 0;
-        while (temp)
-        {
-            char *current_job = xmalloc(sizeof(char) * 256);
-            sprintf(current_job, "[%d] %s\n", counter, temp->data);
+        StageStats *stage = &job->stats->stages[i];
+        char name[MAX_OPERATIONS * 16];
+        stage_name(name, job, stage);
+
+        written += sprintf(dest + written, "    stage %d (%s): in %lld, out %lld, wall %.3f s, cpu %.3f s\n", i + 1, name,
+                           stage->bytes_in, stage->bytes_out, stage->wall_us / 1e6, stage->cpu_us / 1e6);
+    }
 
-            strcat(dest, current_job);
-            temp = temp->next; counter++;
+    return 0;
+}
 
-            free(current_job);
-        }
+/**
+ * @brief Generates the machine readable record of a completed job (one JSON object per line),
+ * with the statistics of each stage of its pipeline (no stages if its output was copied).
+ *
+ * @param dest Output buffer (MESSAGE_MAX_SIZE bytes).
+ * @param job Job that completed.
+ * @return Size of the record.
+ */
+int generate_stats_record(char *dest, Job *job)
+{
+    int stages_len = job->stats ? job->stats->stages_len : 0;
+    int written = sprintf(dest, "{\"job\":%llu,\"priority\":%d,\"stages\":[", (unsigned long long) job->id, job->priority);
+
+    for (int i = 0; i < stages_len; i++)
+    {
+        StageStats *stage = &job->stats->stages[i];
+        char name[MAX_OPERATIONS * 16];
+        stage_name(name, job, stage);
+
+        written += sprintf(dest + written, "%s{\"ops\":\"%s\",\"bytes_in\":%lld,\"bytes_out\":%lld,\"wall_us\":%lld,\"cpu_us\":%lld}",
+                           i ? "," : "", name, stage->bytes_in, stage->bytes_out, stage->wall_us, stage->cpu_us);
     }
-    else strcat(dest, "-- no jobs currently executing --\n");
+
+    written += sprintf(dest + written, "]}\n");
+    return written;
 }
 
-void generate_completed_message(char *dest, char *in, char *out)
+/**
+ * @brief Generates the progress message of an executing job: the input consumed by its first 
+ * stage, the throughput since it started and, if the size of the input is known, the percentage
+ * and the time left at that throughput.
+ *
+ * @param dest Output buffer.
+ * @param job Executing job.
+ * @param done Bytes of the input consumed so far.
+ * @param now Current time (milliseconds, see monotonic_ms).
+ */
+void generate_progress_message(char *dest, Job *job, long long done, long long now)
 {
-    int file_in  = open(in,  O_RDONLY),
-        file_out = open(out, O_RDONLY);
+    long long size = job->stats->input_size;
+    if (size > 0 && done > size) done = size;
+
+    double seconds = (now - job->started) / 1e3;
+    double throughput = seconds > 0 ? done / seconds : 0;
+
+    int written = sprintf(dest, "[*] Progress (job %llu): %.1f MB", (unsigned long long) job->id, done / 1e6);
+    if (size > 0) written += sprintf(dest + written, " of %.1f MB (%d%%)", size / 1e6, (int) (done * 100 / size));
+
+    written += sprintf(dest + written, ", %.1f MB/s", throughput / 1e6);
+    if (size > 0 && throughput > 0) written += sprintf(dest + written, ", ETA %.0f s", (size - done) / throughput);
+
+    sprintf(dest + written, "\n");
+}
 
-    if (file_out < 0 || file_in < 0)
+/**
+ * @brief Reads the bytes read and written so far by a process (/proc/<pid>/io), also after it
+ * ended, as long as it wasn't reaped. With a process group, the process must belong to it: both
+ * files are opened through the same /proc/<pid> directory, which stays bound to the process it
+ * was opened for, so a pid reused by another process after a reap is never read.
+ *
+ * @param pid Process.
+ * @param pgid Process group the process must belong to, 0 if any.
+ * @param read_bytes Output, bytes read (rchar).
+ * @param written_bytes Output, bytes written (wchar).
+ * @return true, if the counters were read, false otherwise (eg. the process is gone or in another group).
+ */
+bool read_process_io(int pid, int pgid, long long *read_bytes, long long *written_bytes)
+{
+    char path[32], content[512];
+    sprintf(path, "/proc/%d", pid);
+
+    int dir_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0) return false;
+
+    ssize_t size = -1;
+    if (pgid > 0)
     {
-        print_error("Could not files 'from' and 'to'.\n");
-        exit(OPEN_ERROR);
+        int stat_fd = openat(dir_fd, "stat", O_RDONLY | O_CLOEXEC);
+        if (stat_fd >= 0)
+        {
+            size = read(stat_fd, content, sizeof(content) - 1);
+            close(stat_fd);
+        }
+
+        /* The process group is the third field after the name, which ends with the last ')'. */
+        int process_group = 0;
+        if (size > 0) content[size] = '\0';
+        char *name_end = size > 0 ? strrchr(content, ')') : NULL;
+
+        if (!name_end || sscanf(name_end + 1, " %*c %*d %d", &process_group) != 1 || process_group != pgid)
+        {
+            close(dir_fd);
+            return false;
+        }
     }
 
-    int size_in  = lseek(file_in,  0, SEEK_END),
-        size_out = lseek(file_out, 0, SEEK_END);
+    int fd = openat(dir_fd, "io", O_RDONLY | O_CLOEXEC);
+    close(dir_fd);
+    if (fd < 0) return false;
+
+    size = read(fd, content, sizeof(content) - 1);
+    close(fd);
+    if (size <= 0) return false;
+
+    content[size] = '\0';
+    char *rchar = strstr(content, "rchar: "), *wchar = strstr(content, "wchar: ");
+    if (!rchar || !wchar) return false;
+
+    *read_bytes = atoll(rchar + 7);
+    *written_bytes = atoll(wchar + 7);
+    return true;
+}
+
+/**
+ * @brief Current time of the monotonic clock, in milliseconds.
+ */
+long long monotonic_ms()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
 
-    sprintf(dest, "[*] Completed (bytes-input: %d, bytes-output: %d)\n", 
-            size_in, size_out);
-     
-    close(file_in);
-    close(file_out);
+    return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
 }
 
-void generate_status_message_from_resources(char *dest, int *resources, Configuration config)
+void generate_status_message_from_resources(char *dest, int *resources, Configuration config, CacheStats *cache)
 {
     sprintf(dest,
+            "Cache (hits/misses): %ld/%ld\n"
             "Resources (using/max):\n"
             "nop:         %d/%d\n"
             "gcompress:   %d/%d\n"
@@ -328,6 +731,7 @@ void generate_status_message_from_resources(char *dest, int *resources, Configur
             "bdecompress: %d/%d\n"
             "encrypt:     %d/%d\n"
             "decrypt:     %d/%d\n",
+            cache->hits, cache->misses,
             resources[0], config.nop,
             resources[1], config.gcompress,
             resources[2], config.gdecompress,
@@ -338,22 +742,140 @@ void generate_status_message_from_resources(char *dest, int *resources, Configur
 }
 
 
-void send_status_to_client(char *fifo, char *content)
+/**
+ * @brief Frees the messages queued for a client, which won't be sent. Called with the lock held
+ * (or once the connection has no other reference).
+ * 
+ * @param client Connection of the client.
+ */
+void discard_client_messages(Connection *client)
 {
-    int server_to_client = open(fifo, O_WRONLY);
-    if (server_to_client < 0)
+    while (client->queue)
     {
-        print_error("Could not files 'server_to_client' @ send_status_to_client.\n");
-        exit(OPEN_ERROR);
+        QueuedMessage *message = client->queue;
+        client->queue = message->next;
+        free(message);
     }
 
-    if (write(server_to_client, content, strlen(content)) < 0)
+    client->queue_tail = NULL;
+    __atomic_store_n(&client->queued_bytes, 0, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Drops the connection of a client that doesn't read its messages, called with the lock
+ * held. The receiver sees the end of the connection and releases it, the jobs of the client are
+ * handled as the ones of a client that has gone away.
+ * 
+ * @param client Connection of the client.
+ */
+static void drop_client(Connection *client)
+{
+    discard_client_messages(client);
+
+    __atomic_store_n(&client->closed, true, __ATOMIC_RELEASE);
+    shutdown(client->fd, SHUT_RDWR);
+}
+
+/**
+ * @brief Sends a message to a client through its connection (one packet per message), never
+ * blocking the server: if the socket is full, the message is queued and the receiver thread
+ * sends it once the client reads (see flush_client_messages). A client that lets more than
+ * CLIENT_QUEUE_MAX bytes pile up has its connection dropped. A client that has gone away is
+ * ignored, the server keeps going.
+ * 
+ * @param client Connection of the client.
+ * @param content Message to send.
+ */
+void send_status_to_client(Connection *client, char *content)
+{
+    if (__atomic_load_n(&client->closed, __ATOMIC_ACQUIRE)) return;
+
+    size_t length = strlen(content);
+    pthread_mutex_lock(&client->lock);
+
+    /* Behind queued messages a new one is queued too, so they arrive in order. */
+    if (!client->queue)
     {
-        print_error("Could not write content to server_to_client @ send_status_to_client.\n");
-        exit(WRITE_ERROR);
+        ssize_t sent = send(client->fd, content, length, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+        {
+            if (sent < 0 && errno != EPIPE && errno != ECONNRESET)
+                print_error("Could not send a message to the client @ send_status_to_client.\n");
+
+            pthread_mutex_unlock(&client->lock);
+            return;
+        }
     }
 
-    close(server_to_client);
+    if (client->queued_bytes + length > CLIENT_QUEUE_MAX)
+    {
+        drop_client(client);
+        pthread_mutex_unlock(&client->lock);
+        return;
+    }
+
+    QueuedMessage *message = xmalloc(sizeof(QueuedMessage) + length);
+    message->next = NULL;
+    message->length = length;
+    memcpy(message->content, content, length);
+
+    bool first = !client->queue;
+    if (first) client->queue = message;
+    else client->queue_tail->next = message;
+
+    client->queue_tail = message;
+    __atomic_store_n(&client->queued_bytes, client->queued_bytes + length, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&client->lock);
+
+    /* The receiver waits for the socket to be writable from now on. */
+    uint64_t wakeup = 1;
+    if (first && write(client->flush_fd, &wakeup, sizeof(wakeup)) < 0)
+        print_error("Could not wake up the receiver @ send_status_to_client.\n");
+}
+
+/**
+ * @brief Sends a message the client may miss (progress), only if it can be sent right away and
+ * no other message is queued (it would overtake them). Never queued.
+ * 
+ * @param client Connection of the client.
+ * @param content Message to send.
+ */
+void send_progress_to_client(Connection *client, char *content)
+{
+    if (__atomic_load_n(&client->closed, __ATOMIC_ACQUIRE)) return;
+
+    pthread_mutex_lock(&client->lock);
+    if (!client->queue) send(client->fd, content, strlen(content), MSG_DONTWAIT | MSG_NOSIGNAL);
+    pthread_mutex_unlock(&client->lock);
+}
+
+/**
+ * @brief Sends the queued messages of a client, as many as its socket takes (called by the
+ * receiver thread when the socket is writable).
+ * 
+ * @param client Connection of the client.
+ */
+void flush_client_messages(Connection *client)
+{
+    pthread_mutex_lock(&client->lock);
+
+    while (client->queue)
+    {
+        QueuedMessage *message = client->queue;
+        if (send(client->fd, message->content, message->length, MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+        {
+            /* The client has gone away otherwise, nothing else is sent. */
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) discard_client_messages(client);
+            break;
+        }
+
+        client->queue = message->next;
+        if (!client->queue) client->queue_tail = NULL;
+        __atomic_store_n(&client->queued_bytes, client->queued_bytes - message->length, __ATOMIC_RELAXED);
+        free(message);
+    }
+
+    pthread_mutex_unlock(&client->lock);
 }
 
 /**
@@ -377,61 +899,60 @@ bool check_execute(int *job, Configuration config, int *in_use_operations)
     return true;
 }
 
+/**
+ * @brief Adds the resources of a job that started executing to the ones in use.
+ * 
+ * @param resources Resources in use.
+ * @param job_to_execute Job that is about to execute.
+ */
 void update_resources_usage_add(int *resources, Job job_to_execute)
 {
-    /* 0:nop 1:gcompress 2:gdecompress 3:bcompress 4:bdecompress 5:encrypt 6:decrypt */
-    for (int i = 0; i < job_to_execute.op_len; i++)
-    {
-        if      (strcmp(job_to_execute.operations[i], "./tools/nop"         ) == 0) resources[0]++;
-        else if (strcmp(job_to_execute.operations[i], "./tools/gcompress"   ) == 0) resources[1]++;
-        else if (strcmp(job_to_execute.operations[i], "./tools/gdecompress" ) == 0) resources[2]++;
-        else if (strcmp(job_to_execute.operations[i], "./tools/bcompress"   ) == 0) resources[3]++;
-        else if (strcmp(job_to_execute.operations[i], "./tools/bdecompress" ) == 0) resources[4]++;
-        else if (strcmp(job_to_execute.operations[i], "./tools/encrypt"     ) == 0) resources[5]++;
-        else resources[6]++;
-    }
+    for (int i = 0; i < OP_COUNT; i++) resources[i] += job_to_execute.resources[i];
 }
 
+/**
+ * @brief Removes the resources of a job that finished executing from the ones in use.
+ * 
+ * @param resources Resources in use.
+ * @param job_to_execute Job that finished executing.
+ */
 void update_resources_usage_del(int *resources, Job job_to_execute)
 {
-    for (int i = 0; i < job_to_execute.op_len; i++)
-    {
-        if      (strcmp(job_to_execute.operations[i], "./tools/nop"         ) == 0) resources[0]--;
-        else if (strcmp(job_to_execute.operations[i], "./tools/gcompress"   ) == 0) resources[1]--;
-        else if (strcmp(job_to_execute.operations[i], "./tools/gdecompress" ) == 0) resources[2]--;
-        else if (strcmp(job_to_execute.operations[i], "./tools/bcompress"   ) == 0) resources[3]--;
-        else if (strcmp(job_to_execute.operations[i], "./tools/bdecompress" ) == 0) resources[4]--;
-        else if (strcmp(job_to_execute.operations[i], "./tools/encrypt"     ) == 0) resources[5]--;
-        else                                                                        resources[6]--;                                                                
-    }
+    for (int i = 0; i < OP_COUNT; i++) resources[i] -= job_to_execute.resources[i];
 }
 
-int get_status(char *string, char *fifo_output)
+/**
+ * @brief Counts the resources (slots of each operation) needed to execute a job.
+ * The first operation takes one slot per segment when it is executed in parallel segments.
+ * 
+ * @param job Job to check.
+ * @param resources Output array, incremented with the resources of the job.
+ */
+void get_job_resources(Job job, int *resources)
 {
-    char *token = strtok(string, " ");   
-    if (fifo_output)
-    {
-        strcpy(fifo_output,token);
-    }
-
-    token = strtok(NULL, " ");
-    if (strcmp(token, "help") == 0) return HELP;
-    if (strcmp(token, "status") == 0) return STATUS;
-    if (strcmp(token, "proc-file") == 0) return PENDING;
-
-    return -1;
+    /* Operations are in the order of the resources array. */
+    for (int i = 0; i < job.op_len; i++)
+        resources[job.operations[i]] += i == 0 && job.segments > 1 ? job.segments : 1;
 }
 
-void get_job_resources(Job job, int *resources)
+/**
+ * @brief Returns the maximum number of concurrent executions of an operation.
+ * 
+ * @param config Configuration object with the limit values.
+ * @param operation Operation.
+ * @return The configured limit, 0 for unknown operations.
+ */
+int get_operation_limit(Configuration config, Operation operation)
 {
-    for (int i = 0; i < job.op_len; i++)
+    switch (operation)
     {
-        if      (strcmp(job.operations[i], "./tools/nop"         ) == 0) resources[0]++;
-        else if (strcmp(job.operations[i], "./tools/gcompress"   ) == 0) resources[1]++;
-        else if (strcmp(job.operations[i], "./tools/gdecompress" ) == 0) resources[2]++;
-        else if (strcmp(job.operations[i], "./tools/bcompress"   ) == 0) resources[3]++;
-        else if (strcmp(job.operations[i], "./tools/bdecompress" ) == 0) resources[4]++;
-        else if (strcmp(job.operations[i], "./tools/encrypt"     ) == 0) resources[5]++;
-        else resources[6]++;
+        case OP_NOP:         return config.nop;
+        case OP_GCOMPRESS:   return config.gcompress;
+        case OP_GDECOMPRESS: return config.gdecompress;
+        case OP_BCOMPRESS:   return config.bcompress;
+        case OP_BDECOMPRESS: return config.bdecompress;
+        case OP_ENCRYPT:     return config.encrypt;
+        case OP_DECRYPT:     return config.decrypt;
+        default:             return 0;
     }
-}
\ No newline at end of file
+}
@@ -0,0 +1,434 @@
+/**
+ * @file worker.c
+ * @author gweebg ; johnny_longo
+ * @brief Pools of warm workers for the operations executed by the tools. A tool that supports
+ * the worker mode is started once with '--worker' and then runs job after job, exchanging
+ * frames with the job stages (see WorkerFrameType), so no fork and exec is paid per job.
+ * @version 0.1
+ * @date 2022-06-02
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include <poll.h>
+#include <stdio.h>
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+
+#include "../includes/worker.h"
+#include "../includes/utils.h"
+
+/*
+Frame layout (integers in host byte order, the workers run on the same machine):
+
+    uint8 type | uint8[3] reserved | uint32 payload length | payload
+
+A job stage sends WORKER_START, its input in WORKER_DATA frames and WORKER_END, while it
+reads the output of the worker (WORKER_DATA frames) until the worker's WORKER_END.
+*/
+
+/**
+ * @brief Reads exactly 'size' bytes from a socket.
+ *
+ * @return 0 on success, -1 on error or if the socket was closed.
+ */
+static int read_full(int fd, void *buffer, size_t size)
+{
+    for (size_t done = 0; done < size; )
+    {
+        ssize_t received = recv(fd, (char *) buffer + done, size - done, MSG_WAITALL);
+        if (received < 0 && errno == EINTR) continue;
+        if (received <= 0) return -1;
+
+        done += received;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Writes exactly 'size' bytes to a file descriptor.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int write_full(int fd, const void *buffer, size_t size)
+{
+    for (size_t done = 0; done < size; )
+    {
+        ssize_t written = write(fd, (const char *) buffer + done, size - done);
+        if (written < 0 && errno == EINTR) continue;
+        if (written < 0) return -1;
+
+        done += written;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Fills the header of a frame.
+ */
+static void put_header(char *header, WorkerFrameType type, uint32_t length)
+{
+    memset(header, 0, WORKER_HEADER_SIZE);
+    header[0] = type;
+    memcpy(header + 4, &length, sizeof(length));
+}
+
+/**
+ * @brief Reads a frame sent by a worker.
+ *
+ * @param fd Socket of the worker.
+ * @param type Output, type of the frame.
+ * @param payload Output buffer, WORKER_CHUNK_SIZE bytes.
+ * @param length Output, size of the payload.
+ * @return 0 on success, -1 on error, if the worker has gone away or the frame is too big.
+ */
+static int read_frame(int fd, WorkerFrameType *type, char *payload, uint32_t *length)
+{
+    char header[WORKER_HEADER_SIZE];
+    if (read_full(fd, header, sizeof(header)) < 0) return -1;
+
+    *type = (unsigned char) header[0];
+    memcpy(length, header + 4, sizeof(*length));
+
+    if (*length > WORKER_CHUNK_SIZE) return -1;
+    return read_full(fd, payload, *length);
+}
+
+/**
+ * @brief Starts a worker: the tool of the operation, with '--worker', connected to the server
+ * through a socket. The worker isn't ready until its WORKER_READY frame is read (see
+ * worker_announced), the server doesn't wait for it here.
+ *
+ * @param pool Pool of the worker.
+ * @param worker Output, the worker ('fd' is -1 if it couldn't be started).
+ * @return true, if the worker was started, false otherwise.
+ */
+static bool worker_spawn(WorkerPool *pool, Worker *worker)
+{
+    *worker = (Worker) {.pid = -1, .fd = -1, .busy = false, .ready = false};
+
+    int ends[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, ends) < 0) return false;
+
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        close(ends[0]);
+        close(ends[1]);
+        return false;
+    }
+
+    if (pid == 0)
+    {
+        /* The server blocks SIGCHLD (signalfd) and ignores SIGPIPE, the tool gets the defaults. */
+        sigset_t sigchld_mask;
+        sigemptyset(&sigchld_mask);
+        sigaddset(&sigchld_mask, SIGCHLD);
+        sigprocmask(SIG_UNBLOCK, &sigchld_mask, NULL);
+        signal(SIGPIPE, SIG_DFL);
+
+        if (dup2(ends[1], STDIN_FILENO) < 0 || dup2(ends[1], STDOUT_FILENO) < 0) _exit(DUP2_ERROR);
+
+        char tool[strlen(pool->exec_path) + 16];
+        sprintf(tool, "%s/%s", pool->exec_path, operation_name(pool->operation));
+
+        execl(tool, tool, "--worker", NULL);
+        _exit(EXEC_ERROR);
+    }
+
+    close(ends[1]);
+
+    *worker = (Worker) {.pid = pid, .fd = ends[0], .busy = false, .ready = false, .spawned = monotonic_ms()};
+    return true;
+}
+
+/**
+ * @brief Gives up on a worker that didn't start: it is killed and its slot stays empty.
+ */
+static void worker_discard(Worker *worker)
+{
+    /* Reaped with the other children, it is no longer a worker of the pool by then. */
+    if (worker->pid > 0) kill(worker->pid, SIGKILL);
+    if (worker->fd >= 0) close(worker->fd);
+
+    *worker = (Worker) {.pid = -1, .fd = -1, .busy = false, .ready = false};
+}
+
+/**
+ * @brief Reads the first frame of a new worker, whose socket is readable.
+ *
+ * @return true, if it was WORKER_READY (the worker is then ready), false otherwise (the worker is discarded).
+ */
+static bool worker_announced(Worker *worker)
+{
+    char payload[WORKER_CHUNK_SIZE];
+    WorkerFrameType type; uint32_t length;
+
+    if (read_frame(worker->fd, &type, payload, &length) < 0 || type != WORKER_READY)
+    {
+        worker_discard(worker);
+        return false;
+    }
+
+    worker->ready = true;
+    return true;
+}
+
+/**
+ * @brief Replaces a worker by a new one (eg. it died, or a job using it didn't end cleanly and
+ * frames of that job may be left in the socket). The new worker is given to the jobs once it
+ * announces itself (see worker_pool_started).
+ */
+static void worker_restart(WorkerPool *pool, Worker *worker)
+{
+    if (worker->pid > 0) kill(worker->pid, SIGKILL);
+    if (worker->fd >= 0) close(worker->fd);
+
+    if (!worker_spawn(pool, worker)) print_error("Could not restart a worker.\n");
+}
+
+/**
+ * @brief Starts the workers of an operation and waits for them to announce themselves. If its
+ * tool doesn't announce itself as a worker, the pool stays empty and the operation keeps being
+ * executed by a new process per job.
+ *
+ * @param pool Pool to initialize.
+ * @param operation Operation of the workers.
+ * @param size Number of workers (the limit of the operation, at most WORKER_POOL_MAX).
+ * @param exec_path Path where the executables are.
+ */
+void worker_pool_init(WorkerPool *pool, Operation operation, int size, char *exec_path)
+{
+    if (size > WORKER_POOL_MAX) size = WORKER_POOL_MAX;
+    if (size < 0) size = 0;
+
+    *pool = (WorkerPool) {.operation = operation, .exec_path = exec_path};
+    pool->workers = xmalloc(sizeof(Worker) * (size ? size : 1));
+
+    for (int i = 0; i < size; i++)
+    {
+        Worker *worker = &pool->workers[i];
+        worker_spawn(pool, worker);
+
+        struct pollfd ready = {.fd = worker->fd, .events = POLLIN};
+        bool started = worker->fd >= 0 && poll(&ready, 1, WORKER_READY_TIMEOUT) == 1 && worker_announced(worker);
+        if (!started) worker_discard(worker);
+
+        /* The first worker tells if the tool supports the worker mode at all. */
+        if (!started && i == 0) return;
+        pool->size++;
+    }
+}
+
+/**
+ * @brief Takes an idle worker for a job stage.
+ *
+ * @param pool Pool of the operation.
+ * @return Socket of the worker, -1 if every worker is busy (the stage then runs the tool as usual).
+ */
+int worker_pool_acquire(WorkerPool *pool)
+{
+    for (int i = 0; i < pool->size; i++)
+    {
+        Worker *worker = &pool->workers[i];
+        if (worker->busy || !worker->ready) continue;
+
+        worker->busy = true;
+        return worker->fd;
+    }
+
+    return -1;
+}
+
+/**
+ * @brief Gives a worker back to its pool once the job that used it ended.
+ *
+ * @param pool Pool of the operation.
+ * @param fd Socket of the worker (see worker_pool_acquire).
+ * @param clean Whether the job ended successfully. Otherwise the worker may be halfway
+ * through the job, so it is replaced by a new one (as is a worker that died).
+ */
+void worker_pool_release(WorkerPool *pool, int fd, bool clean)
+{
+    for (int i = 0; i < pool->size; i++)
+    {
+        Worker *worker = &pool->workers[i];
+        if (worker->fd != fd || !worker->busy) continue;
+
+        worker->busy = false;
+        if (!clean || worker->pid < 0) worker_restart(pool, worker);
+        return;
+    }
+}
+
+/**
+ * @brief Checks if a reaped child was a worker of the pool, which is then replaced.
+ *
+ * @param pool Pool of the operation.
+ * @param pid Reaped child.
+ * @return true, if the child was a worker, false otherwise.
+ */
+bool worker_pool_reap(WorkerPool *pool, pid_t pid)
+{
+    for (int i = 0; i < pool->size; i++)
+    {
+        Worker *worker = &pool->workers[i];
+        if (worker->pid != pid) continue;
+
+        /* A busy worker is restarted when its job releases it (the socket stays open until then,
+        so its descriptor can't be reused by another worker meanwhile). */
+        worker->pid = -1;
+        if (!worker->ready) worker_discard(worker);
+        else if (!worker->busy) worker_restart(pool, worker);
+        return true;
+    }
+
+    return false;
+}
+
+/**
+ * @brief Watches the workers of a pool that are starting: the ones that didn't announce
+ * themselves within WORKER_READY_TIMEOUT are discarded, the sockets of the others are added
+ * to the descriptors polled by the scheduler (see worker_pool_started).
+ *
+ * @param pool Pool of the operation.
+ * @param fds Output, where the descriptors are added (room for WORKER_POOL_MAX of them).
+ * @param now Current time (milliseconds, see monotonic_ms).
+ * @param deadline Lowered to the time the first of those workers is due to be ready (-1 if none yet).
+ * @return Number of descriptors added.
+ */
+int worker_pool_watch(WorkerPool *pool, struct pollfd *fds, long long now, long long *deadline)
+{
+    int fds_len = 0;
+    for (int i = 0; i < pool->size; i++)
+    {
+        Worker *worker = &pool->workers[i];
+        if (worker->ready || worker->fd < 0) continue;
+
+        long long due = worker->spawned + WORKER_READY_TIMEOUT;
+        if (due <= now)
+        {
+            print_error("A restarted worker didn't announce itself, it is not replaced.\n");
+            worker_discard(worker);
+            continue;
+        }
+
+        if (*deadline < 0 || due < *deadline) *deadline = due;
+        fds[fds_len++] = (struct pollfd) {.fd = worker->fd, .events = POLLIN};
+    }
+
+    return fds_len;
+}
+
+/**
+ * @brief Handles the sockets of starting workers that became readable (see worker_pool_watch):
+ * a worker that sent WORKER_READY is given to the jobs from now on, the others are discarded.
+ *
+ * @param pool Pool of the operation.
+ * @param fds Polled descriptors.
+ * @param fds_len Number of polled descriptors.
+ */
+void worker_pool_started(WorkerPool *pool, struct pollfd *fds, int fds_len)
+{
+    for (int i = 0; i < pool->size; i++)
+    {
+        Worker *worker = &pool->workers[i];
+        if (worker->ready || worker->fd < 0) continue;
+
+        for (int j = 0; j < fds_len; j++)
+        {
+            if (fds[j].fd != worker->fd || !fds[j].revents) continue;
+
+            if (!worker_announced(worker)) print_error("A restarted worker didn't announce itself, it is not replaced.\n");
+            break;
+        }
+    }
+}
+
+/**
+ * @brief Runs a job stage on a worker: the input is sent to the worker while its output is
+ * written to 'out_fd', until the worker ends the job. Both directions go on at the same time,
+ * so neither side blocks on a full socket.
+ *
+ * @param worker_fd Socket of the worker (see worker_pool_acquire).
+ * @param job_id Job id.
+ * @param in_fd Input of the stage.
+ * @param out_fd Output of the stage.
+ * @param stats Where the bytes read and written are counted as they go, NULL if they aren't.
+ * @return 0 if the worker executed the job successfully, -1 otherwise.
+ */
+int worker_run(int worker_fd, uint64_t job_id, int in_fd, int out_fd, StageStats *stats)
+{
+    char start[WORKER_HEADER_SIZE + sizeof(job_id)];
+    put_header(start, WORKER_START, sizeof(job_id));
+    memcpy(start + WORKER_HEADER_SIZE, &job_id, sizeof(job_id));
+
+    if (send(worker_fd, start, sizeof(start), MSG_NOSIGNAL) != sizeof(start)) return -1;
+
+    /* Frame being sent to the worker ('sent' bytes of 'pending' already went). */
+    char *outgoing = xmalloc(WORKER_HEADER_SIZE + WORKER_CHUNK_SIZE);
+    char *incoming = xmalloc(WORKER_CHUNK_SIZE);
+    size_t pending = 0, sent = 0;
+    bool input_done = false;
+    int result = -1;
+
+    while (true)
+    {
+        struct pollfd fds[2] =
+        {
+            {.fd = worker_fd, .events = POLLIN | (sent < pending ? POLLOUT : 0)},
+            {.fd = input_done || sent < pending ? -1 : in_fd, .events = POLLIN}
+        };
+
+        if (poll(fds, 2, -1) < 0)
+        {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        if (fds[1].revents)
+        {
+            ssize_t bytes_read = read(in_fd, outgoing + WORKER_HEADER_SIZE, WORKER_CHUNK_SIZE);
+            if (bytes_read < 0) break;
+
+            if (stats) stats->bytes_in += bytes_read;
+            input_done = bytes_read == 0;
+            put_header(outgoing, input_done ? WORKER_END : WORKER_DATA, bytes_read);
+            pending = WORKER_HEADER_SIZE + bytes_read;
+            sent = 0;
+        }
+
+        if (fds[0].revents & POLLOUT)
+        {
+            ssize_t bytes_sent = send(worker_fd, outgoing + sent, pending - sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (bytes_sent < 0 && errno != EAGAIN && errno != EINTR) break;
+            if (bytes_sent > 0) sent += bytes_sent;
+        }
+
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR))
+        {
+            WorkerFrameType type; uint32_t length;
+            if (read_frame(worker_fd, &type, incoming, &length) < 0) break;
+
+            if (type == WORKER_DATA && write_full(out_fd, incoming, length) == 0)
+            {
+                if (stats) stats->bytes_out += length;
+                continue;
+            }
+
+            if (type == WORKER_END && length == 1 && incoming[0] == 0 && input_done && sent == pending) result = 0;
+            break;
+        }
+    }
+
+    free(outgoing);
+    free(incoming);
+    return result;
+}
@@ -0,0 +1,142 @@
+/**
+ * @file worker.c
+ * @author gweebg ; johnny_longo
+ * @brief Reference tool with the worker mode (see worker.c of the server): started as usual it
+ * copies its standard input to its standard output, started with '--worker' it announces itself
+ * and then runs job after job, exchanging frames with the server on its standard input and output.
+ * The data is passed through unchanged, a tool of an operation transforms it in 'transform'.
+ * Built with 'make worker-tool' (obj/tools/worker), to be installed under the name of an
+ * operation executed by a tool (eg. encrypt) in the tools folder given to the server.
+ * @version 0.1
+ * @date 2022-06-02
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../../includes/worker.h"
+
+/**
+ * @brief Transforms a chunk of the data in place (nothing, in this reference tool).
+ *
+ * @param buffer Chunk of the data.
+ * @param size Size of the chunk.
+ * @return 0 on success, -1 if the job fails.
+ */
+static int transform(char *buffer, size_t size)
+{
+    (void) buffer;
+    (void) size;
+
+    return 0;
+}
+
+/**
+ * @brief Reads exactly 'size' bytes.
+ *
+ * @return 0 on success, -1 on error or at the end of the input.
+ */
+static int read_full(int fd, void *buffer, size_t size)
+{
+    for (size_t done = 0; done < size; )
+    {
+        ssize_t bytes_read = read(fd, (char *) buffer + done, size - done);
+        if (bytes_read <= 0) return -1;
+
+        done += bytes_read;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Writes exactly 'size' bytes.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int write_full(int fd, const void *buffer, size_t size)
+{
+    for (size_t done = 0; done < size; )
+    {
+        ssize_t written = write(fd, (const char *) buffer + done, size - done);
+        if (written <= 0) return -1;
+
+        done += written;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Sends a frame to the server.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int send_frame(WorkerFrameType type, const void *payload, uint32_t length)
+{
+    char header[WORKER_HEADER_SIZE] = {0};
+    header[0] = type;
+    memcpy(header + 4, &length, sizeof(length));
+
+    if (write_full(STDOUT_FILENO, header, sizeof(header)) < 0) return -1;
+    return length ? write_full(STDOUT_FILENO, payload, length) : 0;
+}
+
+static char buffer[WORKER_CHUNK_SIZE];
+
+/**
+ * @brief Worker mode: WORKER_READY, then for each job the WORKER_DATA frames are transformed and
+ * sent back, until its WORKER_END, answered with the status of the job. A job that failed still
+ * reads its input to the end, so the next job starts on a frame boundary.
+ *
+ * @return Exit status, once the server closes the socket.
+ */
+static int run_worker()
+{
+    if (send_frame(WORKER_READY, NULL, 0) < 0) return 1;
+
+    unsigned char status = 0;
+    while (true)
+    {
+        char header[WORKER_HEADER_SIZE];
+        if (read_full(STDIN_FILENO, header, sizeof(header)) < 0) return 0;
+
+        uint32_t length;
+        memcpy(&length, header + 4, sizeof(length));
+        if (length > WORKER_CHUNK_SIZE || read_full(STDIN_FILENO, buffer, length) < 0) return 1;
+
+        switch ((unsigned char) header[0])
+        {
+            case WORKER_START:
+                status = 0;
+                break;
+
+            case WORKER_DATA:
+                if (status == 0 && (transform(buffer, length) < 0 || send_frame(WORKER_DATA, buffer, length) < 0)) status = 1;
+                break;
+
+            case WORKER_END:
+                if (send_frame(WORKER_END, &status, sizeof(status)) < 0) return 1;
+                break;
+
+            default:
+                return 1;
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1 && strcmp(argv[1], "--worker") == 0) return run_worker();
+
+    ssize_t bytes_read;
+    while ((bytes_read = read(STDIN_FILENO, buffer, sizeof(buffer))) > 0)
+        if (transform(buffer, bytes_read) < 0 || write_full(STDOUT_FILENO, buffer, bytes_read) < 0) return 1;
+
+    return bytes_read < 0;
+}